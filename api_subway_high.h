@@ -53,6 +53,9 @@ struct Card
 	long request_std(Reader *reader,uint16_t *type = 0);
 	long anticollision(Reader *reader,SerialNumber *sn = 0);
 	long select(Reader *reader);
+	// scan + select, in one exchange when reader firmware has CAP_SCAN_SELECT
+	long activate(Reader *reader);
+	long scan_select(Reader *reader);
 }; // sizeof == 20
 
 // NOTE: operators and methods of sector_t, block_t and SectorBase
@@ -164,6 +167,19 @@ struct Sector
 		uint8_t enc;
 	}; // 50
 
+	// entry of SECTOR_READ_MULTI request and answer, see CardSession::read_sectors
+	struct read_multi_request {
+		uint8_t sector;
+		uint8_t key;
+		uint8_t mode;
+		uint8_t enc;
+	}; //4
+
+	struct read_multi_answer {
+		uint8_t status; // 0 or error code sector read failed with
+		sector_t data;
+	}; //49
+
 	struct set_trailer_request {
 		uint8_t sector;
 		uint8_t key;
@@ -176,4 +192,87 @@ struct Sector
 	}; //7
 };
 
+/*
+ CardSession: card in the field together with reader it is handled through.
+ Reader keeps one sector authenticated at a time, session remembers which one
+ (number, key and mode), so sector commands authenticate only when another sector
+ or key is needed. Any failed command halts the card, so the next one resets it
+ first. NO_CARD and WRONG_CARD (card left or was replaced) invalidate the session,
+ commands fail with NO_CARD until it is opened again.
+ Sectors can also be read and written through write-back cache: read_cached reads
+ only blocks that are not cached yet, write_cached just marks changed blocks dirty
+ and flush writes them in as few bytes on air as possible: BLOCK_WRITE for a single
+ dirty block, SECTOR_WRITE when most blocks are dirty and share encryption.
+ Uncached reads and writes flush dirty blocks of their sector first, so they never see
+ or overwrite stale card contents; writes drop cached copy then. Invalidation drops all.
+ read_sectors reads several sectors in one SECTOR_READ_MULTI exchange when reader
+ firmware offers it, sector by sector otherwise.
+*/
+class CardSession
+{
+	enum {
+		SECTORS = 16,
+		BLOCKS = 3,
+		ALL_BLOCKS = (1 << BLOCKS) - 1,
+		MULTI_SECTORS = 16 // sectors of one SECTOR_READ_MULTI
+	};
+
+	struct CachedSector
+	{
+		sector_t data;
+		uint8_t key;
+		uint8_t mode;
+		uint8_t enc[BLOCKS];
+		uint8_t cached; // bit per block
+		uint8_t dirty;  // bit per block
+	};
+
+	Reader *reader;
+	Card card;
+	bool valid;
+	bool halted;
+	int auth_sector; // -1 when nothing is authenticated
+	uint8_t auth_key;
+	uint8_t auth_mode;
+
+	CachedSector cache[SECTORS];
+
+	long wake();
+	long prepare(Sector *sector);
+	long done(long ret);
+	long read_multi(Sector *sectors, const uint8_t *enc, size_t count, long *results);
+	long drop(Sector *sector);
+	long flush(uint8_t num);
+public:
+	CardSession(Reader *reader);
+
+	// Scans card in the field and starts session with it.
+	long open();
+	void invalidate();
+
+	bool is_valid() const {
+		return valid;
+	}
+
+	Card& get_card() {
+		return card;
+	}
+
+	long authenticate(Sector *sector);
+	long read_block(Sector *sector, uint8_t block, uint8_t enc);
+	long write_block(Sector *sector, uint8_t block, uint8_t enc);
+	long read(Sector *sector, uint8_t enc);
+	long write(Sector *sector, uint8_t enc);
+	// enc is encryption of every sector, results (may be 0) get result of every
+	// sector. All sectors are tried, error of the first one that failed is returned.
+	long read_sectors(Sector *sectors, const uint8_t *enc, size_t count, long *results);
+	long set_trailer(Sector *sector);
+	long set_trailer_dynamic(Sector *sector);
+
+	// enc is encryption of every block
+	long read_cached(Sector *sector, const uint8_t *enc);
+	long write_cached(Sector *sector, const uint8_t *enc);
+	long flush();
+};
+
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "protocol.h"
 #include "custom_combiners.h"
+#include "log.h"
 
 #include <iostream>
 #include <iterator>
@@ -16,7 +17,6 @@
 
 using namespace boost;
 
-static const int log_level = 0;
 
 //define required functions from other modules
 void debug_data(const char* header,void* data,size_t len);
@@ -39,7 +39,7 @@ class AsioImpl : public IOProvider
 	{
 		if (error || !bytes_transferred)
 		{
-			std::cerr << "read callback error:" << error << ": " << error.message() << std::endl;
+			U2_WARN("read callback error:%i: %s",error.value(),error.message().c_str());
 			return;
 		}
 
@@ -65,6 +65,7 @@ class AsioImpl : public IOProvider
 
 	void wait_callback(function<void ()> callback, const system::error_code& error)
 	{
+		trace_instant(error ? "timer_canceled" : "timer_fired",0,error.value());
 		if (error) return;   // Data has been read and this timeout was canceled
 		
 		callback();
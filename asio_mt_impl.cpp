@@ -1,5 +1,6 @@
 #include "protocol.h"
 #include "custom_combiners.h"
+#include "log.h"
 
 #include <iostream>
 #include <iterator>
@@ -29,7 +30,6 @@
 
 using namespace boost;
 
-static const int log_level = 0;
 
 class AsioMTImpl : public IOProvider
 {
@@ -54,7 +54,7 @@ class AsioMTImpl : public IOProvider
 	{
 		if (error || !bytes_transferred)
 		{
-			if(log_level) std::cerr << "read callback error:" << error << ": " << error.message() << std::endl;
+			U2_DEBUG("read callback error:%i: %s",error.value(),error.message().c_str());
 			return;
 		}
 
@@ -81,6 +81,7 @@ class AsioMTImpl : public IOProvider
 
 	void wait_callback(function<void ()> callback, const system::error_code& error)
 	{
+		trace_instant(error ? "timer_canceled" : "timer_fired",0,error.value());
 		if (error) return;   // Data has been read and this timeout was canceled
 		
 		callback();
@@ -129,7 +130,7 @@ public:
 
 	void io_service_thread() {
 		io_svc.run();
-		if(log_level) std::cerr << "io_svc stopped" << std::endl;
+		U2_DEBUG("io_svc stopped");
 		serial.close(); //serial port should be closed from the same thread as io service
 	}
 
@@ -146,14 +147,14 @@ public:
 
 static void disconnector(signals2::connection c)
 {
-	if(log_level) std::cerr << "disconnect" << std::endl;
+	U2_DEBUG("disconnect");
 
 	c.disconnect();
 }
 
 function<void ()> AsioMTImpl::listen(IOProvider::listen_callback callback)
 {
-	if(log_level) std::cerr << "listen" << std::endl;
+	U2_DEBUG("listen");
 
 	signals2::connection c = data_received.connect(callback);
 	return boost::bind(disconnector,c);
@@ -170,7 +171,7 @@ void AsioMTImpl::send(void *data, size_t len,IOProvider::send_callback callback)
 
 long AsioMTImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
 {
-	if(log_level) std::cerr << "set_timeout" << std::endl;
+	U2_DEBUG("set_timeout");
 
 	this->timeout.expires_from_now(posix_time::milliseconds(timeout));
 	this->timeout.async_wait(boost::bind(&AsioMTImpl::wait_callback,this,callback,asio::placeholders::error));
@@ -180,7 +181,7 @@ long AsioMTImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callba
 
 long AsioMTImpl::cancel_timeout()
 {
-	if(log_level) std::cerr << "cancel_timeout" << std::endl;
+	U2_DEBUG("cancel_timeout");
 
 	this->timeout.cancel();
 
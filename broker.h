@@ -0,0 +1,55 @@
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <boost/cstdint.hpp>
+
+using namespace boost;
+
+// Messages exchanged between "broker" IOProvider and u2d over unix socket.
+// Every message is a BrokerMessage header followed by len bytes of payload.
+//
+// client -> u2d:
+//   BROKER_HELLO   - first message of a client, carries its priority;
+//   BROKER_REQUEST - raw bytes that should be written to device;
+//   BROKER_RELEASE - client does not wait for answer of request seq any more.
+// u2d -> client:
+//   BROKER_SENT    - request has been written to device (or failed with error);
+//   BROKER_DATA    - raw bytes that came from device in answer to the request;
+//   BROKER_TIMEOUT - no complete answer came from device in time.
+//
+// Every message but BROKER_HELLO carries seq of the request it belongs to,
+// so late messages of a finished request are not mistaken for the next one.
+
+#define BROKER_HELLO     0x01
+#define BROKER_REQUEST   0x02
+#define BROKER_RELEASE   0x03
+#define BROKER_SENT      0x81
+#define BROKER_DATA      0x82
+#define BROKER_TIMEOUT   0x83
+
+// Requests of high priority clients are always served first,
+// clients of the same priority are served in turns, one request at a time.
+#define BROKER_PRIORITY_HIGH    0
+#define BROKER_PRIORITY_NORMAL  1
+
+#define BROKER_MAX_PAYLOAD      4096
+
+// device timeout of a request whose client decides on its answer only after
+// BROKER_SENT; client releases the request earlier, this guards against a stuck client
+#define BROKER_GUARD_TIMEOUT    10000
+
+#pragma pack(push,1)
+struct BrokerMessage
+{
+	uint8_t type;
+	uint8_t priority; // BROKER_HELLO: priority of this client
+	uint8_t answer;   // BROKER_REQUEST: 1 when answer is expected after write
+	uint8_t pad;
+	uint32_t timeout; // BROKER_REQUEST: answer timeout, miliseconds
+	uint32_t error;   // BROKER_SENT: system error value of device write, 0 on success
+	uint32_t seq;     // sequence number of request, assigned by client
+	uint32_t len;     // length of payload that follows this header
+};
+#pragma pack(pop)
+
+#endif //BROKER_H
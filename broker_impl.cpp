@@ -0,0 +1,333 @@
+#include "protocol.h"
+#include "broker.h"
+#include "custom_combiners.h"
+#include "log.h"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/asio.hpp>
+#include <boost/signals2.hpp>
+#include <boost/throw_exception.hpp>
+
+using namespace boost;
+
+using boost::asio::local::stream_protocol;
+
+
+// Client side of u2d: commands are written to a device owned by broker process.
+// Path is a broker socket path with optional priority:
+// "/var/run/u2d/ttyUSB0.sock?priority=0"
+//
+// Broker writes requests of all its clients to device one by one, so time spent in
+// broker queue should not count towards answer timeout of a protocol. To achieve
+// that, send callback is run only when broker reports that request has actually
+// been written to device; protocol sets its timeout there and local timer is armed.
+// When protocol does not wait for answer or gives up on it, request is released,
+// so broker may go on with the next one.
+//
+// All state lives on io thread: send, set_timeout and cancel_timeout post to it.
+class BrokerImpl : public IOProvider
+{
+	asio::io_service io_svc;
+	stream_protocol::socket socket;
+	asio::io_service::work work;
+	asio::deadline_timer timeout;
+
+	thread io_thread;
+
+	unsigned char read_buf[512];
+	std::vector<uint8_t> incoming;
+	std::deque<std::vector<uint8_t> > outgoing;
+
+	// request in flight, io thread only
+	uint32_t sequence;
+	size_t in_flight_len;
+	bool in_send;
+	size_t answer_timeout;
+	IOProvider::timeout_callback answer_timeout_callback;
+	IOProvider::send_callback in_flight;
+
+	signals2::signal<long (void *data, size_t len), combiner::maximum<long> > data_received;
+
+	void read_callback(size_t bytes_transferred,const system::error_code& error)
+	{
+		if (error || !bytes_transferred)
+		{
+			if(error != asio::error::operation_aborted) {
+				U2_WARN("BrokerImpl: broker connection lost: %s",error.message().c_str());
+				fail_in_flight(error ? error : asio::error::eof);
+			}
+			return;
+		}
+
+		incoming.insert(incoming.end(),read_buf,read_buf + bytes_transferred);
+
+		size_t parsed = 0;
+		while(incoming.size() - parsed >= sizeof(BrokerMessage)) {
+			BrokerMessage *message = (BrokerMessage*)&incoming[parsed];
+			size_t full_size = sizeof(BrokerMessage) + message->len;
+			if(incoming.size() - parsed < full_size) break;
+
+			handle(message,&incoming[parsed] + sizeof(BrokerMessage));
+			parsed += full_size;
+		}
+		incoming.erase(incoming.begin(),incoming.begin() + parsed);
+
+		initiate_read();
+	}
+
+	void handle(BrokerMessage *message, uint8_t *payload)
+	{
+		U2_DEBUG("BrokerImpl::handle %i seq %u",(int)message->type,message->seq);
+
+		if(message->seq != sequence) {
+			U2_DEBUG("BrokerImpl: message of request %u dropped, current %u",message->seq,sequence);
+			return;
+		}
+
+		switch(message->type) {
+		case BROKER_SENT:
+			if(message->error) {
+				fail_in_flight(system::error_code(message->error,system::system_category()));
+			} else {
+				written();
+			}
+			break;
+		case BROKER_DATA:
+			if(data_received.empty()) {
+				unread(payload,message->len);
+			} else {
+				data_received(payload,message->len);
+			}
+			break;
+		case BROKER_TIMEOUT:
+			fire_timeout(sequence);
+			break;
+		default:
+			U2_WARN("BrokerImpl: unknown message %i",(int)message->type);
+			break;
+		}
+	}
+
+	// request is on device: protocol decides here whether it needs an answer and sets its timeout
+	void written()
+	{
+		if(in_flight.empty()) return;
+
+		IOProvider::send_callback callback = in_flight;
+		in_send = true;
+		answer_timeout_callback.clear();
+		long ret = callback(in_flight_len,system::error_code());
+		in_send = false;
+
+		if(ret != 0 || answer_timeout_callback.empty()) {
+			in_flight.clear();
+			answer_timeout_callback.clear();
+			release();
+			return;
+		}
+
+		arm_timeout();
+	}
+
+	void arm_timeout()
+	{
+		timeout.expires_from_now(posix_time::milliseconds(answer_timeout));
+		timeout.async_wait(boost::bind(&BrokerImpl::wait_callback,this,sequence,asio::placeholders::error));
+	}
+
+	void wait_callback(uint32_t current, const system::error_code& error)
+	{
+		if (error) return;   // Data has been read and this timeout was canceled
+
+		if(current != sequence) return;
+		release();
+		fire_timeout(current);
+	}
+
+	void fire_timeout(uint32_t current)
+	{
+		if(current != sequence) return;
+
+		IOProvider::timeout_callback callback = answer_timeout_callback;
+		answer_timeout_callback.clear();
+		in_flight.clear();
+		timeout.cancel();
+		if(!callback.empty()) callback();
+	}
+
+	void fail_in_flight(const system::error_code &error)
+	{
+		if(in_flight.empty()) return;
+
+		IOProvider::send_callback callback = in_flight;
+		in_flight.clear();
+		answer_timeout_callback.clear();
+		timeout.cancel();
+		callback(0,error);
+	}
+
+	void release()
+	{
+		BrokerMessage header = { BROKER_RELEASE };
+		header.seq = sequence;
+		std::vector<uint8_t> message = make_message(header,0,0);
+		write_message(message);
+	}
+
+	void do_send(std::vector<uint8_t> &message, IOProvider::send_callback callback)
+	{
+		if(!in_flight.empty()) release();
+
+		sequence++;
+		((BrokerMessage*)&message[0])->seq = sequence;
+		in_flight = callback;
+		in_flight_len = message.size() - sizeof(BrokerMessage);
+		answer_timeout_callback.clear();
+		timeout.cancel();
+		write_message(message);
+	}
+
+	void do_set_timeout(size_t timeout, IOProvider::timeout_callback callback)
+	{
+		answer_timeout = timeout;
+		answer_timeout_callback = callback;
+
+		// timer is armed by written() when protocol sets timeout from its send callback
+		if(!in_send) arm_timeout();
+	}
+
+	void do_cancel_timeout()
+	{
+		// broker finishes request itself on complete answer, release covers the rest
+		if(!in_flight.empty()) release();
+		answer_timeout_callback.clear();
+		in_flight.clear();
+		timeout.cancel();
+	}
+
+	inline void initiate_read() {
+		namespace ph = boost::asio::placeholders;
+
+		socket.async_read_some(asio::buffer(read_buf),
+			boost::bind(&BrokerImpl::read_callback,this,ph::bytes_transferred,ph::error));
+	}
+
+	void write_message(std::vector<uint8_t> &message) {
+		outgoing.push_back(std::vector<uint8_t>());
+		outgoing.back().swap(message);
+		if(outgoing.size() == 1) initiate_write();
+	}
+
+	void initiate_write() {
+		asio::async_write(socket,asio::buffer(outgoing.front()),
+			boost::bind(&BrokerImpl::write_callback,this,asio::placeholders::error));
+	}
+
+	void write_callback(const system::error_code& error)
+	{
+		outgoing.pop_front();
+		if(error) {
+			U2_WARN("BrokerImpl: write failed: %s",error.message().c_str());
+			outgoing.clear();
+			fail_in_flight(error);
+			return;
+		}
+		if(!outgoing.empty()) initiate_write();
+	}
+
+	static std::vector<uint8_t> make_message(const BrokerMessage &header, const void *data, size_t len) {
+		std::vector<uint8_t> message(sizeof(header) + len);
+		memcpy(&message[0],&header,sizeof(header));
+		if(len) memcpy(&message[sizeof(header)],data,len);
+		return message;
+	}
+
+public:
+	BrokerImpl(const char *path, uint32_t, uint8_t)
+		:socket(io_svc),work(io_svc),timeout(io_svc),sequence(0),in_flight_len(0),in_send(false),answer_timeout(0) {
+
+		std::string socket_path(path);
+		uint8_t priority = BROKER_PRIORITY_NORMAL;
+		size_t query_pos = socket_path.find('?');
+		if(query_pos != std::string::npos) {
+			std::string query = socket_path.substr(query_pos + 1);
+			if(query.compare(0,9,"priority=") == 0) priority = atoi(query.c_str() + 9);
+			socket_path.resize(query_pos);
+		}
+
+		socket.connect(socket_path.c_str());
+
+		BrokerMessage hello = { BROKER_HELLO, priority };
+		asio::write(socket,asio::buffer(&hello,sizeof(hello)));
+
+		initiate_read();
+
+		io_thread = thread(boost::bind(&BrokerImpl::io_service_thread,this));
+	}
+
+	void io_service_thread() {
+		system::error_code e;
+		io_svc.run(e);
+		if(e) U2_WARN("io_svc: %s",e.message().c_str());
+
+		socket.close(e); //socket closed from the same thread as io service
+	}
+
+	virtual ~BrokerImpl() {
+		io_svc.stop();
+		io_thread.join();
+	}
+
+	virtual function<void ()> listen(IOProvider::listen_callback callback);
+	virtual void send(void *data, size_t len, IOProvider::send_callback callback);
+	virtual long set_timeout(size_t timeout, IOProvider::timeout_callback callback);
+	virtual long cancel_timeout();
+};
+
+static void disconnector(signals2::connection c)
+{
+	c.disconnect();
+}
+
+function<void ()> BrokerImpl::listen(IOProvider::listen_callback callback)
+{
+	signals2::connection c = data_received.connect(callback);
+	return boost::bind(disconnector,c);
+}
+
+void BrokerImpl::send(void *data, size_t len,IOProvider::send_callback callback)
+{
+	if(len > BROKER_MAX_PAYLOAD) {
+		callback(0,asio::error::message_size);
+		return;
+	}
+
+	// answer is decided after BROKER_SENT, broker keeps device for us until released
+	BrokerMessage request = { BROKER_REQUEST, 0, 1, 0, BROKER_GUARD_TIMEOUT, 0, 0, (uint32_t)len };
+	std::vector<uint8_t> message = make_message(request,data,len);
+	io_svc.post(boost::bind(&BrokerImpl::do_send,this,message,callback));
+}
+
+long BrokerImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
+{
+	io_svc.dispatch(boost::bind(&BrokerImpl::do_set_timeout,this,timeout,callback));
+	return 0;
+}
+
+long BrokerImpl::cancel_timeout()
+{
+	io_svc.dispatch(boost::bind(&BrokerImpl::do_cancel_timeout,this));
+	return 0;
+}
+
+IOProvider* create_broker_impl(const char* path,uint32_t baud,uint8_t parity)
+{
+	return new BrokerImpl(path,baud,parity);
+}
@@ -2,6 +2,8 @@
 #include "api_subway_high.h"
 #include "protocol.h"
 #include "commands.h"
+#include "card_layout.h"
+#include "card_poller.h"
 
 #include <iostream>
 #include <cstring>
@@ -65,7 +67,43 @@ long Card::anticollision(Reader *reader,SerialNumber *sn) {
 }
 
 long Card::select(Reader *reader) {
-	return reader->send_command<SubwayProtocol>(0,SELECT,sn.sn5(),0);
+	return reader->send_command<SubwayProtocol>(0,SELECT,sn.sn5(),(uint8_t*)0);
+}
+
+#pragma pack(push,1)
+struct scan_select_answer
+{
+	uint16_t type;
+	SerialNumber sn;
+};
+#pragma pack(pop)
+
+long Card::scan_select(Reader *reader) {
+	scan_select_answer answer;
+	memset(&answer,0,sizeof(answer));
+	long ret = reader->send_command<SubwayProtocol>(0,SCAN_SELECT,&answer);
+	if(ret && (ret & ERR_MASK) != PACKET_DATA_LEN_ERROR) {
+		return ret > 0 && ret < ERROR_BASE && ret != NO_COMMAND ? NO_CARD : ret;
+	}
+
+	// serial number comes as in anticollision answer
+	type = answer.type;
+	sn = answer.sn;
+	if(ret) sn.fix();
+	return 0;
+}
+
+long Card::activate(Reader *reader) {
+	if(reader->get_capabilities() & CAP_SCAN_SELECT) {
+		long ret = scan_select(reader);
+		if(ret != NO_COMMAND) return ret;
+
+		// firmware took it back, it is not asked again
+		reader->set_capabilities(reader->get_capabilities() & ~CAP_SCAN_SELECT);
+	}
+
+	CHECK(scan(reader));
+	return select(reader);
 }
 
 /* -------------------------------------------------- */
@@ -120,6 +158,282 @@ long Sector::set_trailer_dynamic(Reader *reader,Card *card) {
 	return reader->send_command<SubwayProtocol>(0,SET_TRAILER_DYN,&request,(uint8_t*)0);
 }
 
+/* -------------------------------------------------- */
+
+CardSession::CardSession(Reader *_reader)
+	:reader(_reader),valid(false),halted(false),auth_sector(-1),auth_key(0),auth_mode(0) {
+	memset(&card,0,sizeof(card));
+	memset(cache,0,sizeof(cache));
+}
+
+long CardSession::open() {
+	invalidate();
+	long ret = card.scan(reader);
+	valid = ret == 0;
+	return ret;
+}
+
+void CardSession::invalidate() {
+	valid = false;
+	halted = false;
+	auth_sector = -1;
+	memset(cache,0,sizeof(cache));
+}
+
+// Uncached write makes cached sector stale. Its pending writes go to the card
+// first, so they are neither lost nor applied after the newer one.
+long CardSession::drop(Sector *sector) {
+	if(sector->num >= SECTORS) return 0;
+	CHECK(flush(sector->num));
+	memset(&cache[sector->num],0,sizeof(CachedSector));
+	return 0;
+}
+
+// Card that answers with an error is halted and has lost its authentication.
+long CardSession::done(long ret) {
+	if(!ret) return 0;
+
+	if(ret == ERROR_NO_CARD || (ret & ERR_MASK) == NO_CARD || ret == WRONG_CARD) {
+		invalidate();
+	} else {
+		halted = true;
+		auth_sector = -1;
+	}
+	return ret;
+}
+
+long CardSession::wake() {
+	if(!valid) return NO_CARD;
+	if(!halted) return 0;
+
+	// card that does not come back is not the one session was opened with
+	long ret = card.reset(reader);
+	if(ret) {
+		invalidate();
+		return ret;
+	}
+	halted = false;
+	return 0;
+}
+
+long CardSession::prepare(Sector *sector) {
+	CHECK(wake());
+
+	if(auth_sector == sector->num && auth_key == sector->key && auth_mode == sector->mode) return 0;
+	return authenticate(sector);
+}
+
+long CardSession::authenticate(Sector *sector) {
+	if(!valid) return NO_CARD;
+
+	auth_sector = -1;
+	long ret = done(sector->authenticate(reader,&card));
+	if(ret) return ret;
+
+	auth_sector = sector->num;
+	auth_key = sector->key;
+	auth_mode = sector->mode;
+	return 0;
+}
+
+long CardSession::read_block(Sector *sector, uint8_t block, uint8_t enc) {
+	if(sector->num < SECTORS) CHECK(flush(sector->num));
+	CHECK(prepare(sector));
+	return done(sector->read_block(reader,block,enc));
+}
+
+long CardSession::write_block(Sector *sector, uint8_t block, uint8_t enc) {
+	CHECK(drop(sector));
+	CHECK(prepare(sector));
+	return done(sector->write_block(reader,block,enc));
+}
+
+long CardSession::read(Sector *sector, uint8_t enc) {
+	if(sector->num < SECTORS) CHECK(flush(sector->num));
+	CHECK(prepare(sector));
+	return done(sector->read(reader,enc));
+}
+
+long CardSession::read_sectors(Sector *sectors, const uint8_t *enc, size_t count, long *results) {
+	long first = 0;
+	size_t i = 0;
+
+	// pending writes go to the card before it is read
+	for(size_t j = 0; j < count; j++) {
+		if(sectors[j].num < SECTORS) CHECK(flush(sectors[j].num));
+	}
+
+	while(count - i > 1 && (reader->get_capabilities() & CAP_SECTOR_READ_MULTI)) {
+		size_t n = std::min(count - i,(size_t)MULTI_SECTORS);
+		long ret = read_multi(sectors + i,enc + i,n,results ? results + i : 0);
+		if(ret == NO_COMMAND) {
+			// firmware took it back, it is not asked again
+			reader->set_capabilities(reader->get_capabilities() & ~CAP_SECTOR_READ_MULTI);
+			break;
+		}
+		if(ret && !first) first = ret;
+		i += n;
+	}
+
+	for(; i < count; i++) {
+		long ret = read(&sectors[i],enc[i]);
+		if(results) results[i] = ret;
+		if(ret && !first) first = ret;
+	}
+	return first;
+}
+
+// Firmware authenticates and reads sectors one after another, the last one stays
+// authenticated. Sector that failed halts the card as a failed command would.
+long CardSession::read_multi(Sector *sectors, const uint8_t *enc, size_t count, long *results) {
+	Sector::read_multi_request request[MULTI_SECTORS];
+	Sector::read_multi_answer answer[MULTI_SECTORS];
+
+	long ret = wake();
+	if(!ret) {
+		for(size_t i = 0; i < count; i++) {
+			Sector::read_multi_request r = { sectors[i].num, sectors[i].key, sectors[i].mode, enc[i] };
+			request[i] = r;
+		}
+
+		auth_sector = -1;
+		ret = reader->send_command<SubwayProtocol>(0,SECTOR_READ_MULTI,request,count * sizeof(*request),
+		                                           answer,count * sizeof(*answer));
+		// unknown command does not reach the card
+		if(ret == NO_COMMAND) return ret;
+		ret = done(ret);
+	}
+	if(ret) {
+		if(results) for(size_t i = 0; i < count; i++) results[i] = ret;
+		return ret;
+	}
+
+	long first = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(results) results[i] = answer[i].status;
+		if(answer[i].status) {
+			if(!first) first = answer[i].status;
+		} else {
+			sectors[i].data = answer[i].data;
+		}
+	}
+	if(first) return done(first);
+
+	auth_sector = sectors[count - 1].num;
+	auth_key = sectors[count - 1].key;
+	auth_mode = sectors[count - 1].mode;
+	return 0;
+}
+
+long CardSession::write(Sector *sector, uint8_t enc) {
+	CHECK(drop(sector));
+	CHECK(prepare(sector));
+	return done(sector->write(reader,enc));
+}
+
+// New trailer takes effect with the next authentication.
+long CardSession::set_trailer(Sector *sector) {
+	CHECK(drop(sector));
+	CHECK(prepare(sector));
+	long ret = done(sector->set_trailer(reader));
+	auth_sector = -1;
+	return ret;
+}
+
+long CardSession::set_trailer_dynamic(Sector *sector) {
+	CHECK(drop(sector));
+	CHECK(prepare(sector));
+	long ret = done(sector->set_trailer_dynamic(reader,&card));
+	auth_sector = -1;
+	return ret;
+}
+
+long CardSession::read_cached(Sector *sector, const uint8_t *enc) {
+	if(sector->num >= SECTORS) return BAD_SECTOR;
+	if(!valid) return NO_CARD;
+
+	CachedSector &c = cache[sector->num];
+	if(c.cached && (c.key != sector->key || c.mode != sector->mode || memcmp(c.enc,enc,BLOCKS))) {
+		// another view of the sector, unless something is waiting to be written
+		if(c.dirty) return CACHE_CONFLICT;
+		memset(&c,0,sizeof(c));
+	}
+	c.key = sector->key;
+	c.mode = sector->mode;
+	memcpy(c.enc,enc,BLOCKS);
+
+	uint8_t missing = ALL_BLOCKS & ~c.cached;
+	if(missing == ALL_BLOCKS && enc[0] == enc[1] && enc[1] == enc[2]) {
+		CHECK(read(sector,enc[0]));
+		c.data = sector->data;
+		c.cached = ALL_BLOCKS;
+	}
+	for(uint8_t block = 0; block < BLOCKS; block++) {
+		if(!(ALL_BLOCKS & ~c.cached & (1 << block))) continue;
+		CHECK(read_block(sector,block,enc[block]));
+		c.data.blocks[block] = sector->data.blocks[block];
+		c.cached |= 1 << block;
+	}
+
+	sector->data = c.data;
+	return 0;
+}
+
+long CardSession::write_cached(Sector *sector, const uint8_t *enc) {
+	if(sector->num >= SECTORS) return BAD_SECTOR;
+	if(!valid) return NO_CARD;
+
+	CachedSector &c = cache[sector->num];
+	for(uint8_t block = 0; block < BLOCKS; block++) {
+		bool same = (c.cached & (1 << block)) && c.enc[block] == enc[block]
+		         && !memcmp(&c.data.blocks[block],&sector->data.blocks[block],sizeof(block_t));
+		if(!same) c.dirty |= 1 << block;
+	}
+	c.data = sector->data;
+	c.key = sector->key;
+	c.mode = sector->mode;
+	memcpy(c.enc,enc,BLOCKS);
+	c.cached = ALL_BLOCKS;
+	return 0;
+}
+
+// Every command costs a round trip and card writes every block it gets, so a single
+// dirty block goes alone and a sector goes at once only when it saves commands.
+long CardSession::flush(uint8_t num) {
+	CachedSector &c = cache[num];
+	if(!c.dirty) return 0;
+
+	Sector sector(num,c.key,c.mode);
+	sector.data = c.data;
+
+	size_t dirty_blocks = 0;
+	for(uint8_t block = 0; block < BLOCKS; block++) dirty_blocks += (c.dirty >> block) & 1;
+
+	if(dirty_blocks > BLOCKS / 2 && c.enc[0] == c.enc[1] && c.enc[1] == c.enc[2]) {
+		CHECK(prepare(&sector));
+		CHECK(done(sector.write(reader,c.enc[0])));
+		c.dirty = 0;
+		return 0;
+	}
+
+	for(uint8_t block = 0; block < BLOCKS; block++) {
+		if(!(c.dirty & (1 << block))) continue;
+		CHECK(prepare(&sector));
+		CHECK(done(sector.write_block(reader,block,c.enc[block])));
+		c.dirty &= ~(1 << block);
+	}
+	return 0;
+}
+
+long CardSession::flush() {
+	if(!valid) return NO_CARD;
+
+	// sector that is authenticated already goes first
+	if(auth_sector >= 0) CHECK(flush(auth_sector));
+	for(uint8_t num = 0; num < SECTORS; num++) CHECK(flush(num));
+	return 0;
+}
+
 /* library interface for card */
 
 EXPORT long card_mfplus_personalize(Reader* reader, Card *card)
@@ -132,6 +446,12 @@ EXPORT long card_scan(Reader *reader, Card *card)
 	return card->scan(reader);
 }
 
+// Scan and select of card, see Card::activate.
+EXPORT long card_activate(Reader *reader, Card *card)
+{
+	return card->activate(reader);
+}
+
 EXPORT long card_reset(Reader *reader, Card *card)
 {
 	return card->reset(reader);
@@ -172,3 +492,189 @@ EXPORT long card_sector_set_trailer_dynamic(Reader *reader, Sector *sector, Card
 	return sector->set_trailer_dynamic(reader,card);
 }
 
+/* library interface for card session */
+
+EXPORT long card_session_open(Reader *reader, CardSession **session)
+{
+	CardSession *s = new CardSession(reader);
+	long ret = s->open();
+	if(ret) {
+		delete s;
+		return ret;
+	}
+	*session = s;
+	return 0;
+}
+
+EXPORT long card_session_close(CardSession *session)
+{
+	delete session;
+	return 0;
+}
+
+// Starts the session over with card that is in the field now.
+EXPORT long card_session_reopen(CardSession *session)
+{
+	return session->open();
+}
+
+EXPORT long card_session_get_card(CardSession *session, Card *card)
+{
+	*card = session->get_card();
+	return session->is_valid() ? 0 : NO_CARD;
+}
+
+EXPORT long card_session_sector_auth(CardSession *session, Sector *sector)
+{
+	return session->authenticate(sector);
+}
+
+EXPORT long card_session_sector_read(CardSession *session, Sector *sector, uint8_t enc)
+{
+	return session->read(sector,enc);
+}
+
+// Reads count sectors, enc and results (may be 0) are arrays of count entries.
+EXPORT long card_session_sectors_read(CardSession *session, Sector *sectors, const uint8_t *enc,
+                                      uint32_t count, long *results)
+{
+	return session->read_sectors(sectors,enc,count,results);
+}
+
+EXPORT long card_session_sector_write(CardSession *session, Sector *sector, uint8_t enc)
+{
+	return session->write(sector,enc);
+}
+
+EXPORT long card_session_block_read(CardSession *session, Sector *sector, uint8_t block, uint8_t enc)
+{
+	return session->read_block(sector,block,enc);
+}
+
+EXPORT long card_session_block_write(CardSession *session, Sector *sector, uint8_t block, uint8_t enc)
+{
+	return session->write_block(sector,block,enc);
+}
+
+// Cached access, enc points to encryption of each of 3 blocks.
+EXPORT long card_session_sector_read_cached(CardSession *session, Sector *sector, const uint8_t *enc)
+{
+	return session->read_cached(sector,enc);
+}
+
+EXPORT long card_session_sector_write_cached(CardSession *session, Sector *sector, const uint8_t *enc)
+{
+	return session->write_cached(sector,enc);
+}
+
+// Writes dirty blocks of all cached sectors.
+EXPORT long card_session_flush(CardSession *session)
+{
+	return session->flush();
+}
+
+EXPORT long card_session_set_trailer(CardSession *session, Sector *sector)
+{
+	return session->set_trailer(sector);
+}
+
+EXPORT long card_session_set_trailer_dynamic(CardSession *session, Sector *sector)
+{
+	return session->set_trailer_dynamic(sector);
+}
+
+/* library interface for card layout */
+
+// Loads layout description (see CardLayout). Returns 0, errno value or EINVAL.
+EXPORT long card_layout_load(const char *path, CardLayout **layout)
+{
+	CardLayout *l = new CardLayout();
+	long ret = l->load(path);
+	if(ret) {
+		delete l;
+		return ret;
+	}
+	*layout = l;
+	return 0;
+}
+
+EXPORT long card_layout_free(CardLayout *layout)
+{
+	delete layout;
+	return 0;
+}
+
+// Compiles comma separated regions of layout (0 - standard one) into plan,
+// names == 0 takes every region.
+EXPORT long card_layout_compile(CardLayout *layout, const char *names, LayoutPlan **plan)
+{
+	LayoutPlan *p = new LayoutPlan();
+	long ret = (layout ? *layout : CardLayout::standard()).compile(names,false,p);
+	if(ret) {
+		delete p;
+		return ret;
+	}
+	*plan = p;
+	return 0;
+}
+
+EXPORT long card_layout_plan_free(LayoutPlan *plan)
+{
+	delete plan;
+	return 0;
+}
+
+// Reads sectors of plan into out (image of the same format as dumps).
+EXPORT long card_layout_plan_read(CardSession *session, LayoutPlan *plan, CardStorage *out)
+{
+	return card_layout_read(session,*plan,out);
+}
+
+/* library interface for card poller */
+
+// Starts watching the field every interval ms (see CardPoller). Without callback
+// events are queued for card_poller_next.
+EXPORT long card_poller_start(Reader *reader, uint32_t interval, uint32_t misses,
+                              card_poll_callback callback, void *context, CardPoller **poller)
+{
+	*poller = new CardPoller(reader,interval,misses,callback,context);
+	return 0;
+}
+
+EXPORT long card_poller_stop(CardPoller *poller)
+{
+	poller->stop();
+	return 0;
+}
+
+// Waits for scan in progress, reader is free for application until resume.
+EXPORT long card_poller_pause(CardPoller *poller)
+{
+	poller->pause();
+	return 0;
+}
+
+EXPORT long card_poller_resume(CardPoller *poller)
+{
+	poller->resume();
+	return 0;
+}
+
+// Takes queued event, waits up to timeout ms for one. Returns 0 or NO_EVENT.
+EXPORT long card_poller_next(CardPoller *poller, uint32_t timeout, card_event *event)
+{
+	return poller->next(event,timeout);
+}
+
+// eventfd that is readable while events are queued.
+EXPORT long card_poller_get_fd(CardPoller *poller, int32_t *fd)
+{
+	*fd = poller->get_fd();
+	return *fd == -1 ? NO_IMPL_SUPPORT : 0;
+}
+
+EXPORT long card_poller_get_stats(CardPoller *poller, card_poller_stats *stats)
+{
+	poller->get_stats(stats);
+	return 0;
+}
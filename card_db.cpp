@@ -0,0 +1,282 @@
+#include "card_db.h"
+#include "stats.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// sn of cards differ in a few low bytes, so they are mixed before masking (splitmix64 finalizer)
+static inline uint64_t sn_hash(uint64_t sn)
+{
+	sn = (sn ^ (sn >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	sn = (sn ^ (sn >> 27)) * 0x94D049BB133111EBULL;
+	return sn ^ (sn >> 31);
+}
+
+static uint64_t slots_for(uint64_t capacity)
+{
+	uint64_t slots = 1;
+	while(slots < 2 * capacity) slots <<= 1;
+	return slots;
+}
+
+static size_t file_size_for(uint64_t capacity)
+{
+	return CARD_DB_HEADER_SIZE + capacity * sizeof(CardStorage) + slots_for(capacity) * sizeof(CardDbSlot);
+}
+
+std::string card_db_sn_name(uint64_t sn)
+{
+	char name[32];
+	snprintf(name,sizeof(name),"%014llX",(unsigned long long)sn);
+	return name;
+}
+
+CardDb::CardDb():fd(-1),readonly(false),base(0),mapped_size(0),mapped_capacity(0),slot_count(0),
+	header(0),records(0),slots(0),private_slots(0),readonly_count(0) {
+}
+
+CardDb::~CardDb() {
+	close();
+}
+
+bool CardDb::is_card_db(const char *path) {
+	int fd = ::open(path,O_RDONLY);
+	if(fd == -1) return false;
+
+	uint32_t magic = 0;
+	bool ret = pread(fd,&magic,sizeof(magic),0) == sizeof(magic) && magic == CARD_DB_MAGIC;
+	::close(fd);
+	return ret;
+}
+
+long CardDb::map(uint64_t capacity) {
+	size_t size = file_size_for(capacity);
+
+	void *p = mmap(0,size,PROT_READ | (readonly ? 0 : PROT_WRITE),MAP_SHARED,fd,0);
+	if(p == MAP_FAILED) return errno;
+
+	base = (uint8_t*)p;
+	mapped_size = size;
+	mapped_capacity = capacity;
+	slot_count = slots_for(capacity);
+	header = (CardDbHeader*)base;
+	records = (CardStorage*)(base + CARD_DB_HEADER_SIZE);
+	slots = (CardDbSlot*)(base + CARD_DB_HEADER_SIZE + capacity * sizeof(CardStorage));
+
+	// records are touched one at a time, readahead around them is wasted
+	madvise(base + CARD_DB_HEADER_SIZE,capacity * sizeof(CardStorage),MADV_RANDOM);
+	return 0;
+}
+
+// Index of read only database is built in anonymous memory.
+long CardDb::map_private_index() {
+	size_t size = slot_count * sizeof(CardDbSlot);
+	void *p = mmap(0,size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+	if(p == MAP_FAILED) return errno;
+
+	private_slots = (CardDbSlot*)p;
+	slots = private_slots;
+	return 0;
+}
+
+// Every lookup probes index at random, and a page fault costs more than the lookup
+// itself, so index is read in at once (sequentially) when database is opened.
+void CardDb::warm_index() {
+	uint64_t start = stats_now();
+
+	static const size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = slot_count * sizeof(CardDbSlot);
+	volatile const uint8_t *p = (const uint8_t*)slots;
+	madvise((void*)slots,size,MADV_WILLNEED);
+	for(size_t i = 0; i < size; i += page) p[i];
+
+	U2_INFO("CardDb: index of %s (%zu MB) read in %llu ms",path.c_str(),size >> 20,(stats_now() - start) / 1000000);
+}
+
+void CardDb::unmap() {
+	if(private_slots) munmap(private_slots,slot_count * sizeof(CardDbSlot));
+	private_slots = 0;
+	if(base) munmap(base,mapped_size);
+	base = 0;
+	mapped_size = 0;
+	mapped_capacity = 0;
+	slot_count = 0;
+	header = 0;
+	records = 0;
+	slots = 0;
+}
+
+long CardDb::open(const char *_path, uint32_t flags) {
+	close();
+
+	path = _path;
+	readonly = flags & CARD_DB_READONLY;
+	int mode = readonly ? O_RDONLY : O_RDWR | (flags & CARD_DB_CREATE ? O_CREAT : 0);
+
+	fd = ::open(_path,mode,0644);
+	struct stat st;
+	if(fd == -1 || fstat(fd,&st)) {
+		long ret = errno;
+		U2_WARN("CardDb: %s: %s",_path,strerror(ret));
+		close();
+		return ret;
+	}
+
+	long ret = 0;
+	if(st.st_size == 0 && !readonly) {
+		// new database
+		if(ftruncate(fd,file_size_for(CARD_DB_MIN_CAPACITY)) || (ret = map(CARD_DB_MIN_CAPACITY))) {
+			if(!ret) ret = errno;
+			U2_WARN("CardDb: %s: %s",_path,strerror(ret));
+			close();
+			return ret;
+		}
+		header->magic = CARD_DB_MAGIC;
+		header->version = CARD_DB_VERSION;
+		header->record_size = sizeof(CardStorage);
+		header->count = 0;
+		header->capacity = CARD_DB_MIN_CAPACITY;
+		header->slots = slots_for(CARD_DB_MIN_CAPACITY);
+		memset(slots,0xFF,slot_count * sizeof(CardDbSlot));
+		header->clean = 1;
+	} else {
+		CardDbHeader h;
+		if(pread(fd,&h,sizeof(h),0) != sizeof(h) || h.magic != CARD_DB_MAGIC || h.version != CARD_DB_VERSION
+		   || h.record_size != sizeof(CardStorage) || h.count > h.capacity || h.slots != slots_for(h.capacity)
+		   || (uint64_t)st.st_size < file_size_for(h.capacity)) {
+			// file may be longer when growth was interrupted before header got new capacity
+			U2_WARN("CardDb: %s is not a card database",_path);
+			close();
+			return EINVAL;
+		}
+		if((ret = map(h.capacity))) {
+			U2_WARN("CardDb: mmap %s: %s",_path,strerror(ret));
+			close();
+			return ret;
+		}
+	}
+
+	if(readonly) {
+		readonly_count = std::min<uint64_t>(__atomic_load_n(&header->count,__ATOMIC_ACQUIRE),mapped_capacity);
+		if((ret = map_private_index())) {
+			U2_WARN("CardDb: %s: %s",_path,strerror(ret));
+			close();
+			return ret;
+		}
+		rebuild();
+	} else if(!header->clean) {
+		U2_WARN("CardDb: %s was not closed cleanly, index is rebuilt",_path);
+		rebuild();
+	} else {
+		warm_index();
+	}
+
+	if(!readonly) {
+		header->clean = 0;
+		msync(base,CARD_DB_HEADER_SIZE,MS_SYNC);
+	}
+
+	U2_INFO("CardDb: %s: %llu cards, capacity %llu",_path,size(),header->capacity);
+	return 0;
+}
+
+void CardDb::close() {
+	if(header && !readonly) {
+		sync();
+		header->clean = 1;
+		msync(base,CARD_DB_HEADER_SIZE,MS_SYNC);
+	}
+	unmap();
+	if(fd != -1) ::close(fd);
+	fd = -1;
+}
+
+uint64_t CardDb::find(uint64_t sn) const {
+	uint64_t mask = slot_count - 1;
+	for(uint64_t i = sn_hash(sn) & mask; ; i = (i + 1) & mask) {
+		const CardDbSlot &slot = slots[i];
+		if(slot.record == CARD_DB_EMPTY) return CARD_DB_EMPTY;
+		if(slot.sn == sn) return slot.record;
+	}
+}
+
+void CardDb::index(uint64_t sn, uint64_t record) {
+	uint64_t mask = slot_count - 1;
+	for(uint64_t i = sn_hash(sn) & mask; ; i = (i + 1) & mask) {
+		CardDbSlot &slot = slots[i];
+		if(slot.record == CARD_DB_EMPTY || slot.sn == sn) {
+			slot.sn = sn;
+			slot.record = record;
+			return;
+		}
+	}
+}
+
+// Index is built from records in insertion order, so later records of the same sn win.
+void CardDb::rebuild() {
+	uint64_t start = stats_now();
+
+	uint64_t count = this->size();
+	size_t size = count * sizeof(CardStorage);
+	madvise(records,size,MADV_SEQUENTIAL);
+	memset(slots,0xFF,slot_count * sizeof(CardDbSlot));
+	for(uint64_t i = 0; i < count; i++) {
+		index(records[i].sn,i);
+	}
+	madvise(records,size,MADV_RANDOM);
+
+	U2_INFO("CardDb: index of %llu cards rebuilt in %llu ms",count,(stats_now() - start) / 1000000);
+}
+
+long CardDb::grow() {
+	uint64_t capacity = header->capacity * 2;
+
+	// file is grown first: header is the last thing to change, and index is not
+	// trusted (clean == 0) while database is open, so a crash in between is harmless
+	if(ftruncate(fd,file_size_for(capacity))) return errno;
+
+	long ret = sync();
+	if(ret) return ret;
+
+	// new mapping is made while the old one is still there, so failure leaves database as it was
+	uint8_t *old_base = base;
+	size_t old_size = mapped_size;
+	if((ret = map(capacity))) return ret;
+	munmap(old_base,old_size);
+
+	header->capacity = capacity;
+	header->slots = slots_for(capacity);
+	rebuild();
+	return 0;
+}
+
+long CardDb::insert(const CardStorage &card) {
+	if(readonly) return EROFS;
+
+	if(header->count == header->capacity) {
+		long ret = grow();
+		if(ret) {
+			U2_WARN("CardDb: cannot grow %s: %s",path.c_str(),strerror(ret));
+			return ret;
+		}
+	}
+
+	uint64_t record = header->count;
+	records[record] = card;
+	index(card.sn,record);
+	__atomic_store_n(&header->count,record + 1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+long CardDb::sync() {
+	if(!header || readonly) return 0;
+	return msync(base,mapped_size,MS_SYNC) ? errno : 0;
+}
@@ -0,0 +1,130 @@
+#ifndef CARD_DB_H
+#define CARD_DB_H
+
+#include "card_storage.h"
+
+#include <string>
+
+#define CARD_DB_MAGIC        0x42445532 // "2UDB"
+#define CARD_DB_VERSION      1
+#define CARD_DB_HEADER_SIZE  4096
+#define CARD_DB_MIN_CAPACITY 1024
+
+// card_db_open flags
+#define CARD_DB_CREATE       1 // create file when it does not exist
+#define CARD_DB_READONLY     2
+
+struct CardDbHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size; // sizeof(CardStorage)
+	uint32_t clean;       // index matches records, cleared while file is open for writing
+	uint64_t count;       // records written, inserts are committed by increment of count
+	uint64_t capacity;    // records that fit before index
+	uint64_t slots;       // index slots, power of two, at least twice capacity
+};
+
+struct CardDbSlot
+{
+	uint64_t sn;
+	uint64_t record;      // CARD_DB_EMPTY for free slot
+};
+
+// Single file store of card images keyed by CardStorage::sn.
+// File layout: header (CARD_DB_HEADER_SIZE), capacity records, open addressing
+// (linear probing) index of slots. Records are only appended; insert of sn that
+// is already there appends a new record and moves index entry to it, so the latest
+// image wins and the old one is left as garbage.
+// Record is written before count is incremented, so a crash never exposes a torn
+// record. Index is trusted only when file was closed cleanly, otherwise it is rebuilt
+// from records on open. When records do not fit, file is grown twice, remapped
+// and the index is rebuilt, so pointers returned by get/lookup are valid until the
+// next insert. Only one process may have a database open for writing.
+// Writer may grow the file under read only openers, and its new records take the
+// place of the old index, so read only opener keeps a private index and sees only
+// records that were there when it opened the database.
+class CardDb
+{
+	std::string path;
+	int fd;
+	bool readonly;
+	uint8_t *base;
+	size_t mapped_size;
+	uint64_t mapped_capacity;  // header may change under read only opener, these do not
+	uint64_t slot_count;
+
+	CardDbHeader *header;
+	CardStorage *records;
+	CardDbSlot *slots;
+	CardDbSlot *private_slots;
+	uint64_t readonly_count;   // records seen by read only opener
+
+	long map(uint64_t capacity);
+	long map_private_index();
+	void unmap();
+	long grow();
+	void rebuild();
+	void index(uint64_t sn, uint64_t record);
+
+	CardDb(const CardDb&);
+	CardDb& operator=(const CardDb&);
+public:
+	static const uint64_t CARD_DB_EMPTY = ~(uint64_t)0;
+
+	CardDb();
+	~CardDb();
+
+	static bool is_card_db(const char *path);
+
+	// Returns 0 or errno value (EINVAL when file is not a card database).
+	long open(const char *path, uint32_t flags);
+	void close();
+
+	bool is_open() const {
+		return header != 0;
+	}
+
+	bool is_readonly() const {
+		return readonly;
+	}
+
+	const std::string& get_path() const {
+		return path;
+	}
+
+	uint64_t size() const {
+		return readonly ? readonly_count : header->count;
+	}
+
+	CardStorage* get(uint64_t record) const {
+		return records + record;
+	}
+
+	// Record number of card with given sn or CARD_DB_EMPTY.
+	uint64_t find(uint64_t sn) const;
+
+	CardStorage* lookup(uint64_t sn) const {
+		uint64_t record = find(sn);
+		return record == CARD_DB_EMPTY ? 0 : records + record;
+	}
+
+	// Latest record of its sn (records replaced by later inserts are not).
+	bool is_current(uint64_t record) const {
+		return find(records[record].sn) == record;
+	}
+
+	// Reads index in, open does it as well.
+	void warm_index();
+
+	// Returns 0 or errno value.
+	long insert(const CardStorage &card);
+
+	// Flushes records and index to disk. Returns 0 or errno value.
+	long sync();
+};
+
+// Hexadecimal sn as card image names and u2db print it.
+std::string card_db_sn_name(uint64_t sn);
+
+#endif //CARD_DB_H
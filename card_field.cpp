@@ -0,0 +1,367 @@
+#include <boost/random/exponential_distribution.hpp>
+#include <boost/random/uniform_int.hpp>
+#include <boost/random/variate_generator.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <cstdlib>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "card_field.h"
+#include "stats.h"
+#include "log.h"
+
+using namespace std;
+
+static const size_t npos = (size_t)-1;
+
+CardField::FieldCard::FieldCard(CardImage *_image, const string &_name)
+	:image(_image),storage(image->get()),name(_name),present(false),state(IDLE),auth(0) {
+}
+
+CardField::CardField(const char *path)
+	:active(0),arrival(0),dwell(300),next_arrival(0),collision_count(0) {
+	start = now();
+
+	struct stat st;
+	bool directory = path && stat(path,&st) == 0 && S_ISDIR(st.st_mode);
+	if(directory) {
+		load_directory(path);
+	} else if(path && CardDb::is_card_db(path)) {
+		load_db(path);
+	}
+
+	if(db) {
+		configure(getenv("U2_FIELD"));
+		if(events.empty() && !arrival && db->size()) {
+			FieldCard &card = cards[db_card(db->find(db->get(0)->sn))];
+			card.present = true;
+			card.state = ACTIVE;
+			active = &card;
+		}
+		return;
+	}
+
+	// directory without images is an empty field, every REQUEST finds no card
+	if(cards.empty() && !directory) {
+		// single card image, it never leaves and is selected from the start
+		cards.push_back(FieldCard(new CardImage(path),path ? path : ""));
+		cards.back().present = true;
+		cards.back().state = ACTIVE;
+		active = &cards.back();
+		return;
+	}
+
+	configure(getenv("U2_FIELD"));
+	if(events.empty() && !arrival) {
+		for(size_t i = 0; i < cards.size(); i++) cards[i].present = true;
+	}
+}
+
+uint64_t CardField::now() const {
+	return stats_now() / 1000000;
+}
+
+void CardField::load_directory(const char *path) {
+	DIR *dir = opendir(path);
+	if(!dir) return;
+
+	vector<string> names;
+	while(struct dirent *entry = readdir(dir)) {
+		string name = entry->d_name;
+		string full = string(path) + "/" + name;
+
+		// anything of card image size is a card image
+		struct stat st;
+		if(stat(full.c_str(),&st) == 0 && S_ISREG(st.st_mode) && st.st_size == sizeof(CardStorage)) {
+			names.push_back(name);
+		}
+	}
+	closedir(dir);
+
+	sort(names.begin(),names.end());
+	for(size_t i = 0; i < names.size(); i++) {
+		cards.push_back(FieldCard(new CardImage((string(path) + "/" + names[i]).c_str()),names[i]));
+	}
+	U2_INFO("CardField: %zu cards in %s",cards.size(),path);
+}
+
+bool CardField::load_db(const char *path) {
+	db.reset(new CardDb());
+	if(db->open(path,0) && db->open(path,CARD_DB_READONLY)) {
+		db.reset();
+		return false;
+	}
+	U2_INFO("CardField: %llu cards in database %s",db->size(),path);
+	return true;
+}
+
+// Card of database record, set up on first use.
+size_t CardField::db_card(uint64_t record) {
+	map<uint64_t,size_t>::iterator i = db_cards.find(record);
+	if(i != db_cards.end()) return i->second;
+
+	cards.push_back(FieldCard(new CardImage(db.get(),record),card_db_sn_name(db->get(record)->sn)));
+	db_cards[record] = cards.size() - 1;
+	return cards.size() - 1;
+}
+
+size_t CardField::find_card(const char *name) {
+	for(size_t i = 0; i < cards.size(); i++) {
+		if(cards[i].name == name) return i;
+	}
+
+	char *end = 0;
+	if(db) {
+		uint64_t sn = strtoull(name,&end,16);
+		uint64_t record = *end ? CardDb::CARD_DB_EMPTY : db->find(sn);
+		if(record != CardDb::CARD_DB_EMPTY) return db_card(record);
+
+		record = strtoull(name,&end,0);
+		return *end || record >= db->size() ? npos : db_card(record);
+	}
+
+	size_t card = strtoul(name,&end,0);
+	return *end || card >= cards.size() ? npos : card;
+}
+
+void CardField::configure(const char *spec) {
+	string s(spec ? spec : "");
+	size_t pos = 0;
+	while(pos < s.size()) {
+		size_t end = s.find(',',pos);
+		if(end == string::npos) end = s.size();
+		string item = s.substr(pos,end - pos);
+		pos = end + 1;
+
+		size_t eq = item.find('=');
+		if(eq == string::npos) {
+			U2_WARN("CardField: bad field spec: %s",item.c_str());
+			continue;
+		}
+		string key = item.substr(0,eq);
+		string value = item.substr(eq + 1);
+
+		if(key == "script") load_script(value.c_str());
+		else if(key == "arrival") arrival = strtoull(value.c_str(),0,0);
+		else if(key == "dwell") dwell = strtoull(value.c_str(),0,0);
+		else if(key == "seed") random.seed((uint32_t)strtoul(value.c_str(),0,0));
+		else U2_WARN("CardField: unknown option: %s",key.c_str());
+	}
+
+	if(arrival) next_arrival = start;
+}
+
+void CardField::load_script(const char *path) {
+	ifstream script(path);
+	if(!script) {
+		U2_ERROR("CardField: cannot open script %s",path);
+		return;
+	}
+
+	string line;
+	size_t line_num = 0;
+	while(getline(script,line)) {
+		line_num++;
+		if(line.empty() || line[0] == '#') continue;
+
+		char action[16] = {0};
+		char name[256] = {0};
+		unsigned long long time = 0;
+		if(sscanf(line.c_str(),"%llu %15s %255s",&time,action,name) != 3) {
+			U2_WARN("CardField: %s:%zu: bad line",path,line_num);
+			continue;
+		}
+
+		size_t card = find_card(name);
+		if(card == npos) {
+			U2_WARN("CardField: %s:%zu: no card %s",path,line_num,name);
+			continue;
+		}
+
+		FieldEvent event = { card, string(action) == "enter" };
+		events.insert(make_pair(start + time,event));
+	}
+}
+
+bool CardField::scheduled(size_t card) const {
+	for(multimap<uint64_t,FieldEvent>::const_iterator e = events.begin(); e != events.end(); ++e) {
+		if(e->second.card == card) return true;
+	}
+	return false;
+}
+
+// Random card that is not in the field and has no events scheduled, npos when none.
+size_t CardField::pick_absent() {
+	if(db) {
+		if(!db->size()) return npos;
+
+		// field holds a handful of cards out of many, so a few tries are enough
+		boost::uniform_int<uint64_t> pick(0,db->size() - 1);
+		for(size_t attempt = 0; attempt < 16; attempt++) {
+			uint64_t record = pick(random);
+			if(!db->is_current(record)) continue;
+
+			size_t card = db_card(record);
+			if(!cards[card].present && !scheduled(card)) return card;
+		}
+		return npos;
+	}
+
+	vector<size_t> absent;
+	for(size_t i = 0; i < cards.size(); i++) {
+		if(!cards[i].present && !scheduled(i)) absent.push_back(i);
+	}
+	if(absent.empty()) return npos;
+
+	boost::uniform_int<size_t> pick(0,absent.size() - 1);
+	return absent[pick(random)];
+}
+
+// Every passenger brings one card that is not in the field yet.
+void CardField::schedule_arrivals(uint64_t until) {
+	boost::exponential_distribution<double> interval(1.0 / arrival);
+	while(next_arrival <= until) {
+		size_t card = pick_absent();
+		if(card != npos) {
+			FieldEvent enter = { card, true }, leave = { card, false };
+			events.insert(make_pair(next_arrival,enter));
+			events.insert(make_pair(next_arrival + dwell,leave));
+		}
+
+		next_arrival += (uint64_t)interval(random) + 1;
+	}
+}
+
+void CardField::move(FieldCard &card, bool enter) {
+	if(card.present == enter) return;
+
+	U2_DEBUG("CardField: %s %s",card.name.c_str(),enter ? "enters" : "leaves");
+	card.present = enter;
+	card.state = IDLE;
+	if(!enter && active == &card) active = 0;
+}
+
+void CardField::update() {
+	if(events.empty() && !arrival) return;
+
+	uint64_t t = now();
+	if(arrival) schedule_arrivals(t);
+
+	while(!events.empty() && events.begin()->first <= t) {
+		FieldEvent event = events.begin()->second;
+		events.erase(events.begin());
+		move(cards[event.card],event.enter);
+	}
+}
+
+bool CardField::request() {
+	update();
+
+	// selected card loses authentication, as after reset
+	if(active) {
+		active->auth = 0;
+		active = 0;
+	}
+
+	bool any = false;
+	for(size_t i = 0; i < cards.size(); i++) {
+		if(cards[i].present) {
+			cards[i].state = READY;
+			any = true;
+		}
+	}
+	return any;
+}
+
+// Reader sends sn bit by bit (byte 0 first, least significant bit first) and
+// takes 1 every time ready cards disagree, like ISO 14443-3 readers do.
+CardStorage* CardField::anticollision() {
+	update();
+
+	vector<FieldCard*> candidates;
+	for(size_t i = 0; i < cards.size(); i++) {
+		if(cards[i].present && cards[i].state == READY) candidates.push_back(&cards[i]);
+	}
+	if(candidates.empty()) return 0;
+
+	const size_t sn_bits = 7 * 8;
+	for(size_t bit = 0; bit < sn_bits && candidates.size() > 1; bit++) {
+		vector<FieldCard*> ones;
+		for(size_t i = 0; i < candidates.size(); i++) {
+			if((candidates[i]->storage->sn >> bit) & 1) ones.push_back(candidates[i]);
+		}
+		if(!ones.empty() && ones.size() != candidates.size()) {
+			collision_count++;
+			candidates.swap(ones);
+		}
+	}
+
+	// the others stay ready and still can be selected
+	active = candidates.front();
+	active->state = ACTIVE;
+
+	return active->storage;
+}
+
+CardStorage* CardField::select(const SN5 &sn5) {
+	update();
+
+	for(size_t i = 0; i < cards.size(); i++) {
+		FieldCard &card = cards[i];
+		if(!card.present || card.state == IDLE) continue;
+		if(memcmp(CardField::sn5(*card.storage).sn,sn5.sn,sizeof(sn5.sn)) != 0) continue;
+
+		if(active && active != &card) active->state = IDLE;
+		active = &card;
+		active->state = ACTIVE;
+		return active->storage;
+	}
+	return 0;
+}
+
+CardStorage* CardField::selected() {
+	update();
+	return active ? active->storage : 0;
+}
+
+CardImage* CardField::selected_image() {
+	update();
+	return active ? active->image.get() : 0;
+}
+
+void CardField::modified(int sector) {
+	if(active) active->image->modified(sector);
+}
+
+bool CardField::authenticated(uint8_t sector) const {
+	return active && (active->auth & (1 << sector));
+}
+
+void CardField::authenticate(uint8_t sector) {
+	if(active) active->auth |= 1 << sector;
+}
+
+void CardField::clear_auth() {
+	if(active) active->auth = 0;
+}
+
+long CardField::load(const char *path) {
+	if(!active) return -1;
+
+	long ret = active->image->load(path);
+	active->storage = active->image->get();
+	return ret;
+}
+
+// The same bytes Card gets from anticollision answer (see SerialNumber::fix).
+SN5 CardField::sn5(const CardStorage &storage) {
+	SerialNumber sn;
+	memset(&sn,0,sizeof(sn));
+	sn.len = 7;
+	memcpy(sn.sn,&storage.sn,sn.len);
+	sn.fix();
+	return *sn.sn5();
+}
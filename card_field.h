@@ -0,0 +1,127 @@
+#ifndef CARD_FIELD
+#define CARD_FIELD
+
+#include "card_storage.h"
+#include "card_db.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/shared_ptr.hpp>
+
+// Set of cards in front of emulated reader (FileImpl).
+// Path is either a card image (the only card, always in the field, as before)
+// or a directory of card images or a card database (see CardDb). Cards come and go
+// as configured by U2_FIELD environment variable, comma separated key=value:
+//   script=file     lines "<ms> enter|leave <image name or index>", cards of database
+//                   are named by hexadecimal sn (or record number),
+//                   time is counted from emulator start
+//   arrival=ms      mean interval between passengers (exponential), each of them
+//                   brings a random card that is not in the field yet
+//   dwell=ms        time a card stays in the field (300 by default)
+//   seed=N          random generator seed (1 by default)
+// Without U2_FIELD all cards of directory stay in the field, of database only the first
+// one does (as single image). Database cards are set up lazily, as they enter the field.
+// Card images are copies or mapped files, see CardImage.
+class CardField
+{
+public:
+	enum card_state {
+		IDLE = 0,   // in the field, waits for request
+		READY,      // answered request, takes part in anticollision
+		ACTIVE      // selected, handles sector commands
+	};
+
+	struct FieldCard
+	{
+		boost::shared_ptr<CardImage> image;
+		CardStorage *storage;
+		std::string name;
+		bool present;
+		uint8_t state;
+		uint32_t auth; // bit per authenticated sector, never goes to image
+
+		FieldCard(CardImage *_image, const std::string &_name);
+	};
+
+	CardField(const char *path);
+
+	// Applies enter/leave events that are due.
+	void update();
+
+	// REQUEST: all cards in the field become ready. Returns false when field is empty.
+	bool request();
+
+	// Bitwise anticollision among ready cards, the one that wins gets selected.
+	CardStorage* anticollision();
+
+	// Selects ready or active card with given 4 bytes of sn and its check byte.
+	CardStorage* select(const SN5 &sn5);
+
+	// Card that sector commands go to, 0 when nothing is selected.
+	CardStorage* selected();
+	CardImage* selected_image();
+
+	// Emulator changed a sector of selected card (CardImage::CARD_IMAGE_ALL - whole card).
+	void modified(int sector);
+
+	// Authentication of selected card, lost on the next request.
+	bool authenticated(uint8_t sector) const;
+	void authenticate(uint8_t sector);
+	void clear_auth();
+
+	// Loads selected card from file, see CardImage::load.
+	long load(const char *path);
+
+	size_t size() const {
+		return db ? db->size() : cards.size();
+	}
+
+	uint64_t collisions() const {
+		return collision_count;
+	}
+
+	static SN5 sn5(const CardStorage &storage);
+
+private:
+	struct FieldEvent
+	{
+		size_t card;
+		bool enter;
+	};
+
+	boost::shared_ptr<CardDb> db;
+	std::map<uint64_t,size_t> db_cards; // record -> card
+
+	// deque keeps active and other card pointers valid while database cards are added
+	std::deque<FieldCard> cards;
+	FieldCard *active;
+
+	std::multimap<uint64_t,FieldEvent> events;
+	uint64_t start;
+
+	// random arrivals, arrival == 0 when disabled
+	boost::mt19937 random;
+	uint64_t arrival;
+	uint64_t dwell;
+	uint64_t next_arrival;
+
+	uint64_t collision_count;
+
+	uint64_t now() const;
+	void load_directory(const char *path);
+	bool load_db(const char *path);
+	size_t db_card(uint64_t record);
+	size_t find_card(const char *name);
+	size_t pick_absent();
+	bool scheduled(size_t card) const;
+	void load_script(const char *path);
+	void configure(const char *spec);
+	void schedule_arrivals(uint64_t until);
+	void move(FieldCard &card, bool enter);
+};
+
+#endif
@@ -0,0 +1,235 @@
+#include "api_subway_low.h"
+#include "card_layout.h"
+#include "card_storage.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+using namespace std;
+
+// Layout every dump used to hardcode; sector 14 holds contract (see term_init).
+static const char builtin_layout[] =
+	"# name    sector key mode    enc       blocks\n"
+	"s1        1      2   static  ff ff ff  all\n"
+	"s2        2      3   static  ff ff ff  all\n"
+	"s3        3      7   static  ff ff ff  all\n"
+	"s4        4      7   static  ff ff ff  all\n"
+	"s5        5      6   static  ff ff ff  all\n"
+	"s9        9      4   static  ff ff ff  all\n"
+	"s10       10     5   static  ff ff ff  all\n"
+	"s11       11     8   static  ff 0a 0a  all\n"
+	"s13       13     27  dynamic 03 03 03  all\n"
+	"contract  14     27  dynamic 03 03 00  all\n";
+
+static bool parse_blocks(const string &s, uint8_t *blocks)
+{
+	if(s == "all") {
+		*blocks = 7;
+		return true;
+	}
+
+	*blocks = 0;
+	const char *p = s.c_str();
+	while(*p) {
+		char *end = 0;
+		unsigned long first = strtoul(p,&end,10), last = first;
+		if(end == p) return false;
+		if(*end == '-') {
+			p = end + 1;
+			last = strtoul(p,&end,10);
+			if(end == p) return false;
+		}
+		if(first > last || last > 2) return false;
+		for(unsigned long b = first; b <= last; b++) *blocks |= 1 << b;
+
+		p = end;
+		if(*p == ',') p++;
+		else if(*p) return false;
+	}
+	return *blocks != 0;
+}
+
+long CardLayout::parse(const char *text) {
+	vector<layout_region> parsed;
+	istringstream in(text);
+	string line;
+	size_t line_num = 0;
+	while(getline(in,line)) {
+		line_num++;
+		size_t hash = line.find('#');
+		if(hash != string::npos) line.erase(hash);
+
+		istringstream fields(line);
+		string name, mode, blocks;
+		unsigned sector, key, enc[3];
+		if(!(fields >> name)) continue;
+		if(!(fields >> sector >> key >> mode >> hex >> enc[0] >> enc[1] >> enc[2] >> dec >> blocks)) {
+			U2_WARN("CardLayout: line %zu: expected name sector key mode enc0 enc1 enc2 blocks",line_num);
+			return EINVAL;
+		}
+
+		layout_region region;
+		region.name = name;
+		region.sector = sector;
+		region.key = key;
+		region.mode = mode == "dynamic" ? Sector::DYNAMIC : Sector::STATIC;
+		for(size_t i = 0; i < 3; i++) region.enc[i] = enc[i];
+		if(sector >= 16 || key > 0xFF || enc[0] > 0xFF || enc[1] > 0xFF || enc[2] > 0xFF
+		   || (mode != "static" && mode != "dynamic") || !parse_blocks(blocks,&region.blocks)) {
+			U2_WARN("CardLayout: line %zu: bad region %s",line_num,name.c_str());
+			return EINVAL;
+		}
+		parsed.push_back(region);
+	}
+
+	regions.swap(parsed);
+	return 0;
+}
+
+long CardLayout::load(const char *path) {
+	ifstream file(path);
+	if(!file) return errno ? errno : ENOENT;
+
+	stringstream text;
+	text << file.rdbuf();
+	long ret = parse(text.str().c_str());
+	if(!ret) U2_INFO("CardLayout: %zu regions loaded from %s",regions.size(),path);
+	return ret;
+}
+
+const layout_region* CardLayout::find(const char *name) const {
+	for(size_t i = 0; i < regions.size(); i++) {
+		if(regions[i].name == name) return &regions[i];
+	}
+	return 0;
+}
+
+uint8_t CardLayout::sector(const char *name, uint8_t fallback) const {
+	const layout_region *region = find(name);
+	return region ? region->sector : fallback;
+}
+
+bool CardLayout::wanted(const layout_region &region, const char *names) const {
+	if(!names) return true;
+
+	string list = string(",") + names + ",";
+	return list.find("," + region.name + ",") != string::npos;
+}
+
+long CardLayout::compile(const char *names, bool whole_sectors, LayoutPlan *plan) const {
+	// sector -> step, map keeps sectors in ascending order
+	map<uint8_t,layout_step> steps;
+	map<uint8_t,uint8_t> known; // blocks of sector with encryption described
+	map<uint8_t,sector_access> sectors;
+
+	for(size_t i = 0; i < regions.size(); i++) {
+		const layout_region &r = regions[i];
+
+		map<uint8_t,sector_access>::iterator s = sectors.find(r.sector);
+		if(s == sectors.end()) {
+			sector_access access = { r.sector, r.key, r.mode, 0, { r.enc[0], r.enc[1], r.enc[2] } };
+			sectors[r.sector] = access;
+			known[r.sector] = r.blocks;
+			continue;
+		}
+
+		sector_access &access = s->second;
+		if(access.key != r.key || access.mode != r.mode) {
+			U2_WARN("CardLayout: %s: sector %u has another key or mode",r.name.c_str(),r.sector);
+			return EINVAL;
+		}
+		for(uint8_t b = 0; b < 3; b++) {
+			if(!(r.blocks & (1 << b))) continue;
+			if((known[r.sector] & (1 << b)) && access.block_enc[b] != r.enc[b]) {
+				U2_WARN("CardLayout: %s: block %u of sector %u has another encryption",r.name.c_str(),b,r.sector);
+				return EINVAL;
+			}
+			access.block_enc[b] = r.enc[b];
+		}
+		known[r.sector] |= r.blocks;
+	}
+
+	for(size_t i = 0; i < regions.size(); i++) {
+		const layout_region &r = regions[i];
+		if(!wanted(r,names)) continue;
+
+		layout_step &step = steps[r.sector];
+		step.access = sectors[r.sector];
+		step.blocks |= whole_sectors ? 7 : r.blocks;
+	}
+
+	plan->clear();
+	for(map<uint8_t,layout_step>::iterator i = steps.begin(); i != steps.end(); ++i) {
+		layout_step step = i->second;
+		const uint8_t *enc = step.access.block_enc;
+
+		// SECTOR_READ decrypts every block with one key, so it replaces block reads
+		// only when no described block of sector is encrypted otherwise
+		size_t count = 0;
+		bool same = true;
+		for(uint8_t b = 0; b < 3; b++) {
+			if(step.blocks & (1 << b)) count++;
+			if((known[i->first] & (1 << b)) && enc[b] != enc[0]) same = false;
+		}
+		if(count > 1 && same && enc[0]) step.access.sector_enc = enc[0];
+
+		plan->push_back(step);
+	}
+	return 0;
+}
+
+const CardLayout& CardLayout::standard() {
+	struct Standard {
+		CardLayout layout;
+		Standard() {
+			const char *path = getenv("U2_CARD_LAYOUT");
+			if(path && layout.load(path) == 0) return;
+			if(path) U2_WARN("CardLayout: cannot load %s, built-in layout is used",path);
+			layout.parse(builtin_layout);
+		}
+	};
+	static const Standard standard;
+	return standard.layout;
+}
+
+long card_layout_read(CardSession *session, const LayoutPlan &plan, CardStorage *out) {
+	// whole sector reads go together, in one exchange where reader can do that
+	vector<Sector> sectors;
+	vector<uint8_t> enc;
+	for(size_t i = 0; i < plan.size(); i++) {
+		const sector_access &a = plan[i].access;
+		if(!a.sector_enc) continue;
+		sectors.push_back(Sector(a.num,a.key,a.mode));
+		enc.push_back(a.sector_enc);
+	}
+	if(!sectors.empty()) CHECK(session->read_sectors(&sectors[0],&enc[0],sectors.size(),0));
+
+	size_t read = 0;
+	for(size_t i = 0; i < plan.size(); i++) {
+		const sector_access &a = plan[i].access;
+		SectorStorage &storage = out->sectors[a.num];
+		Sector sector(a.num,a.key,a.mode);
+
+		if(a.sector_enc) {
+			storage.data = sectors[read++].data;
+			storage.enc[0] = storage.enc[1] = storage.enc[2] = a.sector_enc;
+		} else {
+			for(uint8_t b = 0; b < 3; b++) {
+				if(!(plan[i].blocks & (1 << b))) continue;
+				CHECK(session->read_block(&sector,b,a.block_enc[b]));
+				storage.data.blocks[b] = sector.data.blocks[b];
+				storage.enc[b] = a.block_enc[b];
+			}
+		}
+		storage.num = a.num;
+		storage.key = a.key;
+		storage.mode = a.mode;
+	}
+	return 0;
+}
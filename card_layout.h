@@ -0,0 +1,69 @@
+#ifndef CARD_LAYOUT_H
+#define CARD_LAYOUT_H
+
+#include "key_plan.h"
+
+#include <string>
+#include <vector>
+
+struct CardStorage;
+class CardSession;
+
+// Part of a sector that holds one kind of data (purse, contract, history...).
+struct layout_region
+{
+	std::string name;
+	uint8_t sector;
+	uint8_t key;
+	uint8_t mode;
+	uint8_t enc[3];
+	uint8_t blocks; // bit per block
+};
+
+// One sector of compiled plan: authentication, then either one SECTOR_READ
+// (access.sector_enc != 0) or BLOCK_READ of every block in blocks.
+struct layout_step
+{
+	sector_access access;
+	uint8_t blocks;
+};
+
+typedef std::vector<layout_step> LayoutPlan;
+
+// Card layout described as data instead of code. Text, line per region:
+//   name  sector  key  mode  enc0 enc1 enc2  blocks
+// mode is static or dynamic, enc are hex, blocks are "0-2", "1", "0,2" or "all".
+// Lines starting with # are comments.
+// compile turns regions a reader needs into plan: sectors in ascending order,
+// one authentication per sector whatever number of regions it holds, blocks of a
+// sector merged into one SECTOR_READ when they share encryption.
+// standard() is the layout of U2_CARD_LAYOUT file or built-in one.
+class CardLayout
+{
+	std::vector<layout_region> regions;
+
+	bool wanted(const layout_region &region, const char *names) const;
+public:
+	// Return 0, errno value or EINVAL for malformed text.
+	long load(const char *path);
+	long parse(const char *text);
+
+	const layout_region* find(const char *name) const;
+
+	// Sector of named region or fallback when there is none.
+	uint8_t sector(const char *name, uint8_t fallback) const;
+
+	// names are comma separated, 0 - every region. whole_sectors reads every block
+	// of sectors involved (e.g. for a dump). Returns EINVAL when regions of the same
+	// sector disagree on key, mode or encryption.
+	long compile(const char *names, bool whole_sectors, LayoutPlan *plan) const;
+
+	static const CardLayout& standard();
+};
+
+// Runs plan through session (see CardSession), blocks read and access used go to
+// out sectors. Whole sector steps go first, together (see CardSession::read_sectors),
+// then block reads. Returns error of the first step that failed.
+long card_layout_read(CardSession *session, const LayoutPlan &plan, CardStorage *out);
+
+#endif //CARD_LAYOUT_H
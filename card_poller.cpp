@@ -0,0 +1,213 @@
+#include "card_poller.h"
+#include "protocol.h"
+#include "log.h"
+
+#include <cstring>
+#include <cerrno>
+
+#include <boost/bind.hpp>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+CardPoller::CardPoller(Reader *_reader, uint32_t _interval, uint32_t _misses,
+                       card_poll_callback _callback, void *_context)
+	:reader(_reader),interval(_interval),misses(_misses ? _misses : 1),callback(_callback),context(_context),
+	 stopping(false),paused(false),polling(false),orphaned(false),fd(-1),present(false),missed(0),
+	 poll_count(0),error_count(0),arrival_count(0),departure_count(0),drop_count(0),
+	 started(stats_now()),paused_at(0),paused_time(0) {
+	memset(&card,0,sizeof(card));
+	memset(&latency,0,sizeof(latency));
+#ifndef WIN32
+	if(!callback) {
+		fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+		if(fd == -1) U2_WARN("CardPoller: eventfd: %s",strerror(errno));
+	}
+#endif
+	worker = thread(boost::bind(&CardPoller::run,this));
+}
+
+CardPoller::~CardPoller() {
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		stopping = true;
+		changed.notify_all();
+	}
+	if(worker.joinable()) worker.join();
+#ifndef WIN32
+	if(fd != -1) close(fd);
+#endif
+}
+
+void CardPoller::run() {
+	boost::mutex::scoped_lock lock(mutex);
+	while(!stopping) {
+		if(paused) {
+			changed.wait(lock);
+			continue;
+		}
+
+		polling = true;
+		lock.unlock();
+		poll();
+		lock.lock();
+		polling = false;
+		changed.notify_all();
+
+		// resume and other wakeups do not shorten the interval, only stop does
+		system_time deadline = get_system_time() + posix_time::milliseconds(interval);
+		while(!stopping && changed.timed_wait(lock,deadline));
+	}
+
+	if(orphaned) {
+		lock.unlock();
+		worker.detach();
+		delete this;
+	}
+}
+
+bool CardPoller::on_poller_thread() const {
+	return this_thread::get_id() == worker.get_id();
+}
+
+void CardPoller::stop() {
+	if(on_poller_thread()) {
+		// callback can't join its own thread, run finishes the job
+		boost::mutex::scoped_lock lock(mutex);
+		stopping = true;
+		orphaned = true;
+		return;
+	}
+	delete this;
+}
+
+void CardPoller::poll() {
+	uint64_t start = stats_now();
+
+	Card found;
+	memset(&found,0,sizeof(found));
+	long ret = found.scan(reader);
+	__sync_fetch_and_add(&poll_count,1);
+
+	if(ret && (ret & ERR_MASK) != NO_CARD) {
+		// reader trouble says nothing about the card
+		__sync_fetch_and_add(&error_count,1);
+		U2_DEBUG("CardPoller: scan failed: %08lX",ret);
+		return;
+	}
+
+	if(ret) {
+		if(present && ++missed >= misses) {
+			present = false;
+			emit(CARD_LEFT,card,start);
+		}
+		return;
+	}
+
+	missed = 0;
+	if(present && card.sn == found.sn) return;
+
+	// another card took place of the one that was there
+	if(present) emit(CARD_LEFT,card,start);
+	card = found;
+	present = true;
+	emit(CARD_ARRIVED,card,start);
+}
+
+void CardPoller::emit(uint8_t kind, const Card &from, uint64_t time) {
+	card_event event;
+	event.kind = kind;
+	event.type = from.type;
+	event.sn = from.sn;
+	event.time = time;
+	__sync_fetch_and_add(kind == CARD_ARRIVED ? &arrival_count : &departure_count,1);
+
+	if(callback) {
+		if(kind == CARD_ARRIVED) latency.record(stats_now() - time);
+		callback(&event,context);
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	if(queue.size() == QUEUE_SIZE) {
+		// application does not keep up, the oldest news is the least useful
+		queue.pop_front();
+		__sync_fetch_and_add(&drop_count,1);
+		U2_WARN("CardPoller: event queue is full, oldest event dropped");
+	}
+	queue.push_back(event);
+	changed.notify_all();
+#ifndef WIN32
+	uint64_t one = 1;
+	if(fd != -1 && write(fd,&one,sizeof(one)) != sizeof(one)) {
+		U2_WARN("CardPoller: eventfd write: %s",strerror(errno));
+	}
+#endif
+}
+
+void CardPoller::pause() {
+	boost::mutex::scoped_lock lock(mutex);
+	if(!paused) {
+		paused = true;
+		paused_at = stats_now();
+	}
+	// callback runs inside the poll, waiting for it would never end
+	if(on_poller_thread()) return;
+	while(polling) changed.wait(lock);
+}
+
+void CardPoller::resume() {
+	boost::mutex::scoped_lock lock(mutex);
+	if(!paused) return;
+
+	paused = false;
+	paused_time += stats_now() - paused_at;
+	changed.notify_all();
+}
+
+long CardPoller::next(card_event *event, uint32_t timeout) {
+	boost::mutex::scoped_lock lock(mutex);
+	if(queue.empty() && timeout) {
+		system_time deadline = get_system_time() + posix_time::milliseconds(timeout);
+		while(queue.empty() && changed.timed_wait(lock,deadline));
+	}
+	if(queue.empty()) return NO_EVENT;
+
+	*event = queue.front();
+	queue.pop_front();
+	if(event->kind == CARD_ARRIVED) latency.record(stats_now() - event->time);
+#ifndef WIN32
+	uint64_t count;
+	if(queue.empty() && fd != -1 && read(fd,&count,sizeof(count)) == -1 && errno != EAGAIN) {
+		U2_WARN("CardPoller: eventfd read: %s",strerror(errno));
+	}
+#endif
+	return 0;
+}
+
+void CardPoller::get_stats(card_poller_stats *stats) const {
+	uint64_t now = stats_now();
+	uint64_t idle;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		idle = paused_time + (paused ? now - paused_at : 0);
+	}
+
+	stats->polls = poll_count;
+	stats->errors = error_count;
+	stats->arrivals = arrival_count;
+	stats->departures = departure_count;
+	stats->dropped = drop_count;
+	uint64_t running = now - started - idle;
+	stats->poll_rate = running ? (uint32_t)(poll_count * 1000000000ULL / running) : 0;
+
+	stats->latency.count = latency.count;
+	stats->latency.sum = latency.sum;
+	stats->latency.max = latency.max;
+	stats->latency.p50 = latency.percentile(50);
+	stats->latency.p90 = latency.percentile(90);
+	stats->latency.p99 = latency.percentile(99);
+	stats->latency.p999 = latency.percentile(99.9);
+}
@@ -0,0 +1,121 @@
+#ifndef CARD_POLLER_H
+#define CARD_POLLER_H
+
+#include "api_subway_high.h"
+#include "stats.h"
+
+#include <deque>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+using namespace boost;
+
+class Reader;
+
+// card_event kinds
+#define CARD_ARRIVED  1
+#define CARD_LEFT     2
+
+#pragma pack(push,1)
+struct card_event
+{
+	uint8_t kind;
+	uint16_t type;
+	SerialNumber sn;
+	uint64_t time;     // stats_now() of poll that noticed the change, ns
+};
+
+struct card_poller_stats
+{
+	uint64_t polls;
+	uint64_t errors;      // polls that failed with something other than NO_CARD
+	uint64_t arrivals;
+	uint64_t departures;
+	uint64_t dropped;     // events lost to full queue
+	uint32_t poll_rate;   // polls per second since start, paused time excluded
+	phase_stats latency;  // start of poll that found card -> event handed to application
+};
+#pragma pack(pop)
+
+typedef void (*card_poll_callback)(const card_event *event, void *context);
+
+// Watches the field from its own thread: scans it every interval ms and reports
+// cards that arrived or left, so the application does not have to spin on card_scan.
+// Card is considered gone after misses polls in a row found nothing (one flicker of
+// field does not make it leave and come back). Events go to callback, which runs on
+// poller thread, or, without callback, to a queue read by next; fd is an eventfd
+// that is readable while queue is not empty (for select/poll loops).
+// Poller and application must not talk to reader at the same time: pause stops
+// polling (waits for the scan in progress) before the application reads the card,
+// resume continues where it stopped. Callback may call pause, which does not wait
+// there (the scan is over), and stop, which leaves the poller to its own thread
+// to be deleted when callback returns.
+class CardPoller
+{
+	Reader *reader;
+	uint32_t interval;
+	uint32_t misses;
+	card_poll_callback callback;
+	void *context;
+
+	mutable boost::mutex mutex;
+	boost::condition_variable changed;
+	bool stopping;
+	bool paused;
+	bool polling;
+	bool orphaned;   // stopped from callback, poller thread deletes poller on its way out
+	std::deque<card_event> queue;
+	int fd;
+
+	// poller thread state
+	bool present;
+	uint32_t missed;
+	Card card;
+
+	uint64_t poll_count;
+	uint64_t error_count;
+	uint64_t arrival_count;
+	uint64_t departure_count;
+	uint64_t drop_count;
+	uint64_t started;
+	uint64_t paused_at;
+	uint64_t paused_time;
+	Histogram latency;
+
+	thread worker;
+
+	void run();
+	bool on_poller_thread() const;
+	void poll();
+	void emit(uint8_t kind, const Card &card, uint64_t time);
+
+	CardPoller(const CardPoller&);
+	CardPoller& operator=(const CardPoller&);
+public:
+	static const size_t QUEUE_SIZE = 64;
+
+	CardPoller(Reader *reader, uint32_t interval, uint32_t misses,
+	           card_poll_callback callback, void *context);
+	~CardPoller();
+
+	// Stops polling and deletes poller, see above for calls from callback.
+	void stop();
+
+	void pause();
+	void resume();
+
+	// Takes the oldest queued event, waits for one up to timeout ms.
+	// Returns 0 or NO_EVENT.
+	long next(card_event *event, uint32_t timeout);
+
+	// eventfd of queue, -1 where there is none.
+	int get_fd() const {
+		return fd;
+	}
+
+	void get_stats(card_poller_stats *stats) const;
+};
+
+#endif //CARD_POLLER_H
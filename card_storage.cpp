@@ -5,10 +5,22 @@
 #include <boost/iostreams/device/file.hpp>
 
 #include <ctime>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "card_storage.h"
+#include "card_db.h"
+#include "card_layout.h"
 #include "protocol.h"
 #include "commands.h"
+#include "stats.h"
+#include "log.h"
 
 using namespace std;
 
@@ -17,7 +29,7 @@ using boost::iostreams::file_sink;
 
 SectorStorage::SectorStorage(uint8_t num, uint8_t key, uint8_t mode):Sector(num,key,mode) {
 	enc[0] = enc[1] = enc[2] = 0xFF;
-	status = 0;
+	reserved = 0;
 	memset(pad,0,sizeof(pad));
 }
 
@@ -30,7 +42,7 @@ uint64_t CardStorage::generate_random_sn() {
 	distribution_type distribution(1,(((uint64_t)1) << 63) - 1);
 	gen_type gen(base_gen,distribution);
 	uint64_t random_sn = gen();
-	fprintf(stderr,"random sn: %llX\n",random_sn);
+	U2_INFO("random sn: %llX",random_sn);
 
 	return random_sn;		
 }
@@ -51,7 +63,7 @@ long CardStorage::load(const char *path) {
 	file_source src(path,BOOST_IOS::binary);
 	streamsize bytes_read = src.read((char*)this,sizeof(*this));
 	long ret = bytes_read != sizeof(*this);
-	fprintf(stderr,"FileImpl load[%s] -> [%i][%s]\n",path,bytes_read,ret ? "FAIL" : "OK");
+	U2_INFO("FileImpl load[%s] -> [%i][%s]",path,bytes_read,ret ? "FAIL" : "OK");
 	return ret;
 }
 
@@ -59,10 +71,157 @@ long CardStorage::save(const char *path) {
 	file_sink dst(path,BOOST_IOS::binary);
 	streamsize bytes_written = dst.write((char*)this,sizeof(*this));
 	long ret = bytes_written != sizeof(*this);
-	fprintf(stderr,"FileImpl save[%s] -> [%i][%s]\n",path,bytes_written,ret ? "FAIL" : "OK");
+	U2_INFO("FileImpl save[%s] -> [%i][%s]",path,bytes_written,ret ? "FAIL" : "OK");
+	return ret;
+}
+
+// U2_CARD_SYNC policy, otherwise interval in ms
+enum {
+	CARD_SYNC_OFF = -2,   // images are not mapped
+	CARD_SYNC_NEVER = -1,
+	CARD_SYNC_ALWAYS = 0
+};
+
+static long parse_card_sync(const char *policy)
+{
+	if(!policy) return CARD_SYNC_OFF;
+	if(!strcmp(policy,"always")) return CARD_SYNC_ALWAYS;
+	if(!strcmp(policy,"never")) return CARD_SYNC_NEVER;
+	return strtol(policy,0,0);
+}
+
+static long card_sync_interval()
+{
+	static const long interval = parse_card_sync(getenv("U2_CARD_SYNC"));
+	return interval;
+}
+
+CardImage::CardImage(const char *_path):storage(0),path(_path ? _path : ""),db(0),mapped(false),dirty(0) {
+	last_sync = stats_now() / 1000000;
+
+	if(_path && card_sync_interval() != CARD_SYNC_OFF) storage = map(_path);
+	if(!storage) storage = new CardStorage(_path);
+}
+
+CardImage::CardImage(CardDb *_db, uint64_t record)
+	:storage(_db->get(record)),path(_db->get_path()),db(_db),mapped(true),dirty(0) {
+	last_sync = stats_now() / 1000000;
+
+	// records of read only database are not writable, card gets a copy
+	if(db->is_readonly()) {
+		storage = new CardStorage(*storage);
+		db = 0;
+		mapped = false;
+	}
+}
+
+CardImage::~CardImage() {
+	if(db) return;
+
+	if(mapped) {
+		sync();
+		munmap(storage,sizeof(*storage));
+	} else {
+		delete storage;
+	}
+}
+
+CardStorage* CardImage::map(const char *path) {
+	int fd = open(path,O_RDWR | O_CREAT,0644);
+	struct stat st;
+	if(fd == -1 || fstat(fd,&st)) {
+		U2_WARN("CardImage: %s: %s",path,strerror(errno));
+		if(fd != -1) close(fd);
+		return 0;
+	}
+
+	if(st.st_size == 0) {
+		// new image
+		CardStorage fresh;
+		if(write(fd,&fresh,sizeof(fresh)) != sizeof(fresh)) {
+			U2_WARN("CardImage: %s: %s",path,strerror(errno));
+			close(fd);
+			return 0;
+		}
+	} else if(st.st_size != sizeof(CardStorage)) {
+		U2_WARN("CardImage: %s is not a card image, it is not mapped",path);
+		close(fd);
+		return 0;
+	}
+
+	void *p = mmap(0,sizeof(CardStorage),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		U2_WARN("CardImage: mmap %s: %s",path,strerror(errno));
+		return 0;
+	}
+
+	mapped = true;
+	return (CardStorage*)p;
+}
+
+void CardImage::modified(int sector) {
+	if(!mapped || db) return;
+
+	dirty |= sector == CARD_IMAGE_ALL ? ~(uint32_t)0 : 1 << sector;
+
+	long interval = card_sync_interval();
+	if(interval == CARD_SYNC_NEVER) return;
+	if(interval && stats_now() / 1000000 - last_sync < (uint64_t)interval) return;
+	sync();
+}
+
+long CardImage::sync() {
+	if(db) return db->sync();
+	if(!mapped || !dirty) return 0;
+
+	static const size_t page = sysconf(_SC_PAGESIZE);
+	uint8_t *base = (uint8_t*)storage;
+	const int sectors = sizeof(storage->sectors)/sizeof(*storage->sectors);
+
+	// header (-1) and sectors in file order, adjacent dirty pages are flushed together
+	long ret = 0;
+	size_t first = 0, last = 0;
+	bool pending = false;
+	for(int i = -1; i < sectors; i++) {
+		if(!(dirty & (1 << (i < 0 ? CARD_IMAGE_HEADER : i)))) continue;
+
+		size_t begin = i < 0 ? 0 : (uint8_t*)&storage->sectors[i] - base;
+		size_t end = i < 0 ? (uint8_t*)storage->sectors - base : begin + sizeof(SectorStorage);
+		size_t begin_page = begin / page, end_page = (end - 1) / page;
+		if(pending && begin_page <= last + 1) {
+			last = std::max(last,end_page);
+			continue;
+		}
+
+		if(pending && msync(base + first * page,(last - first + 1) * page,MS_SYNC)) ret = errno;
+		first = begin_page;
+		last = end_page;
+		pending = true;
+	}
+	if(pending && msync(base + first * page,(last - first + 1) * page,MS_SYNC)) ret = errno;
+
+	if(ret) U2_WARN("CardImage: msync %s: %s",path.c_str(),strerror(ret));
+	dirty = 0;
+	last_sync = stats_now() / 1000000;
 	return ret;
 }
 
+long CardImage::load(const char *from) {
+	if(mapped) {
+		CardStorage *copy = new CardStorage(*storage);
+		if(!db) {
+			sync();
+			munmap(storage,sizeof(*storage));
+		}
+		storage = copy;
+		db = 0;
+		mapped = false;
+		dirty = 0;
+	}
+	return storage->load(from);
+}
+
 /*
 def clear(card,sectors):
  def clear_sector(num,key,mode):
@@ -80,78 +239,118 @@ def clear(card,sectors):
 [(1,2,s),(2,3,s),(3,7,s),(4,7,s),(5,6,s),(9,4,s),(10,5,s),(11,8,s)]
 */
 
-struct sector_access
-{
-	uint8_t num;
-	uint8_t key;
-	uint8_t mode;
-	uint8_t sector_enc; //if this is equals to 0, then by-block reading should be used with block_enc
-	uint8_t block_enc[3];
-};
+// Blank sector every card falls back to when its own key does not fit.
+static const sector_access blank_access = { 0, 0, Sector::STATIC, 0xFF };
 
-static long card_sector_auth_tenacious(Reader* reader,Card *card,Sector *sector)
+// Authenticates sector and reads it in as few commands as access allows:
+// one SECTOR_READ when all blocks share encryption, BLOCK_READ per block otherwise.
+// Key, mode and encryption end up in sector, so FileImpl serves it the same way.
+static long card_sector_dump(Reader *reader, Card *card, SectorStorage *sector, const sector_access *A)
 {
+	sector->key = A->key;
+	sector->mode = A->mode;
+
 	long ret = sector->authenticate(reader,card);
-	if(ret || sector->read_block(reader,0,0xFF)) {
-		if(sector->key) {
-			sector->key = 0;
-			return card_sector_auth_tenacious(reader,card,sector);
-		} else {
-			return ERROR_READ;
-		}		
+	if(ret) return ret;
+
+	if(A->sector_enc) {
+		sector->enc[0] = sector->enc[1] = sector->enc[2] = A->sector_enc;
+		return sector->read(reader,A->sector_enc);
 	}
 
+	for(uint8_t block = 0; block < 3; block++) {
+		sector->enc[block] = A->block_enc[block];
+		if((ret = sector->read_block(reader,block,A->block_enc[block]))) return ret;
+	}
 	return 0;
 }
 
-long Reader::save(const char *path)
+// Dumps sectors of compiled layout into storage. Sectors set in *unreadable (bit per
+// sector) are skipped; sectors that cannot be read with their own key nor as blank
+// ones are added there. Failed authentication halts a card, so it is reset, but only
+// when another command follows. Card must be scanned already.
+// Returns error of the last sector that failed.
+static long card_dump(Reader *reader, Card *card, CardStorage *storage,
+                      const LayoutPlan &plan, uint32_t *unreadable)
 {
-	if(!impl) return NO_IMPL;
+	// sn as anticollision answered it, see CardField::sn5
+	storage->sn = 0;
+	memcpy(&storage->sn,&card->sn.sn[sizeof(card->sn.sn) - 1 - card->sn.len],std::min<size_t>(card->sn.len,7));
 
-	ISaveLoadable *save_load = dynamic_cast<ISaveLoadable*>(impl);
-	if(save_load) return save_load->save(path);
+	KeyPlanCache &plans = reader->get_key_plans();
+
+	long ret = 0, result = 0;
+	bool halted = false;
+	for(size_t i = 0; i < plan.size(); i++) {
+		const sector_access *A = &plan[i].access;
+		if(*unreadable & (1 << A->num)) continue;
+
+		SectorStorage *sector = storage->sectors + A->num;
+		sector->num = A->num;
+
+		// what worked for this card type last time, then configured access, then blank
+		sector_access planned, blank = blank_access;
+		blank.num = A->num;
+		bool has_plan = plans.find(card->type,A->num,&planned);
+
+		const sector_access *attempts[3];
+		size_t attempt_count = 0;
+		if(has_plan) attempts[attempt_count++] = &planned;
+		if(!has_plan || memcmp(&planned,A,sizeof(planned))) attempts[attempt_count++] = A;
+		if(memcmp(&blank,A,sizeof(blank)) && (!has_plan || memcmp(&planned,&blank,sizeof(blank)))) {
+			attempts[attempt_count++] = &blank;
+		}
+
+		size_t j = 0;
+		for(; j < attempt_count; j++) {
+			if(halted && (ret = card->reset(reader))) return ret;
+			halted = (ret = card_sector_dump(reader,card,sector,attempts[j])) != 0;
+			if(!ret) break;
+		}
+
+		if(has_plan) plans.count(!ret && j == 0);
+		if(!ret && (!has_plan || j)) plans.learn(card->type,*attempts[j]);
+		if(ret && has_plan) plans.forget(card->type,A->num);
+
+		if(ret) {
+			U2_WARN("dump: sector %u is unreadable [%lX]",A->num,ret);
+			*sector = SectorStorage(A->num);
+			*unreadable |= 1 << A->num;
+			result = ret;
+		}
+	}
+
+	return result;
+}
+
+long Reader::dump(const char *path, uint32_t *unreadable)
+{
+	if(!impl) return NO_IMPL;
 
 	Card card;
 	long ret = card.scan(this);
 	if(ret) return ret;
 
-	sector_access access[] = {
-		{ 1, 2, Sector::STATIC , 0xFF},
-		{ 2, 3, Sector::STATIC , 0xFF},
-		{ 3, 7, Sector::STATIC , 0xFF},
-		{ 4, 7, Sector::STATIC , 0xFF},
-		{ 5, 6, Sector::STATIC , 0xFF},
-		{ 9, 4, Sector::STATIC , 0xFF},
-		{10, 5, Sector::STATIC , 0xFF},
-		{11, 8, Sector::STATIC ,    0, {0xFF, 0xA, 0xA} },
-		{13,27, Sector::DYNAMIC,    3, },
-		{14,27, Sector::DYNAMIC,    0, { 0x3, 0x3,   0} }
-	};
+	LayoutPlan plan;
+	if((ret = CardLayout::standard().compile(0,true,&plan))) return ret;
 
 	CardStorage storage;
-	for(size_t i = 0; i < sizeof(access)/sizeof(*access); i++) {
-		sector_access *A = access + i;
+	uint32_t skip = unreadable ? *unreadable : 0;
+	ret = card_dump(this,&card,&storage,plan,&skip);
+	if(unreadable) *unreadable = skip;
 
-		Sector *sector = storage.sectors + A->num;
-		sector->num = A->num;
-		sector->key = A->key;
-		sector->mode = A->mode;
-		
-		long ret = card_sector_auth_tenacious(this,&card,sector);
-		if(ret) return ret;
-
-		//if any of enc modes != 0xFF then we should use by-block reading
-		if(A->sector_enc) {
-			sector->read(this,A->sector_enc);
-		} else {
-			for(uint8_t block = 0; i < 3; i++) {
-				sector->read_block(this,block,A->block_enc[block]);
-			}
-		}
-		
-	}
+	if(storage.save(path)) return IO_ERROR;
+	return ret;
+}
+
+long Reader::save(const char *path)
+{
+	if(!impl) return NO_IMPL;
+
+	ISaveLoadable *save_load = dynamic_cast<ISaveLoadable*>(impl);
+	if(save_load) return save_load->save(path);
 
-	return NO_IMPL_SUPPORT;	
+	return dump(path,0);
 }
 
 long Reader::load(const char *path)
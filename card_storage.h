@@ -3,15 +3,14 @@
 
 #include "api_subway_high.h"
 
+#include <string>
+
+class CardDb;
+
 struct SectorStorage : public Sector
 {
-	 enum auth_status {
-		NO_AUTH = 0,
-		AUTHENTICATED = 1
-	};
-
 	uint8_t enc[3]; // encryption keys for every block, reading or writing whole sector assumes enc[0] 
-	uint8_t status; // 0 - no authentication, 1 - authenticated
+	uint8_t reserved; // was authentication status, emulator keeps it in CardField now
 	uint8_t pad[9];
 
 	SectorStorage(uint8_t num = 0, uint8_t key = 0, uint8_t mode = STATIC);
@@ -31,4 +30,59 @@ struct CardStorage
 	long save(const char *path);
 };
 
+// Card image the emulator works with. By default it is a copy of file contents
+// that is written back only by save. When U2_CARD_SYNC is set, image file is
+// mapped instead (created if missing), so emulator writes go straight to the page.
+// Sectors changed since the last sync are tracked and msync'ed as U2_CARD_SYNC says:
+//   always   after every write command
+//   N        at most once in N ms, checked on write commands
+//   never    only on close, until then kernel writes pages back on its own
+// Image can be a record of card database as well (see CardDb), it is synced with
+// the whole database (or copied when database is read only).
+class CardImage
+{
+	CardStorage *storage;
+	std::string path;
+	CardDb *db;
+	bool mapped;
+	uint32_t dirty; // bit per sector, CARD_IMAGE_HEADER for sn
+	uint64_t last_sync;
+
+	CardStorage* map(const char *path);
+
+	CardImage(const CardImage&);
+	CardImage& operator=(const CardImage&);
+public:
+	enum {
+		CARD_IMAGE_HEADER = 16,
+		CARD_IMAGE_ALL = -1
+	};
+
+	CardImage(const char *path);
+	CardImage(CardDb *db, uint64_t record);
+	~CardImage();
+
+	CardStorage* get() const {
+		return storage;
+	}
+
+	bool is_mapped() const {
+		return mapped;
+	}
+
+	const std::string& get_path() const {
+		return path;
+	}
+
+	// Emulator changed a sector (CARD_IMAGE_ALL - whole image).
+	void modified(int sector);
+
+	// Flushes dirty sectors of mapped image to disk. Returns errno of msync.
+	long sync();
+
+	// Loads card from file. Mapped image (file or database record) is turned into
+	// a copy first, so its file or database record is left as is.
+	long load(const char *path);
+};
+
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#define ERROR_NO_CARD         1
 #define ERROR_READ            8
 #define ERROR_WRITE           9
 #define ERROR_VALUE          11
@@ -16,10 +17,17 @@
 #define SYNC_WITH_DEVICE	 0x05
 #define UPDATE_START         0x06
 
+//GET_VERSION request byte that asks for capabilities after version string,
+//firmware that does not know it ignores request and answers version only
+#define VERSION_CAPS         0x01
+#define CAP_SCAN_SELECT          0x00000001
+#define CAP_SECTOR_READ_MULTI    0x00000002
+
 //card
 #define ANTICOLLISION        0x22
 #define REQUEST_STD          0x40
 #define SELECT               0x43
+#define SCAN_SELECT          0x4A //extended: REQUEST_STD + ANTICOLLISION + SELECT
 #define AUTH                 0x44
 #define AUTH_DYN             0xBB
 #define BLOCK_READ           0xBC
@@ -28,6 +36,7 @@
 #define SECTOR_WRITE         0xBF
 #define SET_TRAILER          0xC0
 #define SET_TRAILER_DYN      0xC1
+#define SECTOR_READ_MULTI    0xC2 //extended: AUTH + SECTOR_READ of several sectors
 #define MFPLUS_PERSO         0x23
 
 #endif
\ No newline at end of file
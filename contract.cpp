@@ -1,6 +1,7 @@
 #include "api_subway_low.h"
 #include "api_subway_high.h"
 #include "protocol.h"
+#include "card_layout.h"
 
 #include <iostream>
 
@@ -110,7 +111,7 @@ EXPORT void term_init(MFSTD1KContractStatic302h* term, term_init_args* init)
 	term->Block0.ContractFields.AID = init->aid;
 	term->Block0.ContractFields.PIX = init->pix;
 	term->Block0.ContractFields.SaleAID = (init->aid & 0xF0F);
-	term->Block0.ContractFields.ContractDataPointer = 14;
+	term->Block0.ContractFields.ContractDataPointer = CardLayout::standard().sector("contract",14);
 	term->Block0.ContractFields.ContractStatus = init->status;
 	term->Block0.ContractFields.TransportType = (init->pix >> 3) & 0x1F; // select 6 bits from PIX
 	term->Block1.ContractFields.ValiditionModel = 2;
@@ -1,5 +1,6 @@
 #include "protocol.h"
 #include "custom_combiners.h"
+#include "log.h"
 
 #include <iostream>
 #include <iterator>
@@ -20,12 +21,13 @@
 
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include <cp210x.h>
 
 using namespace boost;
 
-static const int log_level = getenv("DEBUG_CP210X_IMPL") != 0;
 
 class Timeout
 {
@@ -37,12 +39,12 @@ class Timeout
 	static uint64_t get_tick_count() {
 		struct timespec ts;
 		if(clock_gettime(CLOCK_MONOTONIC,&ts) != 0) {
-			perror("clock_gettime");
+			U2_ERROR("clock_gettime: %s",strerror(errno));
 		}
 		
 		uint64_t v = ts.tv_sec * 1000 + ts.tv_nsec / 1e6;
 		
-		if(log_level) fprintf(stderr,"get_tick_count() = %lli\n",v);				
+		U2_DEBUG("get_tick_count() = %lli",v);				
 		
 		return v;
 	}
@@ -108,7 +110,7 @@ public:
 	}	
 
 	virtual ~CP210XImpl() {
-		if(log_level) std::cerr << "~CP210XImpl" << std::endl;
+		U2_DEBUG("~CP210XImpl");
 	}
 	
 	virtual function<void ()> listen(IOProvider::listen_callback callback);
@@ -119,14 +121,14 @@ public:
 
 static void disconnector(signals2::connection c)
 {
-	if(log_level) std::cerr << "disconnect" << std::endl;
+	U2_DEBUG("disconnect");
 
 	c.disconnect();
 }
 
 function<void ()> CP210XImpl::listen(IOProvider::listen_callback callback)
 {
-	if(log_level) std::cerr << "listen" << std::endl;
+	U2_DEBUG("listen");
 
 	auto recv_handler = [=](int status, void *data, size_t len) {
 		if(!this->timeout.check()) {
@@ -144,7 +146,7 @@ function<void ()> CP210XImpl::listen(IOProvider::listen_callback callback)
 void CP210XImpl::send(void *data, size_t len,IOProvider::send_callback callback) 
 {
 	int ret = device.send_async(data,len,[=](int status,size_t len) {
-		if(log_level) std::cerr << "CP210XImpl::data_sent" << std::endl;
+		U2_DEBUG("CP210XImpl::data_sent");
 		
 		if(!callback(len,system::error_code(status ? EIO : 0,system::system_category()))) {
 			this->device.recv_async();
@@ -169,7 +171,7 @@ void CP210XImpl::send(void *data, size_t len,IOProvider::send_callback callback)
 
 long CP210XImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
 {
-	if(log_level) std::cerr << "set_timeout" << std::endl;
+	U2_DEBUG("set_timeout");
 
 	this->timeout.set(timeout,callback);
 
@@ -178,7 +180,7 @@ long CP210XImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callba
 
 long CP210XImpl::cancel_timeout()
 {
-	if(log_level) std::cerr << "cancel_timeout" << std::endl;
+	U2_DEBUG("cancel_timeout");
 
 	this->timeout.cancel();
 
@@ -2,6 +2,7 @@
 #define __CRC16_H__
 
 #include <boost/cstdint.hpp>
+#include <cstddef>
 using namespace boost;
 
 extern unsigned char CRC16_High, CRC16_Low;
@@ -16,5 +17,19 @@ unsigned char CRC16_CheckBlock(unsigned char *Block);
 
 uint8_t CheckDataCRC16(void *data, uint8_t DataSize,int low_endian = 0);
 
+// Reentrant CRC16 that gives the same value as CRC16_Calc leaves in
+// CRC16_High:CRC16_Low, without global state and length limit.
+// Incremental use: crc = crc16_update(crc,byte) for every byte starting with CRC16_INIT.
+#define CRC16_INIT 0xFFFF
+
+extern const uint16_t CRC16_Table[256];
+
+inline uint16_t crc16_update(uint16_t crc, uint8_t c)
+{
+	return (uint16_t)((crc << 8) ^ CRC16_Table[(crc >> 8) ^ c]);
+}
+
+uint16_t crc16(const void *buffer, size_t len);
+
 #endif// __CRC16_H__
 
@@ -0,0 +1,305 @@
+#include "protocol.h"
+#include "subway_protocol.h"
+#include "custom_combiners.h"
+#include "stats.h"
+#include "log.h"
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/signals2.hpp>
+
+using namespace boost;
+
+
+static void disconnector(signals2::connection c)
+{
+	c.disconnect();
+}
+
+static void sleep_us(uint64_t us)
+{
+	if(us) this_thread::sleep(posix_time::microseconds(us));
+}
+
+// How often a fault is injected: either with a probability at every opportunity
+// (byte, chunk or exchange, depending on fault) or at every period-th one ("@N").
+struct FaultRate
+{
+	double probability;
+	uint64_t period;
+	uint64_t opportunities;
+	uint64_t injected;
+
+	FaultRate():probability(0),period(0),opportunities(0),injected(0) {
+	}
+
+	void parse(const std::string &value) {
+		if(!value.empty() && value[0] == '@') {
+			period = strtoull(value.c_str() + 1,0,0);
+		} else {
+			probability = strtod(value.c_str(),0);
+		}
+	}
+
+	bool active() const {
+		return probability > 0 || period;
+	}
+};
+
+// Wraps another IOProvider and spoils what comes from the device, so timeouts and
+// retries can be tuned against a bad link that behaves the same way every run.
+// Faults are configured by U2_FAULT environment variable, comma separated key=value:
+//   seed=N              random generator seed (1 by default)
+//   latency=us          delay before the first chunk of every answer
+//   jitter=us           random addition to latency, 0..jitter
+//   drop=R              drops a byte
+//   flip=R              flips a random bit of a byte
+//   fbgn=R              inserts spurious FBGN into a chunk
+//   truncate=R          cuts a chunk and loses the rest of the answer
+//   duplicate=R         delivers a chunk twice
+//   silence=R           loses the whole answer
+// R is a probability (0.01) or a period (@100 - every 100th byte/chunk/answer).
+// Answer that comes later than timeout is lost as well. Timeouts are watched here
+// too (a bit later than inner timer would fire), so lost answers end with timeout
+// even with inner providers that have no timer (file).
+class FaultImpl : public IOProvider
+{
+	IOProvider *inner;
+	function<void ()> disconnect;
+
+	uint64_t random_state;
+	uint64_t latency;
+	uint64_t jitter;
+	FaultRate drop, flip, fbgn, truncate, duplicate, silence;
+
+	// send bumps exchange on caller thread; received notices the change on
+	// io thread and starts a new exchange there, silenced is io thread only
+	uint32_t exchange;
+	uint32_t seen_exchange;
+	bool silenced;
+
+	boost::mutex timeout_mutex;
+	boost::condition_variable timeout_changed;
+	uint64_t deadline;
+	IOProvider::timeout_callback timeout_callback;
+	bool stopping;
+	thread watchdog;
+
+	std::vector<uint8_t> chunk;
+
+	signals2::signal<long (void *data, size_t len), combiner::maximum<long> > data_received;
+
+	// splitmix64
+	uint64_t random() {
+		uint64_t z = (random_state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	bool hit(FaultRate &rate) {
+		if(!rate.active()) return false;
+
+		rate.opportunities++;
+		bool h = rate.period ? rate.opportunities % rate.period == 0
+		                     : (random() >> 11) * (1.0 / 9007199254740992.0) < rate.probability;
+		if(h) rate.injected++;
+		return h;
+	}
+
+	void configure(const char *spec) {
+		std::string s(spec ? spec : "");
+		size_t pos = 0;
+		while(pos < s.size()) {
+			size_t end = s.find(',',pos);
+			if(end == std::string::npos) end = s.size();
+			std::string item = s.substr(pos,end - pos);
+			pos = end + 1;
+
+			size_t eq = item.find('=');
+			if(eq == std::string::npos) {
+				U2_WARN("FaultImpl: bad fault spec: %s",item.c_str());
+				continue;
+			}
+			std::string key = item.substr(0,eq);
+			std::string value = item.substr(eq + 1);
+
+			if(key == "seed") random_state = strtoull(value.c_str(),0,0);
+			else if(key == "latency") latency = strtoull(value.c_str(),0,0);
+			else if(key == "jitter") jitter = strtoull(value.c_str(),0,0);
+			else if(key == "drop") drop.parse(value);
+			else if(key == "flip") flip.parse(value);
+			else if(key == "fbgn") fbgn.parse(value);
+			else if(key == "truncate") truncate.parse(value);
+			else if(key == "duplicate") duplicate.parse(value);
+			else if(key == "silence") silence.parse(value);
+			else U2_WARN("FaultImpl: unknown fault: %s",key.c_str());
+		}
+	}
+
+	long deliver(void *data, size_t len) {
+		if(!len) return 0;
+
+		if(data_received.empty()) {
+			unread(data,len);
+			return 0;
+		}
+		return data_received(data,len);
+	}
+
+	void fire_timeout() {
+		IOProvider::timeout_callback callback;
+		{
+			boost::mutex::scoped_lock lock(timeout_mutex);
+			callback.swap(timeout_callback);
+			deadline = 0;
+		}
+		if(!callback.empty()) callback();
+	}
+
+	void watch() {
+		static const uint64_t GRACE = 10000000; // ns
+
+		boost::mutex::scoped_lock lock(timeout_mutex);
+		while(!stopping) {
+			uint64_t now = stats_now();
+			if(!deadline) {
+				timeout_changed.wait(lock);
+			} else if(now < deadline + GRACE) {
+				timeout_changed.timed_wait(lock,posix_time::microseconds((deadline + GRACE - now) / 1000 + 1));
+			} else {
+				lock.unlock();
+				fire_timeout();
+				lock.lock();
+			}
+		}
+	}
+
+	// The rest of answer is lost. Everything is read and dropped until timeout,
+	// so it does not turn up as an answer to the next command.
+	long expire() {
+		silenced = true;
+		return 0;
+	}
+
+	long received(void *data, size_t len) {
+		uint32_t current = __atomic_load_n(&exchange,__ATOMIC_ACQUIRE);
+		bool first_chunk = current != seen_exchange;
+		if(first_chunk) {
+			seen_exchange = current;
+			silenced = false;
+		}
+
+		if(silenced) return expire();
+
+		if(first_chunk) {
+			if(hit(silence)) return expire();
+
+			uint64_t delay = latency + (jitter ? random() % (jitter + 1) : 0);
+			if(delay) {
+				uint64_t until;
+				{
+					boost::mutex::scoped_lock lock(timeout_mutex);
+					until = deadline;
+				}
+				if(until && stats_now() + delay * 1000 >= until) return expire();
+				sleep_us(delay);
+			}
+		}
+
+		chunk.resize(len + 1);
+		uint8_t *src = (uint8_t*)data;
+		size_t out = 0;
+		for(size_t i = 0; i < len; i++) {
+			if(hit(drop)) continue;
+			uint8_t c = src[i];
+			if(hit(flip)) c ^= 1 << (random() % 8);
+			chunk[out++] = c;
+		}
+
+		if(hit(fbgn)) {
+			size_t at = random() % (out + 1);
+			memmove(&chunk[at + 1],&chunk[at],out - at);
+			chunk[at] = FBGN;
+			out++;
+		}
+
+		bool truncated = hit(truncate);
+		if(truncated) out = out ? random() % out : 0;
+
+		// second copy that comes after complete answer is dropped by protocol or
+		// left unread and discarded before the next command
+		long ret = deliver(&chunk[0],out);
+		if(hit(duplicate)) deliver(&chunk[0],out);
+
+		if(truncated && !ret) return expire();
+		return ret;
+	}
+
+public:
+	FaultImpl(IOProvider *_inner, const char *spec)
+		:inner(_inner),random_state(1),latency(0),jitter(0),exchange(0),seen_exchange(0),silenced(false),
+		 deadline(0),stopping(false) {
+		configure(spec);
+		U2_INFO("FaultImpl: %s",spec ? spec : "no faults");
+
+		disconnect = inner->listen(boost::bind(&FaultImpl::received,this,_1,_2));
+		watchdog = thread(boost::bind(&FaultImpl::watch,this));
+	}
+
+	virtual ~FaultImpl() {
+		{
+			boost::mutex::scoped_lock lock(timeout_mutex);
+			stopping = true;
+		}
+		timeout_changed.notify_all();
+		watchdog.join();
+
+		disconnect();
+		delete inner;
+
+		U2_INFO("FaultImpl: injected drop[%llu] flip[%llu] fbgn[%llu] truncate[%llu] duplicate[%llu] silence[%llu]",
+			drop.injected,flip.injected,fbgn.injected,truncate.injected,duplicate.injected,silence.injected);
+	}
+
+	virtual function<void ()> listen(IOProvider::listen_callback callback) {
+		signals2::connection c = data_received.connect(callback);
+		return boost::bind(disconnector,c);
+	}
+
+	virtual void send(void *data, size_t len, IOProvider::send_callback callback) {
+		__atomic_add_fetch(&exchange,1,__ATOMIC_RELEASE);
+		inner->send(data,len,callback);
+	}
+
+	virtual long set_timeout(size_t timeout, IOProvider::timeout_callback callback) {
+		{
+			boost::mutex::scoped_lock lock(timeout_mutex);
+			timeout_callback = callback;
+			deadline = stats_now() + (uint64_t)timeout * 1000000;
+		}
+		timeout_changed.notify_all();
+		return inner->set_timeout(timeout,boost::bind(&FaultImpl::fire_timeout,this));
+	}
+
+	virtual long cancel_timeout() {
+		{
+			boost::mutex::scoped_lock lock(timeout_mutex);
+			timeout_callback.clear();
+			deadline = 0;
+		}
+		return inner->cancel_timeout();
+	}
+};
+
+IOProvider* create_fault_impl(IOProvider *inner, const char *spec)
+{
+	return inner ? new FaultImpl(inner,spec) : 0;
+}
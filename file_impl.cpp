@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <map>
 #include <string>
 
 #include <cstring>
@@ -8,32 +7,38 @@
 
 #include "protocol.h"
 #include "subway_protocol.h"
-#include "card_storage.h"
+#include "card_field.h"
 #include "commands.h"
 #include "api_subway_high.h"
 #include "custom_combiners.h"
+#include "log.h"
 
 #define CARD_TYPE_STANDARD   0x4
 #define CARD_TYPE_ULTRALIGHT 0x44
 
 using namespace boost;
 
-const int log_level = 0;
 
 
 
 class FileImpl : public IOProvider, public ISaveLoadable
 {
 	typedef uint8_t (FileImpl::*command_handler)(void* in,size_t in_len,void* out,size_t *out_len);
-	typedef std::map<uint8_t,command_handler> HandlerMap;
-	HandlerMap handlers;
+	command_handler handlers[256];
 
-	CardStorage storage;	
+	CardField field;
+
+	// scratch buffers reused by every request, nothing is zeroed:
+	// handlers get exact request length and report exact answer length
+	uint8_t request_buf[MAX_PACKET_SIZE];
+	uint8_t answer_buf[MAX_PACKET_DATA];
+	uint8_t response_buf[MAX_BYTESTAFFED_PACKET];
 
 	signals2::signal<long (void *data, size_t len),combiner::maximum<long> > data_received;
 public:
 
-	FileImpl(const char* path,uint32_t baud,uint8_t):storage(path) {
+	FileImpl(const char* path,uint32_t baud,uint8_t):field(path) {
+		for(size_t i = 0; i < 256; i++) handlers[i] = 0;
 
 		handlers[GET_SN]          = &FileImpl::get_sn;
 		handlers[GET_VERSION]     = &FileImpl::get_version;
@@ -41,78 +46,81 @@ public:
 		handlers[FIELD_OFF]       = &FileImpl::field_off;
 		handlers[REQUEST_STD]     = &FileImpl::request_std;
 		handlers[ANTICOLLISION]   = &FileImpl::anticollision;
+		handlers[SELECT]          = &FileImpl::select;
+		handlers[SCAN_SELECT]     = &FileImpl::scan_select;
 		handlers[AUTH]            = &FileImpl::auth;
 		handlers[AUTH_DYN]        = &FileImpl::auth_dyn;
 		handlers[BLOCK_READ]      = &FileImpl::block_read;
 		handlers[BLOCK_WRITE]     = &FileImpl::block_write;
 		handlers[SECTOR_READ]     = &FileImpl::sector_read;
 		handlers[SECTOR_WRITE]    = &FileImpl::sector_write;
+		handlers[SECTOR_READ_MULTI] = &FileImpl::sector_read_multi;
 		handlers[SET_TRAILER]     = &FileImpl::set_trailer;
 		handlers[SET_TRAILER_DYN] = &FileImpl::set_trailer_dyn;
 
 	}
 
 	virtual ~FileImpl() {
-		
+		if(field.size() > 1) U2_INFO("FileImpl: %llu anticollision rounds",field.collisions());
 	}
 
 	virtual long load(const char *path) {
-		return storage.load(path);
+		if(!field.selected()) return NO_CARD;
+
+		return field.load(path);
 	}
 
 	virtual long save(const char *path) {
-		return storage.save(path);
+		CardImage *image = field.selected_image();
+		if(!image) return NO_CARD;
+
+		// mapped image only needs its dirty sectors flushed
+		if(image->is_mapped() && image->get_path() == path) return image->sync();
+		return image->get()->save(path);
 	}
 
 	virtual void send(void *data, size_t len, IOProvider::send_callback callback) 
 	{
-		uint8_t ret = NO_COMMAND;
-		uint8_t request_buf[256] = {0};
-		size_t request_buf_len = unbytestaff(request_buf,sizeof(request_buf),data,len);
+		bool crc_ok = false;
+		size_t request_len = unbytestaff_packet(request_buf,sizeof(request_buf),data,len,&crc_ok);
 		
 		PacketHeader* header = (PacketHeader*)request_buf;
 		system::error_code err;
-		if(request_buf_len < header->full_size()) {
+		if(request_len < sizeof(PacketHeader) || request_len < header->header_size()
+		   || request_len < header->full_size()) {
 			err.assign(system::errc::protocol_error,system::generic_category());
 		}
 
 		if(callback(len,err) != 0) return;
 
-		uint8_t data_buf[256] = {0};
-		size_t data_buf_len = sizeof(data_buf);
-		if(header->crc_check()) {
-			HandlerMap::const_iterator handler = handlers.find(header->code);
-			if(handler != handlers.end()) {
-				ret = (this->*(handler->second))(header->data(),header->len,data_buf,&data_buf_len);		
+		uint8_t ret = NO_COMMAND;
+		size_t answer_len = sizeof(answer_buf);
+		if(crc_ok) {
+			command_handler handler = handlers[header->code];
+			if(handler) {
+				ret = (this->*handler)(header->data(),header->data_len(),answer_buf,&answer_len);
 			}
 		} else {
 			ret = CRC_ERROR;
 		}
 		
-		uint8_t packet[256] = {0};
-		size_t packet_len = 0;
-		if(ret) {
-			packet_len = create_custom_packet(packet,sizeof(packet),0,NACK_BYTE,&ret,sizeof(ret));
-		} else {
-			packet_len = create_custom_packet(packet,sizeof(packet),0,header->code,data_buf,data_buf_len);
-		}
-
-		uint8_t response[512] = {0};
-		size_t response_len = bytestaff(response,sizeof(response),packet,packet_len);
+		size_t response_len = ret
+			? bytestaff_packet(response_buf,sizeof(response_buf),0,NACK_BYTE,&ret,sizeof(ret))
+			: bytestaff_packet(response_buf,sizeof(response_buf),0,header->code,answer_buf,answer_len);
 
-		data_received(response,response_len);
+		data_received(response_buf,response_len);
 	}
 
 	static void disconnector(signals2::connection c)
 	{
-		if(log_level) std::cerr << "FileImpl::disconnector" << std::endl;
+		U2_DEBUG("FileImpl::disconnector");
 
 		c.disconnect();
 	}
 
 	function<void ()> listen(IOProvider::listen_callback callback)
 	{
-		if(log_level) std::cerr << "FileImpl::listen" << std::endl;
+		U2_DEBUG("FileImpl::listen");
 
 		signals2::connection c = data_received.connect(callback);
 		return boost::bind(disconnector,c);
@@ -120,13 +128,13 @@ public:
 
 	virtual long set_timeout(size_t time, function<void ()> callback)
 	{
-		if(log_level) std::cerr << "FileImpl::set_timeout" << std::endl;
+		U2_DEBUG("FileImpl::set_timeout");
 		return 0;
 	}
 
 	virtual long cancel_timeout()
 	{
-		if(log_level) std::cerr << "FileImpl::cancel_timeout" << std::endl;
+		U2_DEBUG("FileImpl::cancel_timeout");
 		return 0;
 	}
 
@@ -146,8 +154,15 @@ public:
 
 	uint8_t get_version(void* in,size_t in_len,void* out,size_t *out_len) {
 		static const char version[7] = "F01";
-		*out_len = std::min(*out_len,sizeof(version));
-		memcpy(out,version,*out_len);
+		static const uint32_t capabilities = CAP_SCAN_SELECT | CAP_SECTOR_READ_MULTI;
+
+		uint8_t answer[sizeof(version) + sizeof(capabilities)];
+		memcpy(answer,version,sizeof(version));
+		memcpy(answer + sizeof(version),&capabilities,sizeof(capabilities));
+
+		size_t len = in_len && *(uint8_t*)in == VERSION_CAPS ? sizeof(answer) : sizeof(version);
+		*out_len = std::min(*out_len,len);
+		memcpy(out,answer,*out_len);
 		return 0;
 	}
 
@@ -162,38 +177,65 @@ public:
 	}
 
 	uint8_t request_std(void* in,size_t in_len,void* out,size_t *out_len) {
+		if(!field.request()) return ERROR_NO_CARD;
+
 		static const uint16_t type = CARD_TYPE_STANDARD;
 		return make_answer(type,out,out_len);
 	}
 
 	uint8_t anticollision(void* in,size_t in_len,void* out,size_t *out_len) {
+		CardStorage *storage = field.anticollision();
+		if(!storage) return ERROR_NO_CARD;
+
 		const size_t sn_len = 7;
 		uint8_t answer[2 + sn_len] = {0, sn_len };
-		memcpy(&answer[2],&storage.sn,sn_len);
+		memcpy(&answer[2],&storage->sn,sn_len);
 		
 		*out_len = std::min(*out_len,sizeof(answer));
 		memcpy(out,answer,*out_len);
 		return 0;
 	}	
 
-	void clear_card_auth() {
-		for(size_t i = 0;i < sizeof(storage.sectors)/sizeof(SectorStorage); i++) {
-			storage.sectors[i].status = SectorStorage::NO_AUTH;
-		}
+	uint8_t select(void* in,size_t in_len,void* out,size_t *out_len) {
+		if(in_len < sizeof(SN5)) return ERROR_VALUE;
+		if(!field.select(*(SN5*)in)) return ERROR_NO_CARD;
+
+		*out_len = 0;
+		return 0;
+	}
+
+	// request_std, anticollision and select of the card that won it
+	uint8_t scan_select(void* in,size_t in_len,void* out,size_t *out_len) {
+		if(!field.request()) return ERROR_NO_CARD;
+		CardStorage *storage = field.anticollision();
+		if(!storage || !field.select(CardField::sn5(*storage))) return ERROR_NO_CARD;
+
+		static const uint16_t type = CARD_TYPE_STANDARD;
+		const size_t sn_len = 7;
+		uint8_t answer[sizeof(type) + 2 + sn_len] = {0};
+		memcpy(answer,&type,sizeof(type));
+		answer[sizeof(type) + 1] = sn_len;
+		memcpy(&answer[sizeof(type) + 2],&storage->sn,sn_len);
+
+		*out_len = std::min(*out_len,sizeof(answer));
+		memcpy(out,answer,*out_len);
+		return 0;
 	}
 
 	uint8_t auth(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::auth_request *request = (Sector::auth_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_NO_CARD;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 			
-		clear_card_auth();
+		field.clear_auth();
 
-		SectorStorage* sector = storage.sectors + request->sector;
+		SectorStorage* sector = storage->sectors + request->sector;
 
 		//fprintf(stderr,"sector[%i] mode[%i]\n",request->sector,sector->mode);
 		if(sector->mode == SectorStorage::STATIC && sector->key == request->key) {
-			sector->status = SectorStorage::AUTHENTICATED;
-			//fprintf(stderr,"sector[%i] status[%i]\n",request->sector,sector->status);
+			field.authenticate(request->sector);
 		}
 
 		*out_len = 0;
@@ -202,14 +244,16 @@ public:
 
 	uint8_t auth_dyn(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::auth_request *request = (Sector::auth_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_NO_CARD;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 
-		clear_card_auth();
+		field.clear_auth();
 
-		SectorStorage* sector = storage.sectors + request->sector;
+		SectorStorage* sector = storage->sectors + request->sector;
 		if(sector->mode == SectorStorage::DYNAMIC && sector->key == request->key) {
-			sector->status = SectorStorage::AUTHENTICATED;
-			//fprintf(stderr,"sector[%i] status[%i]\n",request->sector,sector->status);
+			field.authenticate(request->sector);
 		}
 
 		*out_len = 0;
@@ -218,12 +262,14 @@ public:
 
 	uint8_t block_read(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::read_block_request *request = (Sector::read_block_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_READ;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 		if(request->block >= sizeof(sector_t)/sizeof(block_t)) return ERROR_VALUE;
 
-		SectorStorage* sector = storage.sectors + request->sector;
-		//fprintf(stderr,"key[%i] status[%i]\n",sector->key,sector->status);
-		if(!sector->status) return ERROR_READ;
+		SectorStorage* sector = storage->sectors + request->sector;
+		if(!field.authenticated(request->sector)) return ERROR_READ;
 		if(request->enc != sector->enc[request->block]) return ERROR_READ;
 		
 		return make_answer((*sector)[request->block],out,out_len);		
@@ -231,68 +277,125 @@ public:
 
 	uint8_t block_write(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::write_block_request *request = (Sector::write_block_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_WRITE;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 		if(request->block >= sizeof(sector_t)/sizeof(block_t)) return ERROR_VALUE;
 		
-		SectorStorage* sector = storage.sectors + request->sector;
-		if(!sector->status) return ERROR_WRITE;
+		SectorStorage* sector = storage->sectors + request->sector;
+		if(!field.authenticated(request->sector)) return ERROR_WRITE;
 		
 		sector->enc[request->block] = request->enc;
 		(*sector)[request->block] = request->data;
 		
+		field.modified(request->sector);
+
 		*out_len = 0;
 		return 0;
 	}
 
 	uint8_t sector_read(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::read_sector_request *request = (Sector::read_sector_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_READ;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 
-		SectorStorage* sector = storage.sectors + request->sector;
-		if(!sector->status) return ERROR_READ;
+		SectorStorage* sector = storage->sectors + request->sector;
+		if(!field.authenticated(request->sector)) return ERROR_READ;
 		if(request->enc != sector->enc[0]) return ERROR_READ;
 
-		return make_answer(storage.sectors[request->sector].data,out,out_len);
+		return make_answer(storage->sectors[request->sector].data,out,out_len);
+	}
+
+	// every sector is authenticated and read as AUTH/AUTH_DYN + SECTOR_READ would do,
+	// the one that fails gets its error code and does not stop the others
+	uint8_t sector_read_multi(void* in,size_t in_len,void* out,size_t *out_len) {
+		Sector::read_multi_request *request = (Sector::read_multi_request*)in;
+		Sector::read_multi_answer *answer = (Sector::read_multi_answer*)out;
+		size_t count = in_len / sizeof(*request);
+		if(!count || in_len % sizeof(*request) || count * sizeof(*answer) > *out_len) return ERROR_VALUE;
+
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_NO_CARD;
+
+		for(size_t i = 0; i < count; i++) {
+			const Sector::read_multi_request &r = request[i];
+			answer[i].status = ERROR_VALUE;
+			memset(&answer[i].data,0,sizeof(answer[i].data));
+			if(r.sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) continue;
+
+			field.clear_auth();
+			SectorStorage* sector = storage->sectors + r.sector;
+			uint8_t mode = r.mode ? SectorStorage::DYNAMIC : SectorStorage::STATIC;
+			if(sector->mode == mode && sector->key == r.key) field.authenticate(r.sector);
+
+			answer[i].status = ERROR_READ;
+			if(!field.authenticated(r.sector) || r.enc != sector->enc[0]) continue;
+
+			answer[i].status = 0;
+			answer[i].data = sector->data;
+		}
+
+		*out_len = count * sizeof(*answer);
+		return 0;
 	}
 
 	uint8_t sector_write(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::write_sector_request *request = (Sector::write_sector_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_WRITE;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 		
-		SectorStorage* sector = storage.sectors + request->sector;
-		if(!sector->status) return ERROR_WRITE;
+		SectorStorage* sector = storage->sectors + request->sector;
+		if(!field.authenticated(request->sector)) return ERROR_WRITE;
 		
-		sector->enc[0] = request->enc;
+		// every block gets the same encryption, so block reads see what sector write did
+		sector->enc[0] = sector->enc[1] = sector->enc[2] = request->enc;
 		sector->data = request->data;
 		
+		field.modified(request->sector);
+
 		*out_len = 0;
 		return 0;
 	}
 
 	uint8_t set_trailer(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::set_trailer_request *request = (Sector::set_trailer_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_WRITE;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 
-		SectorStorage* sector = storage.sectors + request->sector;
-		if(!sector->status) return ERROR_WRITE;
+		SectorStorage* sector = storage->sectors + request->sector;
+		if(!field.authenticated(request->sector)) return ERROR_WRITE;
 		
 		sector->mode = SectorStorage::STATIC;
 		sector->key = request->key;
 
+		field.modified(request->sector);
+
 		*out_len = 0;
 		return 0;
 	}
 
 	uint8_t set_trailer_dyn(void* in,size_t in_len,void* out,size_t *out_len) {
 		Sector::set_trailer_dynamic_request *request = (Sector::set_trailer_dynamic_request*)in;
-		if(request->sector >= sizeof(storage.sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
+		if(in_len != sizeof(*request)) return ERROR_VALUE;
+		CardStorage *storage = field.selected();
+		if(!storage) return ERROR_WRITE;
+		if(request->sector >= sizeof(storage->sectors)/sizeof(SectorStorage)) return ERROR_VALUE;
 
-		SectorStorage* sector = storage.sectors + request->sector;
-		if(!sector->status) return ERROR_WRITE;
+		SectorStorage* sector = storage->sectors + request->sector;
+		if(!field.authenticated(request->sector)) return ERROR_WRITE;
 
 		sector->mode = SectorStorage::DYNAMIC;
 		sector->key = request->key;
 
+		field.modified(request->sector);
+
 		*out_len = 0;
 		return 0;
 	}
@@ -0,0 +1,83 @@
+#include "key_plan.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+
+KeyPlanCache::KeyPlanCache():hit_count(0),miss_count(0) {
+}
+
+bool KeyPlanCache::find(uint16_t type, uint8_t sector, sector_access *access) const {
+	boost::mutex::scoped_lock lock(mutex);
+	std::map<uint32_t,sector_access>::const_iterator i = plans.find(plan_key(type,sector));
+	if(i == plans.end()) return false;
+	*access = i->second;
+	return true;
+}
+
+void KeyPlanCache::learn(uint16_t type, const sector_access &access) {
+	boost::mutex::scoped_lock lock(mutex);
+	plans[plan_key(type,access.num)] = access;
+}
+
+void KeyPlanCache::forget(uint16_t type, uint8_t sector) {
+	boost::mutex::scoped_lock lock(mutex);
+	plans.erase(plan_key(type,sector));
+}
+
+void KeyPlanCache::count(bool hit) {
+	boost::mutex::scoped_lock lock(mutex);
+	(hit ? hit_count : miss_count)++;
+}
+
+uint64_t KeyPlanCache::hits() const {
+	boost::mutex::scoped_lock lock(mutex);
+	return hit_count;
+}
+
+uint64_t KeyPlanCache::misses() const {
+	boost::mutex::scoped_lock lock(mutex);
+	return miss_count;
+}
+
+long KeyPlanCache::load(const char *path) {
+	FILE *f = fopen(path,"r");
+	if(!f) return errno;
+
+	size_t count = 0;
+	char line[128];
+	while(fgets(line,sizeof(line),f)) {
+		unsigned type, num, key, mode, sector_enc, block_enc[3];
+		if(line[0] == '#') continue;
+		if(sscanf(line,"%x %u %u %u %x %x %x %x",&type,&num,&key,&mode,&sector_enc,
+		          &block_enc[0],&block_enc[1],&block_enc[2]) != 8 || num > 0xFF) {
+			U2_WARN("KeyPlanCache: %s: bad line: %s",path,line);
+			continue;
+		}
+		sector_access access = { (uint8_t)num, (uint8_t)key, (uint8_t)mode, (uint8_t)sector_enc,
+		                         { (uint8_t)block_enc[0], (uint8_t)block_enc[1], (uint8_t)block_enc[2] } };
+		learn(type,access);
+		count++;
+	}
+	fclose(f);
+
+	U2_INFO("KeyPlanCache: %zu plans loaded from %s",count,path);
+	return 0;
+}
+
+long KeyPlanCache::save(const char *path) const {
+	FILE *f = fopen(path,"w");
+	if(!f) return errno;
+
+	boost::mutex::scoped_lock lock(mutex);
+	fprintf(f,"# type sector key mode sector_enc block_enc\n");
+	for(std::map<uint32_t,sector_access>::const_iterator i = plans.begin(); i != plans.end(); ++i) {
+		const sector_access &a = i->second;
+		fprintf(f,"%04X %u %u %u %02X %02X %02X %02X\n",i->first >> 8,a.num,a.key,a.mode,a.sector_enc,
+		        a.block_enc[0],a.block_enc[1],a.block_enc[2]);
+	}
+	long ret = ferror(f) ? EIO : 0;
+	if(fclose(f) && !ret) ret = errno;
+	return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef KEY_PLAN_H
+#define KEY_PLAN_H
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+
+using namespace boost;
+
+// How a sector is authenticated and read.
+struct sector_access
+{
+	uint8_t num;
+	uint8_t key;
+	uint8_t mode;
+	uint8_t sector_enc; //if this is equals to 0, then by-block reading should be used with block_enc
+	uint8_t block_enc[3];
+};
+
+// Access that last worked for every (card type, sector), so the dump engine tries
+// it first and does not pay for failed AUTH, read and reset on cards of an issuer
+// it has seen before. Kept by Reader; when U2_KEY_PLAN names a file, plans are
+// loaded from it on open and saved back on close.
+class KeyPlanCache
+{
+	mutable boost::mutex mutex;
+	std::map<uint32_t,sector_access> plans; // type << 8 | sector
+
+	uint64_t hit_count;
+	uint64_t miss_count;
+
+	static uint32_t plan_key(uint16_t type, uint8_t sector) {
+		return (uint32_t)type << 8 | sector;
+	}
+public:
+	KeyPlanCache();
+
+	// Returns false when nothing has worked for this sector yet.
+	bool find(uint16_t type, uint8_t sector, sector_access *access) const;
+	void learn(uint16_t type, const sector_access &access);
+	void forget(uint16_t type, uint8_t sector);
+
+	// Counts attempts that planned access saved (hit) or failed to predict (miss).
+	void count(bool hit);
+	uint64_t hits() const;
+	uint64_t misses() const;
+
+	// Text file, line per plan: type sector key mode sector_enc block_enc[3].
+	// Return 0 or errno value.
+	long load(const char *path);
+	long save(const char *path) const;
+};
+
+#endif //KEY_PLAN_H
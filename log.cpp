@@ -0,0 +1,440 @@
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/bind.hpp>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+#define LOG_BUFFER_SIZE 65536
+
+#pragma pack(push,1)
+struct LogRecordHeader
+{
+	uint16_t size;       // whole record with arguments
+	uint8_t level;
+	uint8_t nargs;
+	uint32_t suppressed; // messages of this site dropped by rate limit before this one
+	uint64_t time;       // CLOCK_REALTIME, microseconds
+	const char *format;
+};
+#pragma pack(pop)
+
+// Per-thread SPSC ring of records. Buffers are never freed: buffer of a finished
+// thread is marked orphan and given to the next new thread once it is drained.
+struct LogBuffer
+{
+	uint32_t head;       // consumer position
+	uint32_t tail;       // producer position
+	uint32_t dropped;    // records that did not fit
+	uint32_t tid;
+	int orphan;
+	uint8_t data[LOG_BUFFER_SIZE];
+};
+
+static int initial_level()
+{
+	const char *level = getenv("U2_LOG_LEVEL");
+	if(!level) return U2_LOG_INFO;
+
+	std::string s(level);
+	if(s == "error") return U2_LOG_ERROR;
+	if(s == "warn") return U2_LOG_WARN;
+	if(s == "info") return U2_LOG_INFO;
+	if(s == "debug") return U2_LOG_DEBUG;
+	return atoi(level);
+}
+
+volatile int log_threshold = initial_level();
+
+static boost::mutex registry_mutex;
+static std::vector<LogBuffer*> buffers;
+static boost::mutex flush_mutex;
+
+static uint64_t log_now()
+{
+#ifdef WIN32
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return t / 10 - 11644473600000000ULL;
+#else
+	struct timeval tv;
+	gettimeofday(&tv,0);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static uint32_t thread_id()
+{
+#ifdef WIN32
+	return GetCurrentThreadId();
+#else
+	return syscall(SYS_gettid);
+#endif
+}
+
+class LogFlusher
+{
+	FILE *out;
+	volatile bool stopped;
+	boost::thread worker;
+
+	void run() {
+		while(!stopped) {
+			boost::this_thread::sleep(posix_time::milliseconds(10));
+			drain();
+		}
+	}
+public:
+	LogFlusher():out(stderr),stopped(false) {
+		const char *path = getenv("U2_LOG_FILE");
+		if(path && !(out = fopen(path,"a"))) {
+			perror(path);
+			out = stderr;
+		}
+		worker = boost::thread(boost::bind(&LogFlusher::run,this));
+	}
+
+	~LogFlusher() {
+		stopped = true;
+		worker.join();
+		drain();
+		if(out != stderr) fclose(out);
+	}
+
+	void drain();
+	void print(uint32_t tid, const LogRecordHeader *record, const uint8_t *args);
+};
+
+static LogFlusher* flusher()
+{
+	// started with the first message, stopped and drained at exit
+	static LogFlusher instance;
+	return &instance;
+}
+
+static void release_buffer(LogBuffer *buffer)
+{
+	__atomic_store_n(&buffer->orphan,1,__ATOMIC_RELEASE);
+}
+
+static boost::thread_specific_ptr<LogBuffer> thread_buffer_owner(release_buffer);
+
+static LogBuffer* thread_buffer()
+{
+	static __thread LogBuffer *buffer = 0;
+	if(buffer) return buffer;
+
+	flusher();
+
+	boost::mutex::scoped_lock lock(registry_mutex);
+	for(size_t i = 0; i < buffers.size() && !buffer; i++) {
+		LogBuffer *b = buffers[i];
+		if(__atomic_load_n(&b->orphan,__ATOMIC_ACQUIRE) && __atomic_load_n(&b->head,__ATOMIC_ACQUIRE) == b->tail) {
+			b->orphan = 0;
+			buffer = b;
+		}
+	}
+	if(!buffer) {
+		buffer = (LogBuffer*)calloc(1,sizeof(LogBuffer));
+		if(!buffer) return 0;
+		buffers.push_back(buffer);
+	}
+	buffer->tid = thread_id();
+	thread_buffer_owner.reset(buffer);
+	return buffer;
+}
+
+static void ring_copy_in(LogBuffer *b, uint32_t pos, const void *src, uint32_t len)
+{
+	uint32_t index = pos & (LOG_BUFFER_SIZE - 1);
+	uint32_t first = min(len,(uint32_t)LOG_BUFFER_SIZE - index);
+	memcpy(b->data + index,src,first);
+	memcpy(b->data,(const uint8_t*)src + first,len - first);
+}
+
+static void ring_copy_out(LogBuffer *b, uint32_t pos, void *dst, uint32_t len)
+{
+	uint32_t index = pos & (LOG_BUFFER_SIZE - 1);
+	uint32_t first = min(len,(uint32_t)LOG_BUFFER_SIZE - index);
+	memcpy(dst,b->data + index,first);
+	memcpy((uint8_t*)dst + first,b->data,len - first);
+}
+
+static __thread uint8_t scratch[LOG_MAX_RECORD];
+
+LogRecordBuilder::LogRecordBuilder(int level, const char *format, uint32_t suppressed)
+	:pos(scratch + sizeof(LogRecordHeader)),end(scratch + sizeof(scratch)),nargs(0)
+{
+	LogRecordHeader *header = (LogRecordHeader*)scratch;
+	header->level = level;
+	header->suppressed = suppressed;
+	header->time = log_now();
+	header->format = format;
+}
+
+void LogRecordBuilder::put_raw(uint8_t type, const void *data, size_t len)
+{
+	if(end - pos < (long)(1 + len)) return;
+	*pos++ = type;
+	memcpy(pos,data,len);
+	pos += len;
+	nargs++;
+}
+
+void LogRecordBuilder::put_blob(uint8_t type, const void *data, size_t len)
+{
+	if(end - pos < 3) return;
+	// long strings and dumps are cut to what fits into record
+	uint16_t fit = min(len,(size_t)(end - pos - 3));
+	*pos++ = type;
+	memcpy(pos,&fit,sizeof(fit));
+	pos += sizeof(fit);
+	memcpy(pos,data,fit);
+	pos += fit;
+	nargs++;
+}
+
+void LogRecordBuilder::commit()
+{
+	LogRecordHeader *header = (LogRecordHeader*)scratch;
+	header->size = pos - scratch;
+	header->nargs = nargs;
+
+	LogBuffer *b = thread_buffer();
+	if(!b) return;
+
+	uint32_t tail = b->tail;
+	uint32_t used = tail - __atomic_load_n(&b->head,__ATOMIC_ACQUIRE);
+	if(LOG_BUFFER_SIZE - used < header->size) {
+		__sync_fetch_and_add(&b->dropped,1);
+		return;
+	}
+	ring_copy_in(b,tail,scratch,header->size);
+	__atomic_store_n(&b->tail,tail + header->size,__ATOMIC_RELEASE);
+}
+
+bool log_admit(LogSite *site, uint32_t *suppressed)
+{
+	uint32_t second = log_now() / 1000000;
+	uint32_t window = __atomic_load_n(&site->window,__ATOMIC_RELAXED);
+
+	if(window != second && __sync_bool_compare_and_swap(&site->window,window,second)) {
+		__atomic_store_n(&site->count,1,__ATOMIC_RELAXED);
+		*suppressed = __sync_lock_test_and_set(&site->suppressed,0);
+		return true;
+	}
+
+	if(__sync_add_and_fetch(&site->count,1) <= LOG_RATE_LIMIT) {
+		*suppressed = 0;
+		return true;
+	}
+
+	__sync_fetch_and_add(&site->suppressed,1);
+	return false;
+}
+
+// Formats one printf conversion with one packed argument.
+static void format_arg(std::string &line, std::string spec, char length, char conversion,
+					   const uint8_t *&arg, const uint8_t *args_end)
+{
+	char buf[64] = "";
+
+	if(arg >= args_end) {
+		line += spec + conversion;
+		return;
+	}
+
+	uint8_t type = *arg++;
+	uint64_t value = 0;
+	std::string blob;
+	if(type == 's' || type == 'b') {
+		uint16_t len;
+		memcpy(&len,arg,sizeof(len));
+		blob.assign((const char*)arg + sizeof(len),len);
+		arg += sizeof(len) + len;
+	} else {
+		memcpy(&value,arg,sizeof(value));
+		arg += sizeof(value);
+	}
+
+	switch(conversion) {
+	case 'd': case 'i': {
+		long long v = (long long)value;
+		if(length == 'H') v = (signed char)v;
+		else if(length == 'h') v = (short)v;
+		else if(!length) v = (int)v;
+		snprintf(buf,sizeof(buf),(spec + "ll" + conversion).c_str(),v);
+		break;
+	}
+	case 'o': case 'u': case 'x': case 'X': case 'c': {
+		unsigned long long v = value;
+		if(length == 'H') v = (uint8_t)v;
+		else if(length == 'h') v = (uint16_t)v;
+		else if(!length) v = (uint32_t)v;
+		if(conversion == 'c') snprintf(buf,sizeof(buf),(spec + 'c').c_str(),(int)v);
+		else snprintf(buf,sizeof(buf),(spec + "ll" + conversion).c_str(),v);
+		break;
+	}
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+		double v;
+		memcpy(&v,&value,sizeof(v));
+		snprintf(buf,sizeof(buf),(spec + conversion).c_str(),v);
+		break;
+	}
+	case 'p':
+		snprintf(buf,sizeof(buf),"%p",(void*)(uintptr_t)value);
+		break;
+	case 's':
+		if(type == 'b') {
+			for(size_t i = 0; i < blob.size(); i++) {
+				snprintf(buf,sizeof(buf),"%02hhX ",(uint8_t)blob[i]);
+				line += buf;
+			}
+			return;
+		}
+		if(type == 's') {
+			std::string f = spec + 's';
+			if(f == "%s") {
+				line += blob;
+			} else {
+				std::vector<char> out(blob.size() + 256);
+				snprintf(&out[0],out.size(),f.c_str(),blob.c_str());
+				line += &out[0];
+			}
+			return;
+		}
+		line += "(?)";
+		return;
+	default:
+		line += spec + conversion;
+		return;
+	}
+	line += buf;
+}
+
+static const char level_names[] = "EWID";
+
+void LogFlusher::print(uint32_t tid, const LogRecordHeader *record, const uint8_t *args)
+{
+	const uint8_t *args_end = (const uint8_t*)record + record->size;
+	std::string line;
+
+	time_t seconds = record->time / 1000000;
+	struct tm t;
+#ifdef WIN32
+	localtime_s(&t,&seconds);
+#else
+	localtime_r(&seconds,&t);
+#endif
+	char prefix[64];
+	snprintf(prefix,sizeof(prefix),"%02i:%02i:%02i.%06u %c [%u] ",t.tm_hour,t.tm_min,t.tm_sec,
+		(unsigned)(record->time % 1000000),level_names[min((int)record->level,3)],tid);
+	line = prefix;
+
+	for(const char *f = record->format; *f; f++) {
+		if(*f != '%') {
+			line += *f;
+			continue;
+		}
+		if(f[1] == '%') {
+			line += '%';
+			f++;
+			continue;
+		}
+
+		std::string spec = "%";
+		const char *p = f + 1;
+		while(*p && strchr("-+ #0",*p)) spec += *p++;
+		while(*p >= '0' && *p <= '9') spec += *p++;
+		if(*p == '.') {
+			spec += *p++;
+			while(*p >= '0' && *p <= '9') spec += *p++;
+		}
+
+		char length = 0;
+		if(p[0] == 'h' && p[1] == 'h') { length = 'H'; p += 2; }
+		else if(*p == 'h') { length = 'h'; p++; }
+		else if(p[0] == 'l' && p[1] == 'l') { length = 'l'; p += 2; }
+		else if(strchr("lLqjzt",*p) && *p) { length = sizeof(long) == 8 || *p != 'l' ? 'l' : 0; p++; }
+
+		if(!*p) {
+			line += spec;
+			break;
+		}
+		format_arg(line,spec,length,*p,args,args_end);
+		f = p;
+	}
+
+	if(record->suppressed) {
+		char suppressed[64];
+		snprintf(suppressed,sizeof(suppressed)," (%u similar messages suppressed)",record->suppressed);
+		line += suppressed;
+	}
+	line += '\n';
+	fwrite(line.data(),line.size(),1,out);
+}
+
+void LogFlusher::drain()
+{
+	boost::mutex::scoped_lock flush_lock(flush_mutex);
+
+	std::vector<LogBuffer*> snapshot;
+	{
+		boost::mutex::scoped_lock lock(registry_mutex);
+		snapshot = buffers;
+	}
+
+	uint8_t record[LOG_MAX_RECORD];
+	bool written = false;
+
+	for(size_t i = 0; i < snapshot.size(); i++) {
+		LogBuffer *b = snapshot[i];
+		uint32_t head = b->head;
+		uint32_t tail = __atomic_load_n(&b->tail,__ATOMIC_ACQUIRE);
+
+		while(head != tail) {
+			LogRecordHeader *header = (LogRecordHeader*)record;
+			ring_copy_out(b,head,record,sizeof(*header));
+			ring_copy_out(b,head,record,header->size);
+			print(b->tid,header,record + sizeof(*header));
+			head += header->size;
+			written = true;
+		}
+		__atomic_store_n(&b->head,head,__ATOMIC_RELEASE);
+
+		if(uint32_t dropped = __sync_lock_test_and_set(&b->dropped,0)) {
+			fprintf(out,"log: %u messages of thread %u dropped, buffer was full\n",dropped,b->tid);
+			written = true;
+		}
+	}
+
+	if(written) fflush(out);
+}
+
+void log_set_level(int level)
+{
+	log_threshold = level;
+}
+
+void log_flush()
+{
+	flusher()->drain();
+}
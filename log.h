@@ -0,0 +1,129 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+#include <cstring>
+
+using namespace boost;
+
+// Asynchronous logger. Call sites only pack format pointer and arguments into
+// a per-thread ring (no locks, no formatting, no syscalls); a background thread
+// formats records printf-style and writes them to stderr or to U2_LOG_FILE.
+//
+// Level is taken from U2_LOG_LEVEL (error, warn, info, debug or 0..3, info by
+// default) and can be changed at runtime with u2_log_set_level.
+// Every call site lets through no more than LOG_RATE_LIMIT messages per second,
+// the number of suppressed ones is reported with the next message of that site.
+//
+//   U2_WARN("write_callback error: %i: %s",error.value(),error.message().c_str());
+//   U2_DEBUG("feed: %s",log_bytes(data,len));   // hex dump
+
+#define U2_LOG_ERROR   0
+#define U2_LOG_WARN    1
+#define U2_LOG_INFO    2
+#define U2_LOG_DEBUG   3
+
+#define LOG_RATE_LIMIT   20
+#define LOG_MAX_RECORD   1024
+
+extern volatile int log_threshold;
+
+struct LogSite
+{
+	uint32_t window;     // second the counters below belong to
+	uint32_t count;
+	uint32_t suppressed;
+};
+
+// Byte dump argument, printed by %s as hex bytes
+struct LogBytes
+{
+	const void *data;
+	size_t len;
+};
+
+inline LogBytes log_bytes(const void *data, size_t len)
+{
+	LogBytes bytes = { data, len };
+	return bytes;
+}
+
+// Packs record into thread-local scratch space, commit moves it to thread's ring.
+class LogRecordBuilder
+{
+	uint8_t *pos;
+	uint8_t *end;
+	uint8_t nargs;
+
+	void put_raw(uint8_t type, const void *data, size_t len);
+	void put_blob(uint8_t type, const void *data, size_t len);
+public:
+	LogRecordBuilder(int level, const char *format, uint32_t suppressed);
+	void commit();
+
+	inline void put(bool v) { put_unsigned(v); }
+	inline void put(char v) { put_signed(v); }
+	inline void put(signed char v) { put_signed(v); }
+	inline void put(unsigned char v) { put_unsigned(v); }
+	inline void put(short v) { put_signed(v); }
+	inline void put(unsigned short v) { put_unsigned(v); }
+	inline void put(int v) { put_signed(v); }
+	inline void put(unsigned int v) { put_unsigned(v); }
+	inline void put(long v) { put_signed(v); }
+	inline void put(unsigned long v) { put_unsigned(v); }
+	inline void put(long long v) { put_signed(v); }
+	inline void put(unsigned long long v) { put_unsigned(v); }
+	inline void put(double v) { put_raw('d',&v,sizeof(v)); }
+	inline void put(const char *s) { put_blob('s',s ? s : "(null)",s ? strlen(s) : 6); }
+	inline void put(const LogBytes &b) { put_blob('b',b.data,b.len); }
+	template<class T>
+	inline void put(const T *p) { put_raw('p',&p,sizeof(p)); }
+
+	inline void put_signed(long long v) { put_raw('i',&v,sizeof(v)); }
+	inline void put_unsigned(unsigned long long v) { put_raw('u',&v,sizeof(v)); }
+};
+
+// Returns false when call site has exceeded its rate limit.
+bool log_admit(LogSite *site, uint32_t *suppressed);
+
+inline void log_pack(LogRecordBuilder &)
+{
+}
+
+template<class T, class... Rest>
+inline void log_pack(LogRecordBuilder &builder, const T &value, const Rest&... rest)
+{
+	builder.put(value);
+	log_pack(builder,rest...);
+}
+
+template<class... Args>
+inline void log_write(LogSite *site, int level, const char *format, const Args&... args)
+{
+	uint32_t suppressed = 0;
+	if(!log_admit(site,&suppressed)) return;
+
+	LogRecordBuilder builder(level,format,suppressed);
+	log_pack(builder,args...);
+	builder.commit();
+}
+
+void log_set_level(int level);
+
+// Waits until everything logged so far is written out.
+void log_flush();
+
+#define U2_LOG(level,...) do { \
+		if((level) <= log_threshold) { \
+			static LogSite u2_log_site = { 0, 0, 0 }; \
+			log_write(&u2_log_site,level,__VA_ARGS__); \
+		} \
+	} while(0)
+
+#define U2_ERROR(...) U2_LOG(U2_LOG_ERROR,__VA_ARGS__)
+#define U2_WARN(...)  U2_LOG(U2_LOG_WARN,__VA_ARGS__)
+#define U2_INFO(...)  U2_LOG(U2_LOG_INFO,__VA_ARGS__)
+#define U2_DEBUG(...) U2_LOG(U2_LOG_DEBUG,__VA_ARGS__)
+
+#endif //LOG_H
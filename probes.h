@@ -0,0 +1,28 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static USDT probes for bpftrace/perf/systemtap, provider "u2".
+// Every probe has the same arguments:
+//   arg0 - Reader*, arg1 - addr, arg2 - code, arg3 - payload length, arg4 - result.
+//
+// frame_send      - packet has been built and is handed to IOProvider
+// frame_received  - complete frame came from device (result 0)
+// crc_fail        - frame came with broken checksum (result PACKET_CRC_ERROR)
+// nack            - device rejected command (result holds nack data)
+// timeout         - no answer in time (result NO_ANSWER)
+// answer          - answer is delivered to the waiting caller
+//
+// Probe sites are a single NOP until a tracer attaches. They are compiled in
+// when sys/sdt.h is available (Makefile defines U2_USDT then).
+//
+//   bpftrace -e 'usdt:./libu2.so:u2:answer { @[arg2] = hist(arg4 ? 1 : 0); }'
+
+#ifdef U2_USDT
+#include <sys/sdt.h>
+#define U2_PROBE(name,reader,addr,code,len,result) \
+	STAP_PROBE5(u2,name,reader,addr,code,len,result)
+#else
+#define U2_PROBE(name,reader,addr,code,len,result) do {} while(0)
+#endif
+
+#endif //PROBES_H
@@ -1,17 +1,83 @@
 #include "protocol.h"
+#include "subway_protocol.h"
+#include "commands.h"
+#include "probes.h"
+#include "log.h"
 
 #include <algorithm>
+#include <cstdlib>
+#include <cerrno>
 
 using namespace std;
 
 void debug_data(const char* header,void* data,size_t len)
 {
-	uint8_t *bytes = (uint8_t*)data;
-	fprintf(stderr,"%s: ",header);
-	for(size_t i=0;i<len;i++) {
-		fprintf(stderr,"%02hhX ",bytes[i]);
+	U2_DEBUG("%s: %s",header,log_bytes(data,len));
+}
+
+ByteRing::ByteRing():head(0),count(0)
+{
+
+}
+
+size_t ByteRing::write(const void *data, size_t len)
+{
+	const uint8_t *src = (const uint8_t*)data;
+	size_t dropped = 0;
+
+	if(len > sizeof(buffer)) {
+		dropped += len - sizeof(buffer);
+		src += len - sizeof(buffer);
+		len = sizeof(buffer);
+	}
+
+	if(count + len > sizeof(buffer)) {
+		size_t overflow = count + len - sizeof(buffer);
+		head = (head + overflow) % sizeof(buffer);
+		count -= overflow;
+		dropped += overflow;
 	}
-	fprintf(stderr,"\n");
+
+	size_t tail = (head + count) % sizeof(buffer);
+	size_t first = min(len,sizeof(buffer) - tail);
+	memcpy(buffer + tail,src,first);
+	memcpy(buffer,src + first,len - first);
+	count += len;
+
+	return dropped;
+}
+
+size_t ByteRing::read(void *buf, size_t len)
+{
+	uint8_t *dst = (uint8_t*)buf;
+
+	len = min(len,count);
+	size_t first = min(len,sizeof(buffer) - head);
+	memcpy(dst,buffer + head,first);
+	memcpy(dst + first,buffer,len - first);
+	head = (head + len) % sizeof(buffer);
+	count -= len;
+
+	return len;
+}
+
+void IOProvider::unread(void *data, size_t len)
+{
+	if(!data || !len) return;
+
+	boost::mutex::scoped_lock lock(unread_mutex);
+	if(size_t dropped = unread_bytes.write(data,len)) {
+		U2_WARN("IOProvider::unread: %zu bytes dropped",dropped);
+	}
+}
+
+size_t IOProvider::discard_unread()
+{
+	boost::mutex::scoped_lock lock(unread_mutex);
+	uint8_t buf[512];
+	size_t dropped = 0;
+	while(size_t n = unread_bytes.read(buf,sizeof(buf))) dropped += n;
+	return dropped;
 }
 
 IOProvider::~IOProvider() 
@@ -31,21 +97,24 @@ ProtocolAnswer::ProtocolAnswer(long _result, uint8_t _addr, uint8_t _code)
 
 }
 
-Protocol::Protocol():answer_future(answer_promise.get_future())
+Protocol::Protocol(uint8_t _kind):answer_future(answer_promise.get_future()),kind(_kind),trace_id(trace_next_id()),
+ reader(0),command_addr(0),command_code(0)
 {
-
+	memset(timing,0,sizeof(timing));
 }	
 
 void Protocol::set_answer(ProtocolAnswer answer)
 {
+	mark(TIMING_ANSWER);
+	U2_PROBE(answer,reader,command_addr,command_code,answer.len,answer.result);
 	try {
 		answer_promise.set_value(answer);
 	} catch(boost::promise_already_satisfied &e) {
-		std::cerr << "PROMISE_ALREADY_SATISFIED: " << e.what() << std::endl;
+		U2_WARN("PROMISE_ALREADY_SATISFIED: %s",e.what());
 	} catch(boost::broken_promise &e) {
-		std::cerr << "BROKEN_PROMISE: " << e.what() << std::endl;
+		U2_WARN("BROKEN_PROMISE: %s",e.what());
 	} catch(std::bad_alloc &e) {
-		std::cerr << "BAD_ALLOC: " << e.what() << std::endl;
+		U2_ERROR("BAD_ALLOC: %s",e.what());
 	}
 }
 
@@ -64,18 +133,28 @@ ISaveLoadable::~ISaveLoadable()
 
 }
 
+IConnection::~IConnection()
+{
+
+}
+
 #ifdef WIN32
 IOProvider* create_blockwise_impl(const char *path,uint32_t baud,uint8_t parity);
 #else
 IOProvider* create_cp210x_impl(const char *path,uint32_t baud,uint8_t parity);
 IOProvider* create_unix_impl(const char *path, uint32_t baud, uint8_t parity);
+IOProvider* create_broker_impl(const char *path, uint32_t baud, uint8_t parity);
+IOProvider* create_shm_impl(const char *path, uint32_t baud, uint8_t parity);
+IOProvider* create_record_impl(IOProvider *inner);
+IOProvider* create_replay_impl(const char *file, const char *path);
 #endif
 IOProvider* create_asio_impl(const char *path,uint32_t baud,uint8_t parity);
 IOProvider* create_asio_mt_impl(const char *path,uint32_t baud,uint8_t parity);
 IOProvider* create_file_impl(const char *path,uint32_t baud,uint8_t parity);
 IOProvider* create_tcp_impl(const char *path,uint32_t baud,uint8_t parity);
+IOProvider* create_fault_impl(IOProvider *inner, const char *spec);
 
-static IOProvider * get_impl(const char *impl_tag, const char *path, uint32_t baud, uint8_t parity)
+IOProvider * get_impl(const char *impl_tag, const char *path, uint32_t baud, uint8_t parity)
 {
 	std::string s = std::string(impl_tag);
 #ifdef WIN32
@@ -83,40 +162,73 @@ static IOProvider * get_impl(const char *impl_tag, const char *path, uint32_t ba
 #else
 	if(s == "cp210x") return create_cp210x_impl(path,baud,parity);
 	if(s == "unix") return create_unix_impl(path,baud,parity);
+	if(s == "broker") return create_broker_impl(path,baud,parity);
+	if(s == "shm") return create_shm_impl(path,baud,parity);
+	if(s.compare(0,7,"record:") == 0) return create_record_impl(get_impl(impl_tag + 7,path,baud,parity));
+	if(s.compare(0,7,"replay:") == 0) return create_replay_impl(impl_tag + 7,path);
 #endif
     if(s == "asio-mt") return create_asio_mt_impl(path,baud,parity);
 	if(s == "asio") return create_asio_impl(path,baud,parity);
 	if(s == "file") return create_file_impl(path,baud,parity);	
 	if(s == "tcp") return create_tcp_impl(path,baud,parity);
+	if(s.compare(0,6,"fault:") == 0) return create_fault_impl(get_impl(impl_tag + 6,path,baud,parity),getenv("U2_FAULT"));
 
 	return 0;
 }
 
-Reader::Reader(const char *path,uint32_t baud,uint8_t parity,const char *impl_tag):impl(0)
+Reader::Reader(const char *path,uint32_t baud,uint8_t parity,const char *impl_tag)
+	:impl(0),capabilities(0),capabilities_known(false),probe_failed(false)
 {
 	impl = get_impl(impl_tag,path,baud,parity);
+
+	// missing file is fine, it appears on close
+	const char *plans = getenv("U2_KEY_PLAN");
+	long ret = plans ? key_plans.load(plans) : 0;
+	if(ret && ret != ENOENT) U2_WARN("Reader: cannot load key plans from %s",plans);
 }
 
 Reader::~Reader()
 {
 	delete impl;
+
+	const char *plans = getenv("U2_KEY_PLAN");
+	if(plans && key_plans.save(plans)) U2_WARN("Reader: cannot save key plans to %s",plans);
 }
 
 long Reader::send_command(Protocol *protocol,uint8_t addr, uint8_t code, 
 						  void *data, size_t len,void *answer, size_t answer_len)
 {
 	if(!impl) {
-		fprintf(stderr,"NO_IMPL\n");
+		U2_ERROR("NO_IMPL");
 		return NO_IMPL;	
 	}
 
 	//SubwayProtocol protocol(impl);
-	
-	if(long send_ret = protocol->send(addr,code,data,len)) {
-		return send_ret;
+
+	TraceSpan span("command",protocol->get_trace_id(),code);
+	protocol->set_command(this,addr,code);
+	protocol->mark(TIMING_START);
+	long ret = transact(protocol,addr,code,data,len,answer,answer_len);
+	protocol->mark(TIMING_WAKEUP);
+
+	stats.record(protocol->get_kind(),code,protocol->get_timing(),ret);
+	if(!ret && __atomic_load_n(&probe_failed,__ATOMIC_RELAXED)) __atomic_store_n(&probe_failed,false,__ATOMIC_RELAXED);
+	return ret;
+}
+
+long Reader::transact(Protocol *protocol,uint8_t addr, uint8_t code,
+					  void *data, size_t len,void *answer, size_t answer_len)
+{
+	{
+		TraceSpan span("Protocol::send",protocol->get_trace_id(),len);
+		if(long send_ret = protocol->send(addr,code,data,len)) {
+			return send_ret;
+		}
 	}
 		
 	ProtocolAnswer protocol_answer = protocol->get_answer();
+	protocol->mark(TIMING_WAKEUP);
+	trace_instant("get_answer",protocol->get_trace_id(),protocol_answer.result);
 	if(protocol_answer.result) return protocol_answer.result;
 		
 	if(answer) {
@@ -131,3 +243,56 @@ long Reader::send_command(Protocol *protocol,uint8_t addr, uint8_t code,
 
 	return 0;	 
 }
+
+#pragma pack(push,1)
+struct version_caps
+{
+	char version[7];
+	uint32_t capabilities;
+};
+#pragma pack(pop)
+
+uint32_t Reader::get_capabilities()
+{
+	boost::mutex::scoped_lock lock(capabilities_mutex);
+	if(capabilities_known) return capabilities;
+	// unresponsive reader is not asked again on every command, each probe waits out a timeout
+	if(__atomic_load_n(&probe_failed,__ATOMIC_RELAXED)) return 0;
+
+	uint8_t request = VERSION_CAPS;
+	version_caps answer;
+	memset(&answer,0,sizeof(answer));
+	long ret = send_command<SubwayProtocol>(0,GET_VERSION,&request,&answer);
+
+	// NACK or short answer is old firmware, transport error is not an answer at all
+	// and probe is retried after reader answers something
+	bool nack = ret > 0 && ret < ERROR_BASE;
+	if(ret && !nack && (ret & ERR_MASK) != PACKET_DATA_LEN_ERROR) {
+		__atomic_store_n(&probe_failed,true,__ATOMIC_RELAXED);
+		return 0;
+	}
+
+	capabilities = nack ? 0 : answer.capabilities;
+	capabilities_known = true;
+	char version[sizeof(answer.version) + 1] = "";
+	memcpy(version,answer.version,sizeof(answer.version));
+	U2_INFO("Reader: firmware %s, capabilities %08X",version,capabilities);
+	return capabilities;
+}
+
+void Reader::set_capabilities(uint32_t _capabilities)
+{
+	boost::mutex::scoped_lock lock(capabilities_mutex);
+	capabilities = _capabilities;
+	capabilities_known = true;
+}
+
+long Reader::get_connection_info(connection_info *info)
+{
+	if(!impl) return NO_IMPL;
+
+	IConnection *connection = dynamic_cast<IConnection*>(impl);
+	if(connection) return connection->get_info(info);
+
+	return NO_IMPL_SUPPORT;
+}
@@ -5,6 +5,11 @@
 #include <boost/thread/future.hpp>
 #include <boost/function.hpp>
 #include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "stats.h"
+#include "trace.h"
+#include "key_plan.h"
 
 using namespace boost;
 
@@ -26,6 +31,10 @@ namespace PARITY
 #define IO_ERROR                0x0E000001
 #define NO_IMPL                 0x0E0000F0
 #define NO_IMPL_SUPPORT         0x0E0000F1
+#define OPEN_PENDING            0x0E0000B0
+#define NO_EVENT                0x0E0000E0
+#define BAD_SECTOR              0x0E0000C1 // sector number out of card
+#define CACHE_CONFLICT          0x0E0000C2 // cached sector has pending writes of another key or encryption
 #define NO_ANSWER               0x0E0000A0
 #define ANSWER_TOO_LONG         0x0E0000AF
 #define WRONG_ANSWER            0x0E0000DF
@@ -34,8 +43,31 @@ namespace PARITY
 
 void debug_data(const char* header,void* data,size_t len);
 
+// Fixed-size byte ring. When there is not enough free space,
+// oldest bytes are overwritten by the new ones.
+class ByteRing
+{
+	uint8_t buffer[4096];
+	size_t head;
+	size_t count;
+public:
+	ByteRing();
+
+	// Returns number of old bytes that were dropped to make room for data.
+	size_t write(const void *data, size_t len);
+	// Moves at most len bytes from the ring to buf. Returns number of bytes moved.
+	size_t read(void *buf, size_t len);
+
+	inline size_t size() const {
+		return count;
+	}
+};
+
 class IOProvider
 {
+	boost::mutex unread_mutex;
+	ByteRing unread_bytes;
+
 public:
 	// write_callback return value specifies the course of action, that IOProvider should take: 
 	//  0 -> everything is ok, IOProvider may initiate reading after that;
@@ -59,9 +91,19 @@ public:
 	virtual long set_timeout(size_t timeout, timeout_callback callback) = 0;
 	virtual long cancel_timeout() = 0;
 
+	// Keeps bytes that came from device when nobody was listening, so that
+	// the next protocol can account for them before it sends its command.
+	void unread(void *data, size_t len);
+
+	// Drops bytes kept by unread. Returns number of bytes dropped.
+	size_t discard_unread();
+
 	virtual ~IOProvider();
 };
 
+// Creates IOProvider by its tag ("asio", "tcp", "file", ...). Returns 0 for unknown tags.
+IOProvider* get_impl(const char *impl_tag, const char *path, uint32_t baud, uint8_t parity);
+
 struct ProtocolAnswer
 {
 	long result;
@@ -74,14 +116,62 @@ struct ProtocolAnswer
 	ProtocolAnswer(long _result,uint8_t addr = 0, uint8_t code = 0);
 };
 
+class Reader;
+
 class Protocol
 {
 	promise<ProtocolAnswer> answer_promise;
 	unique_future<ProtocolAnswer> answer_future;	
+
+	uint8_t kind;
+	uint64_t timing[TIMING_POINTS];
+	uint64_t trace_id;
+
+	// command being served, for probes
+	const Reader *reader;
+	uint8_t command_addr;
+	uint8_t command_code;
 public:
-	Protocol();
+	// kind is PROTOCOL_SUBWAY or PROTOCOL_TERMINAL, commands are accounted by it in Reader stats
+	Protocol(uint8_t kind);
 	virtual ~Protocol();
 
+	inline uint8_t get_kind() const {
+		return kind;
+	}
+
+	// Remembers the moment command reached given point. Only the first mark counts.
+	inline void mark(timing_point point) {
+		if(!timing[point]) timing[point] = stats_now();
+	}
+
+	inline const uint64_t* get_timing() const {
+		return timing;
+	}
+
+	// Id of command in trace timeline, 0 when tracing is off
+	inline uint64_t get_trace_id() const {
+		return trace_id;
+	}
+
+	inline void set_command(const Reader *_reader, uint8_t addr, uint8_t code) {
+		reader = _reader;
+		command_addr = addr;
+		command_code = code;
+	}
+
+	inline const Reader* get_reader() const {
+		return reader;
+	}
+
+	inline uint8_t get_command_addr() const {
+		return command_addr;
+	}
+
+	inline uint8_t get_command_code() const {
+		return command_code;
+	}
+
     // initiates protocol operation, called by IOProvider,
 	// that provides itself in a parameter
 	// Return values:
@@ -107,12 +197,37 @@ public:
 	virtual long save(const char *path) = 0;
 };
 
+struct connection_info
+{
+	uint32_t connected;  // 1 when link is up
+	uint32_t reconnects; // number of successful reconnects since open
+	uint32_t rtt;        // smoothed round trip time, microseconds
+	uint32_t rtt_var;    // round trip time variance, microseconds
+};
+
+// Implemented by IOProviders that work over network connection.
+class IConnection
+{
+public:
+	virtual ~IConnection();
+	virtual long get_info(connection_info *info) = 0;
+};
+
 class Reader
 {
 	IOProvider *impl;
+	ReaderStats stats;
+	KeyPlanCache key_plans;
+
+	boost::mutex capabilities_mutex;
+	uint32_t capabilities;
+	bool capabilities_known;
+	bool probe_failed; // reader did not answer the probe, cleared by the next successful command
 
 	long send_command(Protocol *protocol,uint8_t addr, uint8_t code,
 		              void *data, size_t len,void *answer, size_t answer_len);	
+	long transact(Protocol *protocol,uint8_t addr, uint8_t code,
+		          void *data, size_t len,void *answer, size_t answer_len);
 public:
 	Reader(const char* path, uint32_t baud,uint8_t parity,const char* impl_tag);
 	~Reader();
@@ -145,6 +260,29 @@ public:
 
 	long save(const char* path);
 	long load(const char* path);
+
+	// Dumps card in the field to path as image FileImpl loads, sectors of standard
+	// card layout are read (see CardLayout). Sectors set in
+	// *unreadable (bit per sector, may be 0) are skipped, the ones that fail are
+	// added there; image is saved even then and error of the last one is returned.
+	long dump(const char* path, uint32_t *unreadable);
+	long get_connection_info(connection_info *info);
+
+	// Extended commands reader firmware supports (CAP_* of commands.h). Asked with
+	// GET_VERSION once, the first time they are needed; firmware that does not
+	// answer with capabilities has none. Probe that got no answer at all is not
+	// repeated (0 is returned) until some command succeeds.
+	uint32_t get_capabilities();
+	// Replaces probed capabilities, e.g. to drop the one firmware rejected.
+	void set_capabilities(uint32_t capabilities);
+
+	inline ReaderStats& get_stats() {
+		return stats;
+	}
+
+	inline KeyPlanCache& get_key_plans() {
+		return key_plans;
+	}
 };
 
 #endif //PROTOCOL_H
\ No newline at end of file
@@ -2,11 +2,17 @@
 
 #include "protocol.h"
 #include "commands.h"
+#include "card_db.h"
 #include "crc16.h"
+#include "log.h"
 
 #include <iostream>
 #include <cstdio>
+#include <string>
 #include <boost/system/system_error.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/bind.hpp>
 
 #define PACKET_BUFFER        256
 #define MAX_FRAME_SIZE		 128
@@ -93,20 +99,114 @@ EXPORT long reader_open(const char *path,uint32_t baud,uint8_t parity,const char
 		*reader = new Reader(path,baud,parity,impl);
 		return 0;
 	} catch(boost::system::system_error& e) {
-		std::cerr << e.what() << std::endl;
+		U2_ERROR("%s",e.what());
 		return -1;
 	} catch(int& e) {
 		return e;
 	}
 }
 
+// Reader being opened in background. Every open gets its own thread, so opening
+// many readers takes as long as the slowest of them instead of sum of all.
+struct ReaderOpen
+{
+	std::string path;
+	uint32_t baud;
+	uint8_t parity;
+	std::string impl;
+
+	Reader *reader;
+	promise<long> done;
+	unique_future<long> result;
+	long status;
+	thread worker;
+
+	void run() {
+		long ret = 0;
+		try {
+			reader = new Reader(path.c_str(),baud,parity,impl.c_str());
+		} catch(boost::system::system_error& e) {
+			U2_ERROR("%s: %s",path.c_str(),e.what());
+			// low bits of system error code are kept to tell endpoints' failures apart
+			ret = IO_ERROR | ((e.code().value() & 0xFFFF) << 8);
+		} catch(std::exception& e) {
+			// anything else a provider throws still has to complete the open
+			U2_ERROR("%s: %s",path.c_str(),e.what());
+			ret = IO_ERROR;
+		} catch(int& e) {
+			ret = e;
+		}
+		done.set_value(ret);
+	}
+
+	// Returns OPEN_PENDING until open finishes, result of open after that.
+	// Opened reader is handed over to caller only once.
+	long take(Reader **out) {
+		if(status == OPEN_PENDING) {
+			if(!result.is_ready()) return OPEN_PENDING;
+			status = result.get();
+		}
+		if(out) {
+			*out = reader;
+			reader = 0;
+		}
+		return status;
+	}
+};
+
+EXPORT long reader_open_async(const char *path,uint32_t baud,uint8_t parity,const char* impl,ReaderOpen **op)
+{
+	ReaderOpen *open = 0;
+	try {
+		open = new ReaderOpen();
+		open->path = path;
+		open->baud = baud;
+		open->parity = parity;
+		open->impl = impl;
+		open->reader = 0;
+		open->status = OPEN_PENDING;
+		open->result = open->done.get_future();
+		open->worker = thread(boost::bind(&ReaderOpen::run,open));
+	} catch(std::exception& e) {
+		// no thread was started, so nothing refers to open
+		U2_ERROR("%s: %s",path,e.what());
+		delete open;
+		return IO_ERROR;
+	}
+
+	*op = open;
+	return 0;
+}
+
+EXPORT long reader_open_poll(ReaderOpen *op, Reader **reader)
+{
+	return op->take(reader);
+}
+
+EXPORT long reader_open_wait(ReaderOpen *op, uint32_t timeout, Reader **reader)
+{
+	if(op->status == OPEN_PENDING) {
+		op->result.timed_wait(posix_time::milliseconds(timeout));
+	}
+	return op->take(reader);
+}
+
+// Waits for open to finish. Reader that was not taken by poll or wait is closed.
+EXPORT long reader_open_free(ReaderOpen *op)
+{
+	op->worker.join();
+	delete op->reader;
+	delete op;
+	return 0;
+}
+
 EXPORT long reader_close(Reader *reader)
 {
 	try {
 		delete reader;
 		return 0;
 	} catch(boost::system::system_error& e) {
-		std::cerr << e.what() << std::endl;
+		U2_ERROR("%s",e.what());
 		return -1;
 	} catch(int& e) {
 		return e;
@@ -118,11 +218,175 @@ EXPORT long reader_save(Reader *reader, const char* path)
 	return reader->save(path);
 }
 
+// Dumps card through reader even when it is an emulator (reader_save just saves its image).
+EXPORT long reader_dump(Reader *reader, const char* path, uint32_t *unreadable)
+{
+	return reader->dump(path,unreadable);
+}
+
+// Sector access plans learned by dumps, see KeyPlanCache. Return 0 or errno value.
+EXPORT long reader_key_plan_load(Reader *reader, const char* path)
+{
+	return reader->get_key_plans().load(path);
+}
+
+EXPORT long reader_key_plan_save(Reader *reader, const char* path)
+{
+	return reader->get_key_plans().save(path);
+}
+
+// Sectors where learned plan worked at first attempt (hits) or failed (misses).
+EXPORT long reader_key_plan_stats(Reader *reader, uint64_t *hits, uint64_t *misses)
+{
+	*hits = reader->get_key_plans().hits();
+	*misses = reader->get_key_plans().misses();
+	return 0;
+}
+
 EXPORT long reader_load(Reader *reader, const char* path)
 {
 	return reader->load(path);
 }
 
+// Extended commands of reader firmware (CAP_* bits), probed on first use.
+EXPORT long reader_get_capabilities(Reader *reader, uint32_t *capabilities)
+{
+	*capabilities = reader->get_capabilities();
+	return 0;
+}
+
+// Overrides probed capabilities, e.g. 0 to compare with plain command set.
+EXPORT long reader_set_capabilities(Reader *reader, uint32_t capabilities)
+{
+	reader->set_capabilities(capabilities);
+	return 0;
+}
+
+EXPORT long reader_get_connection_info(Reader *reader, connection_info *info)
+{
+	return reader->get_connection_info(info);
+}
+
+// Fills out with latency stats of every command that has been sent through reader
+// (no more than max entries), count receives number of entries written.
+EXPORT long reader_get_stats(Reader *reader, command_stats *out, uint32_t max, uint32_t *count)
+{
+	*count = reader->get_stats().snapshot(out,max);
+	return 0;
+}
+
+// Fills out with counters of failed commands grouped by (result & ERR_MASK).
+EXPORT long reader_get_error_stats(Reader *reader, error_stats *out, uint32_t max, uint32_t *count)
+{
+	*count = reader->get_stats().snapshot_errors(out,max);
+	return 0;
+}
+
+// Copies STATS_BUCKETS raw histogram buckets of given command phase to buckets.
+EXPORT long reader_get_histogram(Reader *reader, uint8_t protocol, uint8_t code, uint8_t phase, uint32_t *buckets)
+{
+	return reader->get_stats().histogram(protocol,code,phase,buckets);
+}
+
+EXPORT long reader_reset_stats(Reader *reader)
+{
+	reader->get_stats().reset();
+	return 0;
+}
+
+// Starts process-wide command tracing into ring of at least events entries, 0 stops it.
+EXPORT long u2_trace_enable(uint32_t events)
+{
+	trace_enable(events);
+	return 0;
+}
+
+// Writes traced spans to path as Chrome/Perfetto trace-event JSON.
+// Returns 0 on success or errno value.
+EXPORT long u2_trace_dump(const char *path)
+{
+	return trace_dump(path);
+}
+
+// Sets level of messages that get logged: 0 - errors, 1 - warnings, 2 - info, 3 - debug.
+EXPORT long u2_log_set_level(int32_t level)
+{
+	log_set_level(level);
+	return 0;
+}
+
+EXPORT long u2_log_get_level()
+{
+	return log_threshold;
+}
+
+// Blocks until everything logged so far has been written out.
+EXPORT long u2_log_flush()
+{
+	log_flush();
+	return 0;
+}
+
+// Opens card database (CARD_DB_CREATE, CARD_DB_READONLY flags).
+// Returns 0 or errno value.
+EXPORT long card_db_open(const char *path, uint32_t flags, CardDb **db)
+{
+	CardDb *d = new CardDb();
+	long ret = d->open(path,flags);
+	if(ret) {
+		delete d;
+		return ret;
+	}
+	*db = d;
+	return 0;
+}
+
+EXPORT long card_db_close(CardDb *db)
+{
+	delete db;
+	return 0;
+}
+
+EXPORT long card_db_count(CardDb *db, uint64_t *count)
+{
+	*count = db->size();
+	return 0;
+}
+
+// Copies image of card with given sn to card. Returns NO_CARD when there is none.
+EXPORT long card_db_lookup(CardDb *db, uint64_t sn, CardStorage *card)
+{
+	CardStorage *found = db->lookup(sn);
+	if(!found) return NO_CARD;
+	*card = *found;
+	return 0;
+}
+
+// Appends card image, it replaces image with the same sn. Returns 0 or errno value.
+EXPORT long card_db_insert(CardDb *db, const CardStorage *card)
+{
+	return db->insert(*card);
+}
+
+typedef long (*card_db_callback)(const CardStorage *card, void *context);
+
+// Calls callback for the latest image of every card in insertion order.
+// Stops when callback returns non zero and returns that value.
+EXPORT long card_db_iterate(CardDb *db, card_db_callback callback, void *context)
+{
+	for(uint64_t i = 0; i < db->size(); i++) {
+		if(!db->is_current(i)) continue;
+		long ret = callback(db->get(i),context);
+		if(ret) return ret;
+	}
+	return 0;
+}
+
+EXPORT long card_db_sync(CardDb *db)
+{
+	return db->sync();
+}
+
 EXPORT long crc16_calc(void *data,uint32_t len,uint8_t low_endian)
 {
 	uint8_t *buffer = (uint8_t*)data;
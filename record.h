@@ -0,0 +1,44 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <boost/cstdint.hpp>
+
+using namespace boost;
+
+// Session file written by "record:<inner>" IOProvider and served by "replay:<file>".
+// File is RecordFileHeader followed by records. Every record is RecordEntry followed
+// by len bytes of payload padded to 8 bytes, so records can be walked in mmap'ed file
+// without copying.
+
+#define RECORD_MAGIC    0x43455232  // "2REC"
+#define RECORD_VERSION  1
+
+#define RECORD_SEND     1 // bytes given to IOProvider::send
+#define RECORD_SENT     2 // write completed, error holds system error value
+#define RECORD_RECV     3 // chunk of bytes that came from device
+#define RECORD_TIMEOUT  4 // timeout fired
+
+#pragma pack(push,1)
+struct RecordFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start;   // CLOCK_REALTIME of recording start, nanoseconds since epoch
+};
+
+struct RecordEntry
+{
+	uint64_t time;    // nanoseconds since recording start
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t error;   // RECORD_SENT: system error value of write, 0 on success
+	uint32_t len;     // length of payload that follows
+	uint32_t reserved;
+
+	inline size_t full_size() const {
+		return sizeof(*this) + ((len + 7) & ~7);
+	}
+};
+#pragma pack(pop)
+
+#endif //RECORD_H
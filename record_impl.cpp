@@ -0,0 +1,282 @@
+#include "protocol.h"
+#include "record.h"
+#include "custom_combiners.h"
+#include "log.h"
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/bind.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/signals2.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+
+using namespace boost;
+
+
+static uint64_t get_time_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void disconnector(signals2::connection c)
+{
+	c.disconnect();
+}
+
+// Wraps another IOProvider and writes everything that passes through it to a session file.
+// File is created in directory given by U2_RECORD_DIR (current directory by default)
+// with name u2-<pid>-<n>.rec.
+class RecordImpl : public IOProvider
+{
+	IOProvider *inner;
+	function<void ()> disconnect;
+
+	mutex file_mutex;
+	FILE *file;
+	uint64_t start;
+
+	signals2::signal<long (void *data, size_t len), combiner::maximum<long> > data_received;
+
+	void write(uint8_t type, const void *data, size_t len, uint32_t error = 0) {
+		static const uint8_t padding[8] = {0};
+
+		RecordEntry entry;
+		memset(&entry,0,sizeof(entry));
+		entry.time = get_time_ns(CLOCK_MONOTONIC) - start;
+		entry.type = type;
+		entry.error = error;
+		entry.len = len;
+
+		mutex::scoped_lock lock(file_mutex);
+		fwrite(&entry,sizeof(entry),1,file);
+		if(len) fwrite(data,len,1,file);
+		fwrite(padding,entry.full_size() - sizeof(entry) - len,1,file);
+		// recording is most needed when process crashes, so nothing is kept in stdio buffer
+		fflush(file);
+	}
+
+	long received(void *data, size_t len) {
+		write(RECORD_RECV,data,len);
+
+		if(data_received.empty()) {
+			unread(data,len);
+			return 0;
+		}
+		return data_received(data,len);
+	}
+
+	long sent(IOProvider::send_callback callback, size_t bytes_transferred, const system::error_code &error) {
+		write(RECORD_SENT,0,0,error.value());
+		return callback(bytes_transferred,error);
+	}
+
+	void timed_out(IOProvider::timeout_callback callback) {
+		write(RECORD_TIMEOUT,0,0);
+		callback();
+	}
+
+	static std::string make_path() {
+		static int counter = 0;
+		const char *dir = getenv("U2_RECORD_DIR");
+		char name[64];
+		snprintf(name,sizeof(name),"u2-%i-%i.rec",(int)getpid(),__sync_fetch_and_add(&counter,1));
+		return std::string(dir ? dir : ".") + "/" + name;
+	}
+
+public:
+	RecordImpl(IOProvider *_inner):inner(_inner) {
+		std::string path = make_path();
+		file = fopen(path.c_str(),"wb");
+		if(!file) {
+			int e = errno;
+			delete inner;
+			throw_exception(system::system_error(system::error_code(e,system::system_category())));
+		}
+		U2_INFO("RecordImpl: recording to %s",path.c_str());
+
+		start = get_time_ns(CLOCK_MONOTONIC);
+		RecordFileHeader header = { RECORD_MAGIC, RECORD_VERSION, get_time_ns(CLOCK_REALTIME) };
+		fwrite(&header,sizeof(header),1,file);
+		fflush(file);
+
+		disconnect = inner->listen(boost::bind(&RecordImpl::received,this,_1,_2));
+	}
+
+	virtual ~RecordImpl() {
+		disconnect();
+		delete inner;
+		fclose(file);
+	}
+
+	virtual function<void ()> listen(IOProvider::listen_callback callback) {
+		signals2::connection c = data_received.connect(callback);
+		return boost::bind(disconnector,c);
+	}
+
+	virtual void send(void *data, size_t len, IOProvider::send_callback callback) {
+		write(RECORD_SEND,data,len);
+		inner->send(data,len,boost::bind(&RecordImpl::sent,this,callback,_1,_2));
+	}
+
+	virtual long set_timeout(size_t timeout, IOProvider::timeout_callback callback) {
+		return inner->set_timeout(timeout,boost::bind(&RecordImpl::timed_out,this,callback));
+	}
+
+	virtual long cancel_timeout() {
+		return inner->cancel_timeout();
+	}
+};
+
+// Serves session recorded by RecordImpl. Every send is matched with the next
+// recorded send, and everything recorded after it up to the next send
+// (write completion, received chunks, timeout) is played back right away.
+// Path "timed" makes it keep original delays between send and the events after it,
+// otherwise session is replayed at full speed.
+class ReplayImpl : public IOProvider
+{
+	uint8_t *begin;
+	size_t size;
+	size_t cursor;
+	bool timed;
+
+	IOProvider::timeout_callback timeout_callback;
+
+	signals2::signal<long (void *data, size_t len), combiner::maximum<long> > data_received;
+
+	RecordEntry* next_entry() {
+		if(cursor + sizeof(RecordEntry) > size) return 0;
+		RecordEntry *entry = (RecordEntry*)(begin + cursor);
+		if(cursor + entry->full_size() > size) return 0;
+		cursor += entry->full_size();
+		return entry;
+	}
+
+	RecordEntry* peek_entry() {
+		size_t saved = cursor;
+		RecordEntry *entry = next_entry();
+		cursor = saved;
+		return entry;
+	}
+
+	void wait_until(uint64_t replay_start, uint64_t record_start, uint64_t record_time) {
+		if(!timed) return;
+
+		uint64_t target = replay_start + (record_time - record_start);
+		uint64_t now = get_time_ns(CLOCK_MONOTONIC);
+		if(target <= now) return;
+
+		struct timespec ts = { (time_t)((target - now) / 1000000000), (long)((target - now) % 1000000000) };
+		nanosleep(&ts,0);
+	}
+
+public:
+	ReplayImpl(const char *file, const char *path):begin(0),size(0),cursor(sizeof(RecordFileHeader)) {
+		timed = path && std::string(path) == "timed";
+
+		int fd = open(file,O_RDONLY);
+		struct stat st;
+		if(fd == -1 || fstat(fd,&st)) {
+			int e = errno;
+			if(fd != -1) close(fd);
+			throw_exception(system::system_error(system::error_code(e,system::system_category())));
+		}
+
+		size = st.st_size;
+		void *p = size ? mmap(0,size,PROT_READ,MAP_PRIVATE,fd,0) : MAP_FAILED;
+		close(fd);
+
+		RecordFileHeader *header = (RecordFileHeader*)p;
+		if(p == MAP_FAILED || size < sizeof(*header) || header->magic != RECORD_MAGIC
+		   || header->version != RECORD_VERSION) {
+			if(p != MAP_FAILED) munmap(p,size);
+			throw_exception(system::system_error(system::error_code(EINVAL,system::system_category())));
+		}
+		begin = (uint8_t*)p;
+	}
+
+	virtual ~ReplayImpl() {
+		munmap(begin,size);
+	}
+
+	virtual function<void ()> listen(IOProvider::listen_callback callback) {
+		signals2::connection c = data_received.connect(callback);
+		return boost::bind(disconnector,c);
+	}
+
+	virtual void send(void *data, size_t len, IOProvider::send_callback callback) {
+		RecordEntry *request = 0;
+		while((request = next_entry()) && request->type != RECORD_SEND);
+
+		if(!request) {
+			callback(0,asio::error::eof);
+			return;
+		}
+
+		if(request->len != len || memcmp(request + 1,data,len)) {
+			U2_DEBUG("ReplayImpl: recorded: %s",log_bytes(request + 1,request->len));
+			U2_DEBUG("ReplayImpl: sent: %s",log_bytes(data,len));
+			U2_WARN("ReplayImpl: request differs from recorded one");
+		}
+
+		uint64_t replay_start = get_time_ns(CLOCK_MONOTONIC);
+		RecordEntry *entry = 0;
+		while((entry = peek_entry()) && entry->type != RECORD_SEND) {
+			next_entry();
+			wait_until(replay_start,request->time,entry->time);
+
+			switch(entry->type) {
+			case RECORD_SENT:
+				callback(entry->error ? 0 : len,system::error_code(entry->error,system::system_category()));
+				break;
+			case RECORD_RECV:
+				if(data_received.empty()) {
+					unread(entry + 1,entry->len);
+				} else {
+					data_received(entry + 1,entry->len);
+				}
+				break;
+			case RECORD_TIMEOUT:
+				if(!timeout_callback.empty()) {
+					IOProvider::timeout_callback fire;
+					fire.swap(timeout_callback);
+					fire();
+				}
+				break;
+			}
+		}
+	}
+
+	virtual long set_timeout(size_t, IOProvider::timeout_callback callback) {
+		timeout_callback = callback;
+		return 0;
+	}
+
+	virtual long cancel_timeout() {
+		timeout_callback.clear();
+		return 0;
+	}
+};
+
+IOProvider* create_record_impl(IOProvider *inner)
+{
+	return inner ? new RecordImpl(inner) : 0;
+}
+
+IOProvider* create_replay_impl(const char *file, const char *path)
+{
+	return new ReplayImpl(file,path);
+}
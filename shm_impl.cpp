@@ -0,0 +1,174 @@
+#include "protocol.h"
+#include "shm_ring.h"
+#include "custom_combiners.h"
+#include "log.h"
+
+#include <iostream>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/signals2.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+
+using namespace boost;
+
+
+// Talks to a co-located server (see u2shm) through a pair of SPSC rings in shared memory.
+// Path is the name of shared memory segment created by server, e.g. "/u2-emulator".
+// Requests are written to the ring right in the calling thread, answers are
+// picked by a receiver thread that also serves timeout, so there is no io_service
+// handoff on the way and no syscalls while both sides are busy.
+class ShmImpl : public IOProvider
+{
+	// receiver never sleeps longer than that, so it notices stopping even if wakeup is lost
+	static const long idle_wait = 100;
+
+	ShmSegment *segment;
+
+	thread receiver;
+	volatile bool stopping;
+
+	mutex timeout_mutex;
+	bool timeout_active;
+	uint64_t deadline;
+	IOProvider::timeout_callback timeout_callback;
+
+	// Server may answer before send callback arms the timeout: receiver then cancels
+	// first and timeout set by the callback of that send must not be armed.
+	uint32_t exchange;        // bumped by every send
+	uint32_t cancelled;       // exchange whose timeout has been canceled
+
+	uint8_t read_buf[SHM_RING_SIZE / 2];
+
+	signals2::signal<long (void *data, size_t len), combiner::maximum<long> > data_received;
+
+	// measured in miliseconds
+	static uint64_t get_tick_count() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	// Returns time left till deadline in miliseconds, but not more than idle_wait.
+	long time_left() {
+		mutex::scoped_lock lock(timeout_mutex);
+		if(!timeout_active) return idle_wait;
+		uint64_t now = get_tick_count();
+		return deadline > now ? std::min<uint64_t>(deadline - now,idle_wait) : 0;
+	}
+
+	void check_timeout() {
+		IOProvider::timeout_callback callback;
+		{
+			mutex::scoped_lock lock(timeout_mutex);
+			if(!timeout_active || deadline > get_tick_count()) return;
+			timeout_active = false;
+			callback.swap(timeout_callback);
+		}
+		callback();
+	}
+
+	void receiver_thread() {
+		while(!stopping) {
+			if(segment->to_client.wait(time_left())) {
+				while(uint32_t len = segment->to_client.read(read_buf,sizeof(read_buf))) {
+					U2_DEBUG("ShmImpl::receive: %s",log_bytes(read_buf,len));
+					if(data_received.empty()) {
+						unread(read_buf,len);
+					} else {
+						data_received(read_buf,len);
+					}
+				}
+			}
+			check_timeout();
+		}
+	}
+
+public:
+	ShmImpl(const char *path, uint32_t, uint8_t)
+		:stopping(false),timeout_active(false),deadline(0),exchange(0),cancelled(~0u) {
+
+		segment = shm_segment_open(path,false);
+		if(!segment) {
+			throw_exception(system::system_error(system::error_code(ENOENT,system::system_category())));
+		}
+
+		receiver = thread(boost::bind(&ShmImpl::receiver_thread,this));
+	}
+
+	virtual ~ShmImpl() {
+		stopping = true;
+		segment->to_client.interrupt();
+		receiver.join();
+		shm_segment_close(segment);
+	}
+
+	virtual function<void ()> listen(IOProvider::listen_callback callback);
+	virtual void send(void *data, size_t len, IOProvider::send_callback callback);
+	virtual long set_timeout(size_t timeout, IOProvider::timeout_callback callback);
+	virtual long cancel_timeout();
+};
+
+static void disconnector(signals2::connection c)
+{
+	c.disconnect();
+}
+
+function<void ()> ShmImpl::listen(IOProvider::listen_callback callback)
+{
+	signals2::connection c = data_received.connect(callback);
+	return boost::bind(disconnector,c);
+}
+
+void ShmImpl::send(void *data, size_t len,IOProvider::send_callback callback)
+{
+	U2_DEBUG("ShmImpl::send: %s",log_bytes(data,len));
+
+	{
+		mutex::scoped_lock lock(timeout_mutex);
+		exchange++;
+	}
+
+	if(!segment->to_server.write(data,len)) {
+		callback(0,system::error_code(ENOBUFS,system::system_category()));
+		return;
+	}
+	segment->to_server.wake();
+
+	callback(len,system::error_code());
+}
+
+long ShmImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
+{
+	{
+		mutex::scoped_lock lock(timeout_mutex);
+		if(cancelled == exchange) return 0; // answer of this send has come already
+		timeout_active = true;
+		deadline = get_tick_count() + timeout;
+		timeout_callback = callback;
+	}
+	// receiver may sleep without deadline
+	segment->to_client.interrupt();
+
+	return 0;
+}
+
+long ShmImpl::cancel_timeout()
+{
+	mutex::scoped_lock lock(timeout_mutex);
+	timeout_active = false;
+	timeout_callback.clear();
+	cancelled = exchange;
+
+	return 0;
+}
+
+IOProvider* create_shm_impl(const char* path,uint32_t baud,uint8_t parity)
+{
+	return new ShmImpl(path,baud,parity);
+}
@@ -0,0 +1,166 @@
+#include "shm_ring.h"
+#include "log.h"
+
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static long futex(uint32_t *addr, int op, uint32_t value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex,addr,op,value,timeout,0,0);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+void ShmRing::init()
+{
+	head = 0;
+	tail = 0;
+	waiting = 0;
+	wake_seq = 0;
+}
+
+bool ShmRing::empty() const
+{
+	return __atomic_load_n(&tail,__ATOMIC_ACQUIRE) == head;
+}
+
+bool ShmRing::write(const void *message, uint32_t len)
+{
+	uint32_t current_tail = tail;
+	uint32_t used = current_tail - __atomic_load_n(&head,__ATOMIC_ACQUIRE);
+	if(SHM_RING_SIZE - used < sizeof(len) + len) return false;
+
+	const uint8_t *parts[2] = { (const uint8_t*)&len, (const uint8_t*)message };
+	uint32_t lengths[2] = { sizeof(len), len };
+	uint32_t pos = current_tail;
+
+	for(size_t i = 0; i < 2; i++) {
+		uint32_t index = pos & (SHM_RING_SIZE - 1);
+		uint32_t first = std::min(lengths[i],SHM_RING_SIZE - index);
+		memcpy(data + index,parts[i],first);
+		memcpy(data,parts[i] + first,lengths[i] - first);
+		pos += lengths[i];
+	}
+
+	__atomic_store_n(&tail,pos,__ATOMIC_RELEASE);
+	return true;
+}
+
+uint32_t ShmRing::read(void *buf, uint32_t buf_len)
+{
+	uint32_t pos = head;
+	if(__atomic_load_n(&tail,__ATOMIC_ACQUIRE) == pos) return 0;
+
+	uint32_t len = 0;
+	uint8_t *dst[2] = { (uint8_t*)&len, (uint8_t*)buf };
+	for(size_t i = 0; i < 2; i++) {
+		uint32_t wanted = i ? std::min(len,buf_len) : sizeof(len);
+		uint32_t index = pos & (SHM_RING_SIZE - 1);
+		uint32_t first = std::min(wanted,SHM_RING_SIZE - index);
+		memcpy(dst[i],data + index,first);
+		memcpy(dst[i] + first,data,wanted - first);
+		pos += i ? len : wanted;
+	}
+
+	__atomic_store_n(&head,pos,__ATOMIC_RELEASE);
+	return std::min(len,buf_len);
+}
+
+// Spinning makes sense only when the other side can run at the same time
+static const size_t spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_COUNT : 0;
+
+bool ShmRing::wait(long timeout)
+{
+	for(size_t i = 0; i < spin_count; i++) {
+		if(!empty()) return true;
+		cpu_relax();
+	}
+
+	// wake_seq is read before the ring is checked: wake or interrupt that comes
+	// after the check changes it and futex returns at once
+	uint32_t seq = __atomic_load_n(&wake_seq,__ATOMIC_ACQUIRE);
+	__atomic_store_n(&waiting,1,__ATOMIC_SEQ_CST);
+	if(!empty()) {
+		__atomic_store_n(&waiting,0,__ATOMIC_RELAXED);
+		return true;
+	}
+
+	struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+	if(futex(&wake_seq,FUTEX_WAIT,seq,timeout < 0 ? 0 : &ts) && errno != EAGAIN
+	   && errno != EINTR && errno != ETIMEDOUT) {
+		U2_WARN("ShmRing: futex(FUTEX_WAIT): %s",strerror(errno));
+	}
+	__atomic_store_n(&waiting,0,__ATOMIC_RELAXED);
+
+	return !empty();
+}
+
+void ShmRing::wake()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&waiting,__ATOMIC_RELAXED)) {
+		interrupt();
+	}
+}
+
+void ShmRing::interrupt()
+{
+	__atomic_add_fetch(&wake_seq,1,__ATOMIC_SEQ_CST);
+	futex(&wake_seq,FUTEX_WAKE,1,0);
+}
+
+ShmSegment* shm_segment_open(const char *name, bool create)
+{
+	int fd = shm_open(name,O_RDWR | (create ? O_CREAT : 0),0600);
+	if(fd == -1) {
+		U2_ERROR("shm_segment_open[%s]: shm_open: %s",name,strerror(errno));
+		return 0;
+	}
+
+	if(create && ftruncate(fd,sizeof(ShmSegment))) {
+		U2_ERROR("shm_segment_open[%s]: ftruncate: %s",name,strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	void *p = mmap(0,sizeof(ShmSegment),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		U2_ERROR("shm_segment_open[%s]: mmap: %s",name,strerror(errno));
+		return 0;
+	}
+
+	ShmSegment *segment = (ShmSegment*)p;
+	if(create) {
+		segment->to_server.init();
+		segment->to_client.init();
+		segment->size = sizeof(ShmSegment);
+		__atomic_store_n(&segment->magic,SHM_MAGIC,__ATOMIC_RELEASE);
+	} else if(__atomic_load_n(&segment->magic,__ATOMIC_ACQUIRE) != SHM_MAGIC
+	          || segment->size != sizeof(ShmSegment)) {
+		U2_ERROR("shm_segment_open[%s]: not a u2 segment",name);
+		shm_segment_close(segment);
+		return 0;
+	}
+
+	return segment;
+}
+
+void shm_segment_close(ShmSegment *segment)
+{
+	if(segment) munmap(segment,sizeof(ShmSegment));
+}
@@ -0,0 +1,64 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+
+using namespace boost;
+
+#define SHM_RING_SIZE   65536  // must be power of two
+#define SHM_MAGIC       0x55324D53
+#define SHM_SPIN_COUNT  2000   // ring checks before consumer goes to sleep on futex
+
+// Single-producer/single-consumer ring of messages placed in shared memory.
+// Every message is stored as 32-bit length followed by its bytes, so consumer
+// always gets exactly what producer has written in one call.
+// head and tail are free running counters: head is changed by consumer only,
+// tail by producer only. Consumer sleeps with futex on wake_seq when ring is empty,
+// every wake and interrupt bumps it, so a wakeup that comes before the sleep is not lost.
+struct ShmRing
+{
+	uint32_t head;
+	uint8_t pad1[60];      // head and tail live in different cache lines
+	uint32_t tail;
+	uint32_t waiting;      // consumer is about to sleep or is sleeping on wake_seq
+	uint32_t wake_seq;     // futex word, changed by every wake and interrupt
+	uint8_t pad2[52];
+	uint8_t data[SHM_RING_SIZE];
+
+	void init();
+
+	// Returns false when there is not enough free space for the message.
+	bool write(const void *message, uint32_t len);
+
+	// Moves next message to buf. Returns its length or 0 when ring is empty.
+	// Part of the message that does not fit into buf is dropped.
+	uint32_t read(void *buf, uint32_t buf_len);
+
+	bool empty() const;
+
+	// Blocks until ring is not empty, interrupt is called or timeout expires.
+	// timeout < 0 means infinite wait. Returns true when ring is not empty.
+	bool wait(long timeout);
+
+	// Wakes consumer if it sleeps. Producer calls it after write.
+	void wake();
+
+	// Unconditionally wakes threads sleeping in wait (e.g. to make them notice changes).
+	void interrupt();
+};
+
+struct ShmSegment
+{
+	uint32_t magic;
+	uint32_t size;
+	ShmRing to_server;
+	ShmRing to_client;
+};
+
+// Maps shared memory segment with given name (e.g. "/u2-emulator").
+// Server creates it, client opens existing one. Returns 0 on failure.
+ShmSegment* shm_segment_open(const char *name, bool create);
+void shm_segment_close(ShmSegment *segment);
+
+#endif //SHM_RING_H
@@ -0,0 +1,237 @@
+#include "stats.h"
+#include "protocol.h"
+
+#include <cstring>
+#include <algorithm>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+using namespace std;
+
+uint64_t stats_now()
+{
+#ifdef WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	if(!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart * (1000000000.0 / frequency.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline size_t highest_bit(uint64_t value)
+{
+	size_t bit = 0;
+	while(value >>= 1) bit++;
+	return bit;
+}
+
+size_t Histogram::bucket(uint64_t value)
+{
+	const uint64_t sub_buckets = 1 << STATS_SUB_BITS;
+	if(value < sub_buckets) return value;
+
+	size_t magnitude = highest_bit(value);
+	size_t index = (magnitude - STATS_SUB_BITS + 1) * sub_buckets
+	             + ((value >> (magnitude - STATS_SUB_BITS)) & (sub_buckets - 1));
+	return min(index,(size_t)STATS_BUCKETS - 1);
+}
+
+uint64_t Histogram::bucket_value(size_t bucket)
+{
+	const uint64_t sub_buckets = 1 << STATS_SUB_BITS;
+	if(bucket < sub_buckets) return bucket;
+
+	size_t magnitude = bucket / sub_buckets + STATS_SUB_BITS - 1;
+	uint64_t sub = bucket % sub_buckets;
+	return (sub_buckets + sub) << (magnitude - STATS_SUB_BITS);
+}
+
+void Histogram::record(uint64_t value)
+{
+	__sync_fetch_and_add(&buckets[bucket(value)],1);
+	__sync_fetch_and_add(&sum,value);
+	__sync_fetch_and_add(&count,1);
+
+	uint64_t current = max;
+	while(value > current) {
+		uint64_t seen = __sync_val_compare_and_swap(&max,current,value);
+		if(seen == current) break;
+		current = seen;
+	}
+}
+
+void Histogram::reset()
+{
+	for(size_t i = 0; i < STATS_BUCKETS; i++) __atomic_store_n(&buckets[i],0,__ATOMIC_RELAXED);
+	__atomic_store_n(&sum,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&count,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&max,0,__ATOMIC_RELAXED);
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+	uint64_t total = 0;
+	for(size_t i = 0; i < STATS_BUCKETS; i++) total += buckets[i];
+	if(!total) return 0;
+
+	uint64_t wanted = (uint64_t)(total * p / 100.0 + 0.5);
+	if(!wanted) wanted = 1;
+
+	uint64_t seen = 0;
+	for(size_t i = 0; i < STATS_BUCKETS; i++) {
+		seen += buckets[i];
+		if(seen >= wanted) return bucket_value(i);
+	}
+	return max;
+}
+
+ReaderStats::ReaderStats()
+{
+	memset(commands,0,sizeof(commands));
+	memset(errors,0,sizeof(errors));
+}
+
+ReaderStats::~ReaderStats()
+{
+	for(size_t p = 0; p < STATS_PROTOCOLS; p++) {
+		for(size_t c = 0; c < 256; c++) {
+			delete commands[p][c];
+		}
+	}
+}
+
+CommandStats* ReaderStats::get(uint8_t protocol, uint8_t code)
+{
+	if(protocol >= STATS_PROTOCOLS) return 0;
+
+	CommandStats *stats = commands[protocol][code];
+	if(stats) return stats;
+
+	CommandStats *fresh = new CommandStats();
+	memset(fresh,0,sizeof(*fresh));
+	stats = __sync_val_compare_and_swap(&commands[protocol][code],(CommandStats*)0,fresh);
+	if(stats) {
+		delete fresh; // another thread was faster
+		return stats;
+	}
+	return fresh;
+}
+
+void ReaderStats::record_error(uint32_t result_class)
+{
+	// open addressing, slots are never freed, so lookup stops at first empty one
+	size_t start = (result_class ^ (result_class >> 16)) % STATS_ERROR_CLASSES;
+	for(size_t i = 0; i < STATS_ERROR_CLASSES; i++) {
+		error_slot *slot = errors + (start + i) % STATS_ERROR_CLASSES;
+		uint32_t key = slot->result_class;
+		if(!key) key = __sync_val_compare_and_swap(&slot->result_class,0,result_class);
+		if(!key || key == result_class) {
+			__sync_fetch_and_add(&slot->count,1);
+			return;
+		}
+	}
+}
+
+void ReaderStats::record(uint8_t protocol, uint8_t code, const uint64_t *timing, long result)
+{
+	CommandStats *stats = get(protocol,code);
+	if(!stats) return;
+
+	__sync_fetch_and_add(&stats->count,1);
+	if(result) {
+		__sync_fetch_and_add(&stats->errors,1);
+		record_error(result & ERR_MASK);
+	}
+
+	for(size_t phase = STATS_ENCODE; phase <= STATS_WAKEUP; phase++) {
+		uint64_t from = timing[phase];
+		uint64_t to = timing[phase + 1];
+		// points are missing when command failed before reaching them
+		if(from && to >= from) stats->phases[phase].record(to - from);
+	}
+
+	if(timing[TIMING_START] && timing[TIMING_WAKEUP]) {
+		stats->phases[STATS_TOTAL].record(timing[TIMING_WAKEUP] - timing[TIMING_START]);
+	}
+}
+
+size_t ReaderStats::snapshot(command_stats *out, size_t max) const
+{
+	size_t n = 0;
+	for(size_t p = 0; p < STATS_PROTOCOLS; p++) {
+		for(size_t c = 0; c < 256 && n < max; c++) {
+			const CommandStats *stats = commands[p][c];
+			if(!stats || !stats->count) continue;
+
+			command_stats *s = out + n++;
+			s->protocol = p;
+			s->code = c;
+			s->count = stats->count;
+			s->errors = stats->errors;
+			for(size_t phase = 0; phase < STATS_PHASES; phase++) {
+				const Histogram &h = stats->phases[phase];
+				s->phases[phase].count = h.count;
+				s->phases[phase].sum = h.sum;
+				s->phases[phase].max = h.max;
+				s->phases[phase].p50 = h.percentile(50);
+				s->phases[phase].p90 = h.percentile(90);
+				s->phases[phase].p99 = h.percentile(99);
+				s->phases[phase].p999 = h.percentile(99.9);
+			}
+		}
+	}
+	return n;
+}
+
+size_t ReaderStats::snapshot_errors(error_stats *out, size_t max) const
+{
+	size_t n = 0;
+	for(size_t i = 0; i < STATS_ERROR_CLASSES && n < max; i++) {
+		if(!errors[i].result_class || !errors[i].count) continue;
+		out[n].result_class = errors[i].result_class;
+		out[n].count = errors[i].count;
+		n++;
+	}
+	return n;
+}
+
+long ReaderStats::histogram(uint8_t protocol, uint8_t code, uint8_t phase, uint32_t *buckets) const
+{
+	if(protocol >= STATS_PROTOCOLS || phase >= STATS_PHASES) return -1;
+
+	const CommandStats *stats = commands[protocol][code];
+	if(!stats) {
+		memset(buckets,0,sizeof(uint32_t) * STATS_BUCKETS);
+	} else {
+		memcpy(buckets,stats->phases[phase].buckets,sizeof(uint32_t) * STATS_BUCKETS);
+	}
+	return 0;
+}
+
+// Commands may be recorded at the same time, so every counter is zeroed with atomic store.
+// Error classes keep their slots: clearing a key under a concurrent lookup could make it
+// take another slot, so only counts are zeroed and snapshot skips empty ones.
+void ReaderStats::reset()
+{
+	for(size_t p = 0; p < STATS_PROTOCOLS; p++) {
+		for(size_t c = 0; c < 256; c++) {
+			CommandStats *stats = __atomic_load_n(&commands[p][c],__ATOMIC_ACQUIRE);
+			if(!stats) continue;
+			__atomic_store_n(&stats->count,0,__ATOMIC_RELAXED);
+			__atomic_store_n(&stats->errors,0,__ATOMIC_RELAXED);
+			for(size_t phase = 0; phase < STATS_PHASES; phase++) stats->phases[phase].reset();
+		}
+	}
+	for(size_t i = 0; i < STATS_ERROR_CLASSES; i++) {
+		__atomic_store_n(&errors[i].count,0,__ATOMIC_RELAXED);
+	}
+}
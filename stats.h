@@ -0,0 +1,130 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+
+using namespace boost;
+
+// Monotonic time in nanoseconds.
+uint64_t stats_now();
+
+// Points of command life that protocols and Reader mark.
+enum timing_point {
+	TIMING_START = 0,      // Reader started command
+	TIMING_ENCODED,        // packet has been built and handed to IOProvider
+	TIMING_WRITTEN,        // IOProvider reported completion of write
+	TIMING_FIRST_BYTE,     // first chunk of answer came
+	TIMING_ANSWER,         // answer (or error) has been set by protocol
+	TIMING_WAKEUP,         // caller thread got the answer
+	TIMING_POINTS
+};
+
+// Latency histograms are kept for intervals between successive timing points
+// and for the whole command.
+enum stats_phase {
+	STATS_ENCODE = 0,      // START -> ENCODED
+	STATS_WRITE,           // ENCODED -> WRITTEN
+	STATS_FIRST_BYTE,      // WRITTEN -> FIRST_BYTE
+	STATS_FRAME,           // FIRST_BYTE -> ANSWER
+	STATS_WAKEUP,          // ANSWER -> WAKEUP
+	STATS_TOTAL,           // START -> WAKEUP
+	STATS_PHASES
+};
+
+#define PROTOCOL_SUBWAY     0
+#define PROTOCOL_TERMINAL   1
+#define STATS_PROTOCOLS     2
+
+// Log-linear buckets: values below 8ns are exact, every power of two above
+// is split into 8 buckets, so any value is known with 12.5% precision.
+#define STATS_SUB_BITS      3
+#define STATS_BUCKETS       320  // up to 2^42 ns (~73 min)
+#define STATS_ERROR_CLASSES 64
+
+struct Histogram
+{
+	uint32_t count;
+	uint32_t buckets[STATS_BUCKETS];
+	uint64_t sum;
+	uint64_t max;
+
+	void record(uint64_t value);
+
+	// Zeroes every field with atomic store, safe while record runs in other threads.
+	void reset();
+
+	// Returns lower bound of bucket holding given percentile (0..100).
+	uint64_t percentile(double p) const;
+
+	static size_t bucket(uint64_t value);
+	static uint64_t bucket_value(size_t bucket);
+};
+
+struct CommandStats
+{
+	uint32_t count;
+	uint32_t errors;
+	Histogram phases[STATS_PHASES];
+};
+
+#pragma pack(push,1)
+// Snapshot of latency histogram, returned through C API. Values are in nanoseconds.
+struct phase_stats
+{
+	uint32_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+struct command_stats
+{
+	uint8_t protocol;
+	uint8_t code;
+	uint32_t count;
+	uint32_t errors;
+	phase_stats phases[STATS_PHASES];
+};
+
+struct error_stats
+{
+	uint32_t result_class; // result & ERR_MASK
+	uint32_t count;
+};
+#pragma pack(pop)
+
+// Statistics of all commands of one Reader. Recording is lock-free: per-command
+// stats are allocated on first use with CAS and counters are updated with atomic
+// adds, so commands of different threads never wait for each other here.
+// Snapshots are taken without stopping recording and may be off by commands
+// that are being recorded at the moment.
+class ReaderStats
+{
+	CommandStats *commands[STATS_PROTOCOLS][256];
+
+	struct error_slot {
+		uint32_t result_class;
+		uint32_t count;
+	} errors[STATS_ERROR_CLASSES];
+
+	CommandStats* get(uint8_t protocol, uint8_t code);
+	void record_error(uint32_t result_class);
+public:
+	ReaderStats();
+	~ReaderStats();
+
+	void record(uint8_t protocol, uint8_t code, const uint64_t *timing, long result);
+
+	// Returns number of command_stats written to out (no more than max).
+	size_t snapshot(command_stats *out, size_t max) const;
+	size_t snapshot_errors(error_stats *out, size_t max) const;
+	// Copies raw buckets of given histogram, returns 0 on success.
+	long histogram(uint8_t protocol, uint8_t code, uint8_t phase, uint32_t *buckets) const;
+	void reset();
+};
+
+#endif //STATS_H
@@ -2,6 +2,8 @@
 
 #include "api_subway_low.h"
 #include "crc16.h"
+#include "probes.h"
+#include "log.h"
 
 #include <string>
 #include <cstring>
@@ -13,17 +15,27 @@
 using namespace boost;
 
 static const size_t TIMEOUT = 1500;
-static const int log_level = getenv("DEBUG_SUBWAY_PROTOCOL") != 0;
 
 size_t PacketHeader::full_size() const {
-	return sizeof(*this) + this->len + CRC_LEN;
+	return header_size() + data_len() + CRC_LEN;
+}
+
+size_t PacketHeader::header_size() const {
+	return sizeof(*this) + (this->len == EXT_LEN ? sizeof(uint16_t) : 0);
+}
+
+size_t PacketHeader::data_len() const {
+	if(this->len != EXT_LEN) return this->len;
+
+	const uint8_t *ext = (const uint8_t*)this + sizeof(*this);
+	return ext[0] | (ext[1] << 8);
 }
 
 bool PacketHeader::crc_check() const {
 	size_t len = this->full_size() - CRC_LEN;
-	CRC16_Calc(this,len);
+	uint16_t crc = crc16(this,len);
 	uint8_t *p = (uint8_t*)this;
-	return p[len] == CRC16_Low && p[len+1] == CRC16_High;
+	return p[len] == (crc & 0xFF) && p[len+1] == (crc >> 8);
 }
 
 uint32_t PacketHeader::nack_data() const {
@@ -33,11 +45,11 @@ uint32_t PacketHeader::nack_data() const {
 }
 
 uint8_t* PacketHeader::data() const {
-	return (uint8_t*)this + sizeof(*this);
+	return (uint8_t*)this + header_size();
 }
 
 size_t PacketHeader::get_data(void *buf,size_t len) const {
-	size_t copy_len = std::min((size_t)this->len,len);
+	size_t copy_len = std::min(data_len(),len);
 	memcpy(buf,data(),copy_len);
 	return copy_len;
 }
@@ -48,38 +60,33 @@ uint16_t prepare_packet(uint8_t addr, uint8_t code, void *packet, size_t packet_
 	header->addr = addr;
 	header->code = code;
 
-	CRC16_Calc(packet,packet_len - CRC_LEN);
+	uint16_t crc = crc16(packet,packet_len - CRC_LEN);
 
     uint8_t *packet_u8 = (uint8_t*)packet;
-	packet_u8[packet_len - 1] = CRC16_High;
-	packet_u8[packet_len - 2] = CRC16_Low;
+	packet_u8[packet_len - 1] = crc >> 8;
+	packet_u8[packet_len - 2] = crc & 0xFF;
 
-	return (CRC16_High << 8) + CRC16_Low;
+	return crc;
 }
 
 long create_custom_packet(void *packet, size_t max_packet_len,
 						  uint8_t addr, uint8_t code,
-						  void *data, uint8_t len) {
-	if(max_packet_len < sizeof(PacketHeader)) return -1;
+						  void *data, size_t len) {
+	if(len > MAX_PACKET_DATA) return -1;
+	if(max_packet_len < sizeof(PacketHeader) + sizeof(uint16_t)) return -1;
 
 	PacketHeader *header = (PacketHeader*)packet;
-	header->len = len;
+	header->len = len < EXT_LEN ? len : EXT_LEN;
+	if(header->len == EXT_LEN) {
+		uint8_t *ext = (uint8_t*)packet + sizeof(PacketHeader);
+		ext[0] = len & 0xFF;
+		ext[1] = len >> 8;
+	}
 	
 	size_t packet_len = header->full_size();
 	if(max_packet_len < packet_len) return -1;
-#ifdef WIN32
-#pragma warning( push )
-#pragma warning( disable : 4200 )
-#endif
-	struct CustomPacket {
-		PacketHeader header;
-		uint8_t contents[0];
-	} *custom_packet = (CustomPacket*)packet;
-#ifdef WIN32
-#pragma warning( pop )
-#endif
-
-	memcpy(custom_packet->contents,data,len);
+
+	memcpy(header->data(),data,len);
 	prepare_packet(addr,code,packet,packet_len);	
 
 	return packet_len;
@@ -135,6 +142,111 @@ size_t bytestaff(void *dst_buf, size_t dst_len, void *src_buf,size_t src_len) {
 	return dst - (uint8_t*)dst_buf;
 }
 
+static inline uint8_t* bytestaff_byte(uint8_t *dst, uint8_t c) {
+	if(c == FBGN) {
+		*dst++ = FESC;
+		*dst++ = TFBGN;
+	} else if(c == FESC) {
+		*dst++ = FESC;
+		*dst++ = TFESC;
+	} else {
+		*dst++ = c;
+	}
+	return dst;
+}
+
+static long frame_written(size_t, const system::error_code&)
+{
+	return 0;
+}
+
+void send_frame(IOProvider *impl, PacketHeader *header)
+{
+	uint8_t request[MAX_BYTESTAFFED_PACKET];
+	size_t len = bytestaff(request,sizeof(request),header,header->full_size());
+	impl->send(request,len,frame_written);
+}
+
+size_t bytestaff_packet(void *dst_buf, size_t dst_len,
+						uint8_t addr, uint8_t code,
+						const void *data, size_t len) {
+	if(len > MAX_PACKET_DATA) return 0;
+	// every byte but FBGN may take two
+	if(dst_len < 1 + 2 * (sizeof(PacketHeader) - 1 + sizeof(uint16_t) + len + CRC_LEN)) return 0;
+
+	uint8_t *dst = (uint8_t*)dst_buf;
+	const uint8_t *src = (const uint8_t*)data;
+	const uint8_t *src_end = src + len;
+
+	uint16_t crc = crc16_update(CRC16_INIT,FBGN);
+	*dst++ = FBGN;
+
+	crc = crc16_update(crc,addr);
+	dst = bytestaff_byte(dst,addr);
+	crc = crc16_update(crc,code);
+	dst = bytestaff_byte(dst,code);
+	uint8_t header_len = len < EXT_LEN ? len : EXT_LEN;
+	crc = crc16_update(crc,header_len);
+	dst = bytestaff_byte(dst,header_len);
+	if(header_len == EXT_LEN) {
+		crc = crc16_update(crc,len & 0xFF);
+		dst = bytestaff_byte(dst,len & 0xFF);
+		crc = crc16_update(crc,len >> 8);
+		dst = bytestaff_byte(dst,len >> 8);
+	}
+
+	while(src != src_end) {
+		crc = crc16_update(crc,*src);
+		dst = bytestaff_byte(dst,*src++);
+	}
+
+	dst = bytestaff_byte(dst,crc & 0xFF);
+	dst = bytestaff_byte(dst,crc >> 8);
+
+	return dst - (uint8_t*)dst_buf;
+}
+
+size_t unbytestaff_packet(void *dst_buf, size_t dst_len, const void *src_buf, size_t src_len, bool *crc_ok) {
+	*crc_ok = false;
+
+	const uint8_t *src = (const uint8_t*)src_buf;
+	const uint8_t *src_end = src + src_len;
+	uint8_t *dst = (uint8_t*)dst_buf;
+	uint8_t *dst_end = dst + dst_len;
+
+	while(src != src_end && *src != FBGN) src++;
+
+	// crc of everything but the last two bytes, those are crc itself
+	uint16_t crc[3] = { CRC16_INIT, CRC16_INIT, CRC16_INIT };
+	size_t full_size = dst_len;
+	bool escape = false;
+	while(src != src_end && dst != dst_end) {
+		uint8_t c = *src++;
+		if(escape) {
+			c = c == TFBGN ? FBGN : FESC;
+			escape = false;
+		} else if(c == FESC) {
+			escape = true;
+			continue;
+		}
+
+		*dst++ = c;
+		crc[0] = crc[1];
+		crc[1] = crc[2];
+		crc[2] = crc16_update(crc[2],c);
+
+		size_t size = dst - (uint8_t*)dst_buf;
+		if(size >= sizeof(PacketHeader) && size == ((PacketHeader*)dst_buf)->header_size()) {
+			full_size = ((PacketHeader*)dst_buf)->full_size();
+		}
+		if(size == full_size) {
+			*crc_ok = dst[-2] == (crc[0] & 0xFF) && dst[-1] == (crc[0] >> 8);
+			break;
+		}
+	}
+
+	return dst - (uint8_t*)dst_buf;
+}
 
 EXPORT long bytestaffing_test(uint8_t *data,size_t len) {
 	//debug_data("data_in",data,len);
@@ -221,8 +333,71 @@ void SubwayUnbytestaffer::reset() {
 	escape = false;
 }
 
+SubwayFrameParser::SubwayFrameParser() {
+	reset();
+}
+
+void SubwayFrameParser::reset() {
+	size = 0;
+	wait_for_fbgn = true;
+	escape = false;
+}
+
+void SubwayFrameParser::push(uint8_t c) {
+	if(size < sizeof(frame)) {
+		frame[size++] = c;
+	} else {
+		reset(); // cannot be a valid frame, wait for the next one
+	}
+}
+
+bool SubwayFrameParser::completed() const {
+	if(size < sizeof(PacketHeader)) return false;
+
+	const PacketHeader *header = (PacketHeader*)frame;
+	return size >= header->header_size() && size >= header->full_size();
+}
+
+void SubwayFrameParser::feed(void *data, size_t len, frame_callback callback) {
+	if(!data || !len) return;
+
+	uint8_t *src = (uint8_t*)data;
+	uint8_t *src_end = src + len;
+
+	while(src != src_end) {
+		uint8_t c = *src++;
+		if(c == FBGN) {
+			// FBGN never appears inside bytestaffed frame
+			if(!wait_for_fbgn && size) {
+				U2_DEBUG("incomplete frame dropped: %s",log_bytes(frame,size));
+			}
+			reset();
+			wait_for_fbgn = false;
+			push(c);
+			continue;
+		}
+
+		if(wait_for_fbgn) continue;
 
-SubwayProtocol::SubwayProtocol(IOProvider *_provider):provider(_provider) {
+		if(escape) {
+			push(c == TFBGN ? FBGN : FESC);
+			if(c != TFBGN && c != TFESC) push(c);
+			escape = false;
+		} else if(c == FESC) {
+			escape = true;
+		} else {
+			push(c);
+		}
+
+		if(completed()) {
+			callback((PacketHeader*)frame);
+			reset();
+		}
+	}
+}
+
+
+SubwayProtocol::SubwayProtocol(IOProvider *_provider):Protocol(PROTOCOL_SUBWAY),provider(_provider) {
 	disconnect = provider->listen(boost::bind(&SubwayProtocol::feed,this,_1,_2));
 }
 
@@ -234,38 +409,50 @@ SubwayProtocol::~SubwayProtocol() {
 // Fires when maximum packet waiting time expired. If its called, that means not 
 // enough data came from the serial port to be recognized as a complete packet by read callbacks.
 void SubwayProtocol::timeout() {
-	if(log_level) std::cerr << "SubwayProtocol::timeout" << std::endl;
+	U2_DEBUG("SubwayProtocol::timeout");
+	U2_PROBE(timeout,get_reader(),get_command_addr(),get_command_code(),0,NO_ANSWER);
 	set_answer(ProtocolAnswer(NO_ANSWER));
 }
 
 long SubwayProtocol::write_callback(size_t bytes_sent_to_transfer, size_t bytes_transferred,
 									const system::error_code &error) {
+	TraceSpan span("write_callback",get_trace_id(),bytes_transferred);
 	if (error)
 	{
-		std::cerr << "write_callback error:" << error << ": " << error.message() << std::endl;
+		U2_WARN("write_callback error:%i: %s",error.value(),error.message().c_str());
 		set_answer(ProtocolAnswer(IO_ERROR));
 		return -1;
 	}
 
-	if(log_level) std::cerr << "write_callback: " << bytes_transferred << "/" << bytes_sent_to_transfer << std::endl;
+	U2_DEBUG("write_callback: %zu/%zu",bytes_transferred,bytes_sent_to_transfer);
+	mark(TIMING_WRITTEN);
 
-	provider->set_timeout(TIMEOUT,boost::bind(&SubwayProtocol::timeout,this));
+	{
+		TraceSpan span("set_timeout",get_trace_id(),TIMEOUT);
+		provider->set_timeout(TIMEOUT,boost::bind(&SubwayProtocol::timeout,this));
+	}
 
 	return 0;
 }
 
 long SubwayProtocol::send(uint8_t addr, uint8_t code, void *data, size_t len) {
-	uint8_t packet[256] = {0};
-	long packet_len = create_custom_packet(packet,sizeof(packet),addr,code,data,len);
-	if(packet_len == -1) {
-		std::cerr << "create_custom_packet failed for command code: " << code << std::endl;
+	size_t write_buf_len = len <= MAX_PACKET_DATA ? bytestaff_packet(write_buf,sizeof(write_buf),addr,code,data,len) : 0;
+	if(!write_buf_len) {
+		U2_WARN("bytestaff_packet failed for command code: %02hhX",code);
 		return -0xCF;
 	}
+	mark(TIMING_ENCODED);
+	U2_PROBE(frame_send,get_reader(),addr,code,len,0);
 
-	size_t write_buf_len = bytestaff(write_buf,sizeof(write_buf),packet,packet_len);
+	U2_DEBUG("send: %s",log_bytes(write_buf,write_buf_len));
 
-	if(log_level) debug_data("send",write_buf,write_buf_len);
+	// whatever came while nobody listened (e.g. late answer to a command that
+	// timed out) must not be taken for the answer to this one
+	if(size_t stale = provider->discard_unread()) {
+		U2_DEBUG("send: %zu stale bytes dropped",stale);
+	}
 
+	TraceSpan span("IOProvider::send",get_trace_id(),write_buf_len);
 	provider->send(write_buf,write_buf_len,
 		boost::bind(&SubwayProtocol::write_callback,this,write_buf_len,_1,_2));
 
@@ -273,34 +460,57 @@ long SubwayProtocol::send(uint8_t addr, uint8_t code, void *data, size_t len) {
 }
 
 void SubwayProtocol::set_answer(ProtocolAnswer answer) {
+	TraceSpan span("set_answer",get_trace_id(),answer.result);
 	if(!disconnect.empty()) {
 		disconnect();
 		disconnect.clear();
 	}
-	provider->cancel_timeout();
+	{
+		TraceSpan span("cancel_timeout",get_trace_id());
+		provider->cancel_timeout();
+	}
 	Protocol::set_answer(answer);
 }
 
 long SubwayProtocol::feed(void *data, size_t len) {
-	if(log_level) debug_data("feed",data,len);
+	U2_DEBUG("feed: %s",log_bytes(data,len));
 
 	if(!data || !len) return 0;
+	mark(TIMING_FIRST_BYTE);
+	TraceSpan span("feed",get_trace_id(),len);
 
-	filter.feed(data,len);
-
-	if(filter.size() < sizeof(PacketHeader)) return 0;
+	ProtocolAnswer answer(NO_ANSWER);
+	bool answered = false;
+	parser.feed(data,len,boost::bind(&SubwayProtocol::frame,this,_1,&answer,&answered));
+	if(!answered) return disconnect.empty() ? 1 : 0;
 
-	PacketHeader *header = filter.get<PacketHeader*>();
+	// waiting thread may destroy this protocol as soon as the answer is set,
+	// so nothing is touched after it
+	set_answer(answer);
+	return 1;
+}
 
-	if(filter.size() < header->full_size()) return 0; //not enough data
+void SubwayProtocol::frame(PacketHeader *header, ProtocolAnswer *answer, bool *answered) {
+	if(*answered) {
+		U2_DEBUG("frame after answer dropped: %02hhX %02hhX",header->addr,header->code);
+		return;
+	}
 
 	if(!header->crc_check()) {
-		set_answer(ProtocolAnswer(PACKET_CRC_ERROR));
+		U2_PROBE(crc_fail,get_reader(),header->addr,header->code,header->data_len(),PACKET_CRC_ERROR);
+		*answer = ProtocolAnswer(PACKET_CRC_ERROR);
+	} else if(header->addr != get_command_addr()
+	          || (header->code != get_command_code() && header->code != NACK_BYTE)) {
+		// answer to some other command, this one is still waited for
+		U2_DEBUG("foreign frame dropped: %02hhX %02hhX",header->addr,header->code);
+		return;
 	} else if(header->code == NACK_BYTE) {
-		set_answer(ProtocolAnswer(header->nack_data(),header->addr,header->code));
+		U2_PROBE(nack,get_reader(),header->addr,header->code,header->data_len(),header->nack_data());
+		*answer = ProtocolAnswer(header->nack_data(),header->addr,header->code);
 	} else {
-		set_answer(ProtocolAnswer(header->data(),header->len,header->addr,header->code));
+		U2_PROBE(frame_received,get_reader(),header->addr,header->code,header->data_len(),0);
+		*answer = ProtocolAnswer(header->data(),header->data_len(),header->addr,header->code);
 	}
 
-	return 1;
-}
\ No newline at end of file
+	*answered = true;
+}
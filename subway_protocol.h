@@ -13,30 +13,62 @@
 
 #define CRC_LEN		2
 
+// Extended frame: header len equal to EXT_LEN means that payload length follows
+// header as 16 bit little endian value and payload starts right after it.
+// Payloads of EXT_LEN bytes and longer always go in extended frames, none of
+// plain commands carries that many.
+#define EXT_LEN         0xFF
+#define MAX_PACKET_DATA 1024
+#define MAX_PACKET_SIZE (4 + 2 + MAX_PACKET_DATA + CRC_LEN)
+
 // Parameters:
 // void* packet - buffer for packet being constructed
 // size_t max_packet_len - Length of packet buffer. Maximal possible length of constructed packet.
 // uint8_t addr - addr of packet being constructed
 // uint8_t code - code of packet being constructed
 // void *data - payload of packet being constructed
-// uint8_t len - length of data buffer
+// size_t len - length of data buffer, up to MAX_PACKET_DATA (extended frame from EXT_LEN)
 //
 // Return value:
 // -1 when there is not enough space in given buffer for complete packet;
 // length of successfully constructed packet otherwise
 long create_custom_packet(void *packet,size_t max_packet_len,
 						  uint8_t addr, uint8_t code,
-						  void *data, uint8_t len);
+						  void *data, size_t len);
 
 size_t unbytestaff(void* dst_buf,size_t dst_len,void *src_buf,size_t src_len,bool wait_for_fbgn = true);
 size_t bytestaff(void *dst_buf, size_t dst_len, void *src_buf,size_t src_len);
 
+// Fused codec paths: the same as create_custom_packet + bytestaff and
+// unbytestaff + PacketHeader::crc_check, done in a single pass over data.
+//
+// Builds packet straight into bytestaffed form.
+// Returns length of bytestaffed packet or 0 when dst_buf is too small.
+size_t bytestaff_packet(void *dst_buf, size_t dst_len,
+						uint8_t addr, uint8_t code,
+						const void *data, size_t len);
+
+// Unbytestaffs the first packet of src_buf (bytes before FBGN are skipped)
+// and stops right after it. *crc_ok tells whether it is complete and its crc matches.
+// Returns number of unbytestaffed bytes.
+size_t unbytestaff_packet(void *dst_buf, size_t dst_len, const void *src_buf, size_t src_len, bool *crc_ok);
+
+// Maximal length of bytestaffed packet
+#define MAX_BYTESTAFFED_PACKET (1 + 2 * (MAX_PACKET_SIZE - 1))
+
 #pragma pack(push,1)
 struct PacketHeader
 {
 	//returns full packet size using information from header
+	//(of extended frame, header_size() bytes of it should be there)
 	size_t full_size() const;
 
+	//size of header together with extended length
+	size_t header_size() const;
+
+	//length of packet data, plain or extended
+	size_t data_len() const;
+
 	//Warning: this method assumes that `this` points 
 	//to a buffer of at least this->full_size() length
 	//to be able to check correctness of last 2 bytes
@@ -89,14 +121,43 @@ public:
 	}	
 };
 
+// Streaming frame parser: unbytestaffs incoming data and calls frame callback
+// for every complete frame found in it. Incomplete frame at the end of data
+// is kept inside parser until the rest of it comes with the next call to feed.
+// FBGN byte in raw data always starts a new frame, so parser resynchronizes
+// itself after garbage or a truncated frame.
+class SubwayFrameParser
+{
+	uint8_t frame[MAX_PACKET_SIZE];
+	size_t size;
+	bool wait_for_fbgn;
+	bool escape;
+
+	void push(uint8_t c);
+	bool completed() const;
+public:
+	typedef function<void (PacketHeader *header)> frame_callback;
+
+	SubwayFrameParser();
+
+	void reset();
+
+	// Consumes all of data, callback is called for every frame completed by it.
+	void feed(void *data, size_t len, frame_callback callback);
+};
+
+// Bytestaffs frame given by SubwayFrameParser back and sends it to impl,
+// so an emulator front end can serve frames with FileImpl; answer goes to impl listeners.
+void send_frame(IOProvider *impl, PacketHeader *header);
+
 class SubwayProtocol : public Protocol
 {
 	IOProvider *provider;
 	function<void ()> disconnect;
 
-	SubwayUnbytestaffer filter;
+	SubwayFrameParser parser;
 
-	uint8_t write_buf[1024];
+	uint8_t write_buf[MAX_BYTESTAFFED_PACKET];
 
 	void timeout();
 
@@ -107,6 +168,11 @@ class SubwayProtocol : public Protocol
 	//  1 -> packet has been successfully formed from data given so far;
 	long feed(void *data, size_t len);
 
+	// Handles complete frame found by parser. The first one that answers command
+	// being served (its addr and code or NACK) is stored to *answer and delivered
+	// by feed once parser is done; the others are dropped.
+	void frame(PacketHeader *header, ProtocolAnswer *answer, bool *answered);
+
 	long write_callback(size_t bytes_transferred, size_t bytes_sent_to_transfer,const system::error_code &error);
 
 	void set_answer(ProtocolAnswer answer);
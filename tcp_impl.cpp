@@ -1,11 +1,13 @@
 #include "protocol.h"
 #include "custom_combiners.h"
+#include "log.h"
 
 #include <iostream>
 #include <iterator>
 #include <algorithm>
 #include <vector>
 #include <string>
+#include <map>
 
 #define BOOST_ASIO_ENABLE_CANCELIO 
 
@@ -22,46 +24,100 @@
 
 using namespace boost;
 
+#ifndef WIN32
+#include <netinet/tcp.h>
+#endif
+
 using boost::asio::ip::tcp;
 
-static const int log_level = 0;
+#ifdef TCP_QUICKACK
+#define TCP_QUICKACK_OPTION TCP_QUICKACK
+#else
+#define TCP_QUICKACK_OPTION -1
+#endif
+
+#ifdef TCP_KEEPIDLE
+#define TCP_KEEPIDLE_OPTION  TCP_KEEPIDLE
+#define TCP_KEEPINTVL_OPTION TCP_KEEPINTVL
+#define TCP_KEEPCNT_OPTION   TCP_KEEPCNT
+#else
+#define TCP_KEEPIDLE_OPTION  -1
+#define TCP_KEEPINTVL_OPTION -1
+#define TCP_KEEPCNT_OPTION   -1
+#endif
+
 static const size_t connect_timeout = 3000;
 
+typedef std::vector<tcp::endpoint> endpoint_list;
+
+// Resolved endpoints are cached per host:service, so opening many readers
+// behind the same converter and reconnecting after link loss skip DNS lookup.
+// Entry is forgotten when none of its endpoints accepts connection.
+static mutex resolve_cache_mutex;
+static std::map<std::string,endpoint_list> resolve_cache;
+
+static bool cached_endpoints(const std::string &host, const std::string &service, endpoint_list &endpoints)
+{
+	mutex::scoped_lock lock(resolve_cache_mutex);
+	std::map<std::string,endpoint_list>::const_iterator i = resolve_cache.find(host + ":" + service);
+	if(i == resolve_cache.end()) return false;
+	endpoints = i->second;
+	return true;
+}
+
+static void cache_endpoints(const std::string &host, const std::string &service, const endpoint_list &endpoints)
+{
+	mutex::scoped_lock lock(resolve_cache_mutex);
+	resolve_cache[host + ":" + service] = endpoints;
+}
+
+static void forget_endpoints(const std::string &host, const std::string &service)
+{
+	mutex::scoped_lock lock(resolve_cache_mutex);
+	resolve_cache.erase(host + ":" + service);
+}
+
 class Connector
 {
-	void async_connect(tcp::socket &socket, tcp::resolver::iterator i) {
-		if(log_level) std::cerr << "async_connect " << std::endl;
+	void async_connect(tcp::socket &socket, size_t i) {
+		U2_DEBUG("async_connect");
 		try {
-			socket.async_connect(*i,boost::bind(&Connector::connect_callback,this,
+			socket.async_connect(endpoints[i],boost::bind(&Connector::connect_callback,this,
 				asio::placeholders::error,ref(socket),i));
 		} catch(system::system_error &e) {
-			std::cerr << "async_connect: " << e.what() << std::endl;
+			U2_WARN("async_connect: %s",e.what());
 		}
 	}
 
-	void connect_callback(const system::error_code &error, tcp::socket &socket, tcp::resolver::iterator i) {
-		if(log_level) std::cerr << "connect_callback " << error.message() << std::endl;
-		if(error != asio::error::operation_aborted && ++i != tcp::resolver::iterator()) {
+	void connect_callback(const system::error_code &error, tcp::socket &socket, size_t i) {
+		U2_DEBUG("connect_callback %s",error.message().c_str());
+		if(error && error != asio::error::operation_aborted && ++i != endpoints.size()) {
+			system::error_code e;
+			socket.close(e);
 			async_connect(socket,i);
 		} else {
+			if(error) forget_endpoints(host,service);
 			timeout.cancel();
 			connect_promise.set_value(error);			
 		}
 	}
 
 	void resolve_callback(const system::error_code &error, tcp::socket &socket, tcp::resolver::iterator i) {
-		if(log_level) std::cerr << "resolve_callback " << error.message() << std::endl;
+		U2_DEBUG("resolve_callback %s",error.message().c_str());
 		if(error != asio::error::operation_aborted && i != tcp::resolver::iterator()) {
-			async_connect(socket,i);
+			endpoints.assign(i,tcp::resolver::iterator());
+			cache_endpoints(host,service,endpoints);
+			async_connect(socket,0);
 		} else {
 			timeout.cancel();
-			connect_promise.set_value(error);
+			connect_promise.set_value(error ? error : asio::error::host_not_found);
 		}
 	}
 
 	void timeout_callback(const system::error_code &error, tcp::socket &socket) {
-		if(log_level) std::cerr << "timeout_callback " << error.message() << std::endl;
+		U2_DEBUG("timeout_callback %s",error.message().c_str());
 		if(error != asio::error::operation_aborted) {
+			resolver.cancel();
 			socket.close();
 		} 
 	}
@@ -71,15 +127,21 @@ public:
 		
 	}
 
-	system::error_code connect(tcp::socket &socket, const std::string &host, const std::string &service) {
+	system::error_code connect(tcp::socket &socket, const std::string &_host, const std::string &_service) {
+		host = _host;
+		service = _service;
 		connect_promise = promise<system::error_code>();
 		boost::unique_future<system::error_code> connect_future = connect_promise.get_future();
 
-		tcp::resolver::query query(host, service);
-		resolver.async_resolve(query,boost::bind(&Connector::resolve_callback,this,
-			asio::placeholders::error,
-			ref(socket),
-			asio::placeholders::iterator));
+		if(cached_endpoints(host,service,endpoints)) {
+			async_connect(socket,0);
+		} else {
+			tcp::resolver::query query(host, service);
+			resolver.async_resolve(query,boost::bind(&Connector::resolve_callback,this,
+				asio::placeholders::error,
+				ref(socket),
+				asio::placeholders::iterator));
+		}
 
 		timeout.expires_from_now(posix_time::milliseconds(connect_timeout));
 		timeout.async_wait(boost::bind(&Connector::timeout_callback,this,
@@ -91,21 +153,78 @@ private:
 	tcp::resolver resolver;
 	asio::deadline_timer timeout;
 	promise<system::error_code> connect_promise;
+	std::string host;
+	std::string service;
+	endpoint_list endpoints;
+};
+
+// Link options are given after host:port in a query-like form:
+// "host:port?nodelay=1&quickack=1&keepidle=5&keepintvl=1&keepcnt=3&reconnect=1&backoff=100&backoff_max=5000"
+struct TcpOptions
+{
+	int nodelay;     // disable Nagle algorithm
+	int quickack;    // acknowledge every segment right away instead of delaying ACK
+	int keepidle;    // seconds of idle link before the first keepalive probe, 0 disables keepalive
+	int keepintvl;   // seconds between keepalive probes
+	int keepcnt;     // unanswered probes before link is considered dead
+	int reconnect;   // reconnect automatically when link is lost
+	int backoff;     // first reconnect delay, milliseconds; doubled after every failed attempt
+	int backoff_max; // upper limit of reconnect delay, milliseconds
+
+	TcpOptions():nodelay(1),quickack(1),keepidle(5),keepintvl(1),keepcnt(3),
+		reconnect(1),backoff(100),backoff_max(5000) {
+
+	}
+
+	void parse(const std::string &query) {
+		std::vector<std::string> pairs;
+		split(pairs, query, is_any_of("&"));
+
+		for(size_t i = 0; i < pairs.size(); i++) {
+			std::vector<std::string> kv;
+			split(kv, pairs[i], is_any_of("="));
+			if(kv.size() != 2) continue;
+
+			int value = atoi(kv[1].c_str());
+			if(kv[0] == "nodelay") nodelay = value;
+			else if(kv[0] == "quickack") quickack = value;
+			else if(kv[0] == "keepidle") keepidle = value;
+			else if(kv[0] == "keepintvl") keepintvl = value;
+			else if(kv[0] == "keepcnt") keepcnt = value;
+			else if(kv[0] == "reconnect") reconnect = value;
+			else if(kv[0] == "backoff") backoff = value;
+			else if(kv[0] == "backoff_max") backoff_max = value;
+			else U2_WARN("TcpImpl: unknown option %s",kv[0].c_str());
+		}
+	}
 };
 
-class TcpImpl : public IOProvider
+class TcpImpl : public IOProvider, public IConnection
 {
 	asio::io_service io_svc;
 	tcp::socket socket;
 	asio::io_service::work work;
 	asio::deadline_timer timeout;	
+	asio::deadline_timer reconnect_timer;
+	tcp::resolver resolver;
 	
 	thread io_thread;
 
 	unsigned char read_buf[512];
-	size_t read_size;
-	
-	boost::promise<system::error_code> connect_promise;
+
+	std::string host;
+	std::string service;
+	endpoint_list endpoints;
+	TcpOptions options;
+
+	bool connected;
+	uint32_t reconnects;
+	size_t backoff;
+
+	// send callback of a command that waits for its answer. If link is lost
+	// while waiting, command is failed right away with an error passed to it
+	// instead of waiting for its timeout.
+	IOProvider::send_callback in_flight;
 
 	// Using maximum combiner assures that if more than one listener will be active
 	// on this signal, we should always get maximum of their return values.
@@ -117,12 +236,20 @@ class TcpImpl : public IOProvider
 	{
 		if (error || !bytes_transferred)
 		{
-			if(log_level) std::cerr << "read callback error:" << error << ": " << error.message() << std::endl;
+			U2_DEBUG("read callback error:%i: %s",error.value(),error.message().c_str());
+			if(error != asio::error::operation_aborted) link_lost(error);
 			return;
 		}
 
-		if(log_level) debug_data("read_callback",read_buf,bytes_transferred);
-	    data_received(read_buf,bytes_transferred);
+		U2_DEBUG("read_callback: %s",log_bytes(read_buf,bytes_transferred));
+		
+		// socket is read continuously, so data may come when there is no protocol
+		// waiting for it. The next one drops it before its command is sent.
+		if(data_received.empty()) {
+			unread(read_buf,bytes_transferred);
+		} else {
+			data_received(read_buf,bytes_transferred);
+		}
 		initiate_read();
 
 	}
@@ -137,6 +264,7 @@ class TcpImpl : public IOProvider
 
 	void write_callback(IOProvider::send_callback callback,size_t bytes_transferred,const system::error_code& error)
 	{
+		if(!error) in_flight = callback;
 		callback(bytes_transferred,error);
 	}
 
@@ -144,6 +272,7 @@ class TcpImpl : public IOProvider
 	{
 		if (error) return;   // Data has been read and this timeout was canceled
 		
+		in_flight.clear();
 		callback();
 	}
 
@@ -154,7 +283,10 @@ class TcpImpl : public IOProvider
 	//2. read_callback - this callback signals about receiving data and decides what to do next
 	//   by its return value
 	inline void initiate_read() {
-		if(log_level) std::cerr << "initiate_read" << std::endl;
+		U2_DEBUG("initiate_read");
+
+		// TCP_QUICKACK is not permanent, kernel may return to delayed ACKs after any read
+		if(options.quickack) set_tcp_option(TCP_QUICKACK_OPTION,1);
 
 		namespace ph = boost::asio::placeholders;
 		 
@@ -163,9 +295,140 @@ class TcpImpl : public IOProvider
 			boost::bind(&TcpImpl::read_callback,this,ph::bytes_transferred,ph::error));
 	}
 
+	void set_tcp_option(int name, int value) {
+		if(name < 0) return; // not supported on this platform
+		if(setsockopt(socket.native_handle(),IPPROTO_TCP,name,(const char*)&value,sizeof(value))) {
+			U2_DEBUG("setsockopt(%i): %s",name,strerror(errno));
+		}
+	}
+
+	void configure_socket() {
+		system::error_code e;
+		socket.set_option(tcp::no_delay(options.nodelay != 0),e);
+		if(e) U2_WARN("TcpImpl no_delay: %s",e.message().c_str());
+
+		if(options.keepidle) {
+			socket.set_option(asio::socket_base::keep_alive(true),e);
+			if(e) U2_WARN("TcpImpl keep_alive: %s",e.message().c_str());
+			set_tcp_option(TCP_KEEPIDLE_OPTION,options.keepidle);
+			set_tcp_option(TCP_KEEPINTVL_OPTION,options.keepintvl);
+			set_tcp_option(TCP_KEEPCNT_OPTION,options.keepcnt);
+		}
+	}
+
+	void link_up() {
+		U2_DEBUG("link_up");
+
+		configure_socket();
+		connected = true;
+		backoff = options.backoff;
+		initiate_read();
+	}
+
+	void link_lost(const system::error_code &error) {
+		if(!connected) return;
+		U2_WARN("TcpImpl link lost: %s",error.message().c_str());
+
+		connected = false;
+		system::error_code e;
+		socket.close(e);
+
+		fail_in_flight(error);
+
+		if(options.reconnect) schedule_reconnect();
+	}
+
+	void fail_in_flight(const system::error_code &error) {
+		if(in_flight.empty()) return;
+
+		IOProvider::send_callback callback = in_flight;
+		in_flight.clear();
+		this->timeout.cancel();
+		callback(0,error);
+	}
+
+	void schedule_reconnect() {
+		U2_DEBUG("schedule_reconnect %i",backoff);
+
+		reconnect_timer.expires_from_now(posix_time::milliseconds(backoff));
+		reconnect_timer.async_wait(boost::bind(&TcpImpl::reconnect,this,asio::placeholders::error));
+		backoff = std::min(backoff * 2,(size_t)options.backoff_max);
+	}
+
+	void reconnect(const system::error_code &error) {
+		if(error) return;
+
+		if(cached_endpoints(host,service,endpoints)) {
+			reconnect_next(0);
+			return;
+		}
+
+		tcp::resolver::query query(host, service);
+		resolver.async_resolve(query,boost::bind(&TcpImpl::reconnect_resolved,this,
+			asio::placeholders::error,asio::placeholders::iterator));
+	}
+
+	void reconnect_resolved(const system::error_code &error, tcp::resolver::iterator i) {
+		if(error || i == tcp::resolver::iterator()) {
+			if(error != asio::error::operation_aborted) schedule_reconnect();
+			return;
+		}
+		endpoints.assign(i,tcp::resolver::iterator());
+		cache_endpoints(host,service,endpoints);
+		reconnect_next(0);
+	}
+
+	void reconnect_next(size_t i) {
+		socket.async_connect(endpoints[i],boost::bind(&TcpImpl::reconnect_connected,this,
+			asio::placeholders::error,i));
+	}
+
+	void reconnect_connected(const system::error_code &error, size_t i) {
+		if(error == asio::error::operation_aborted) return;
+		if(error) {
+			system::error_code e;
+			socket.close(e);
+			if(++i != endpoints.size()) {
+				reconnect_next(i);
+			} else {
+				forget_endpoints(host,service);
+				schedule_reconnect();
+			}
+			return;
+		}
+
+		reconnects++;
+		U2_INFO("TcpImpl reconnected to %s:%s",host.c_str(),service.c_str());
+		link_up();
+	}
+
+	void query_info(connection_info *info, promise<void> *done);
+
+	void do_send(void *data, size_t len, IOProvider::send_callback callback) {
+		if(!connected) {
+			callback(0,asio::error::not_connected);
+			return;
+		}
+
+		asio::async_write(this->socket,asio::buffer(data,len),
+			boost::bind(&TcpImpl::write_callback,this,
+				 callback,
+				 asio::placeholders::bytes_transferred,
+				 asio::placeholders::error));
+	}
+
 public:
-	TcpImpl(const char *host_port, uint32_t baud, uint8_t)
-		:socket(io_svc),work(io_svc),timeout(io_svc) {
+	TcpImpl(const char *path, uint32_t baud, uint8_t)
+		:socket(io_svc),work(io_svc),timeout(io_svc),reconnect_timer(io_svc),resolver(io_svc),
+		 connected(false),reconnects(0) {
+
+		std::string host_port(path);
+		size_t query_pos = host_port.find('?');
+		if(query_pos != std::string::npos) {
+			options.parse(host_port.substr(query_pos + 1));
+			host_port.resize(query_pos);
+		}
+		backoff = options.backoff;
 
 		std::vector<std::string> tokens;
 		split(tokens, host_port, is_any_of(":"));
@@ -173,31 +436,35 @@ public:
 		if(tokens.size() != 2) {
 			throw_exception(system::system_error(boost::asio::error::invalid_argument));
 		}
+		host = tokens[0];
+		service = tokens[1];
 
 		io_thread = thread(boost::bind(&TcpImpl::io_service_thread,this));
 
 		Connector connector(io_svc);
-		system::error_code error = connector.connect(socket,tokens[0],tokens[1]);
+		system::error_code error = connector.connect(socket,host,service);
 		if (error) {
-			if(log_level) std::cerr << "throw_exception" << std::endl;
+			U2_DEBUG("throw_exception");
+			io_svc.stop();
+			io_thread.join();
 			throw_exception(system::system_error(error));
 		} else {
-			initiate_read();
+			io_svc.post(boost::bind(&TcpImpl::link_up,this));
 		}
 	}
 
 	void io_service_thread() {
-		if(log_level) std::cerr << "starting io_svc" << std::endl;
+		U2_DEBUG("starting io_svc");
 
 		system::error_code e;
 		io_svc.run(e);
-		if(e) std::cerr << "io_svc: " << e.message() << std::endl;
+		if(e) U2_WARN("io_svc: %s",e.message().c_str());
 		
-		if(log_level) std::cerr << "io_svc[stopped]" << std::endl;
+		U2_DEBUG("io_svc[stopped]");
 		//socket.shutdown(asio::socket_base::shutdown_both);
 		
 		socket.close(e); //socket closed from the same thread as io service
-		if(e) std::cerr << "socket.close() : " << e.message() << std::endl;
+		if(e) U2_WARN("socket.close() : %s",e.message().c_str());
 	}
 
 	virtual ~TcpImpl() {
@@ -210,35 +477,33 @@ public:
 	virtual void send(void *data, size_t len, IOProvider::send_callback callback);
 	virtual long set_timeout(size_t timeout, IOProvider::timeout_callback callback);
 	virtual long cancel_timeout();
+	virtual long get_info(connection_info *info);
 };
 
 static void disconnector(signals2::connection c)
 {
-	if(log_level) std::cerr << "disconnect" << std::endl;
+	U2_DEBUG("disconnect");
 
 	c.disconnect();
 }
 
 function<void ()> TcpImpl::listen(IOProvider::listen_callback callback)
 {
-	if(log_level) std::cerr << "listen" << std::endl;
+	U2_DEBUG("listen");
 
 	signals2::connection c = data_received.connect(callback);
 	return boost::bind(disconnector,c);
 }
 
+// Socket may be reopened by io thread at any moment, so all work with it is done there.
 void TcpImpl::send(void *data, size_t len,IOProvider::send_callback callback) 
 {
-	asio::async_write(this->socket,asio::buffer(data,len),
-		boost::bind(&TcpImpl::write_callback,this,
-		     callback,
-		     asio::placeholders::bytes_transferred,
-			 asio::placeholders::error));
+	io_svc.post(boost::bind(&TcpImpl::do_send,this,data,len,callback));
 }
 
 long TcpImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
 {
-	if(log_level) std::cerr << "set_timeout" << std::endl;
+	U2_DEBUG("set_timeout");
 
 	this->timeout.expires_from_now(posix_time::milliseconds(timeout));
 	this->timeout.async_wait(boost::bind(&TcpImpl::wait_callback,this,callback,asio::placeholders::error));
@@ -248,14 +513,43 @@ long TcpImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
 
 long TcpImpl::cancel_timeout()
 {
-	if(log_level) std::cerr << "cancel_timeout" << std::endl;
+	U2_DEBUG("cancel_timeout");
 
+	in_flight.clear();
 	this->timeout.cancel();
 
 	return 0;
 }
 
+// Socket may be closed and reopened by io thread meanwhile, so it is asked there.
+long TcpImpl::get_info(connection_info *info)
+{
+	promise<void> done;
+	unique_future<void> result = done.get_future();
+	io_svc.post(boost::bind(&TcpImpl::query_info,this,info,&done));
+	result.wait();
+	return 0;
+}
+
+void TcpImpl::query_info(connection_info *info, promise<void> *done)
+{
+	memset(info,0,sizeof(*info));
+	info->connected = connected;
+	info->reconnects = reconnects;
+
+#ifdef TCP_INFO
+	struct tcp_info tcpi;
+	socklen_t tcpi_len = sizeof(tcpi);
+	if(connected && getsockopt(socket.native_handle(),IPPROTO_TCP,TCP_INFO,&tcpi,&tcpi_len) == 0) {
+		info->rtt = tcpi.tcpi_rtt;
+		info->rtt_var = tcpi.tcpi_rttvar;
+	}
+#endif
+
+	done->set_value();
+}
+
 IOProvider* create_tcp_impl(const char* path,uint32_t baud,uint8_t parity)
 {
 	return new TcpImpl(path,baud,parity);
-}
\ No newline at end of file
+}
@@ -1,11 +1,12 @@
 #include "terminal_protocol.h"
+#include "probes.h"
+#include "log.h"
 
 #include <boost/bind.hpp>
 
 using namespace boost;
 
 static const size_t DEFAULT_TIMEOUT = 150;
-static const int log_level = getenv("DEBUG_TERMINAL_PROTOCOL") != 0;
 
 static const size_t checksum_length = 2;
 
@@ -230,7 +231,7 @@ void TerminalUnbytestaffer::reset() {
 }
 
 TerminalProtocol::TerminalProtocol(IOProvider *_provider)
-:provider(_provider),type(FMAS),timeout(DEFAULT_TIMEOUT) {
+:Protocol(PROTOCOL_TERMINAL),provider(_provider),type(FMAS),timeout(DEFAULT_TIMEOUT) {
 	disconnect = provider->listen(boost::bind(&TerminalProtocol::feed,this,_1,_2));
 }
 
@@ -242,23 +243,29 @@ TerminalProtocol::~TerminalProtocol() {
 // Fires when maximum packet waiting time expired. If its called, that means not 
 // enough data came from the serial port to be recognized as a complete packet by read callbacks.
 void TerminalProtocol::timeout_callback() {
-	if(log_level) std::cerr << "TerminalProtocol::timeout_callback" << std::endl;
+	U2_DEBUG("TerminalProtocol::timeout_callback");
+	U2_PROBE(timeout,get_reader(),addr,code,0,NO_ANSWER);
 	set_answer(ProtocolAnswer(NO_ANSWER));
 }
 
 long TerminalProtocol::write_callback(size_t bytes_sent_to_transfer, size_t bytes_transferred,
 									  const system::error_code &error) {
+	TraceSpan span("write_callback",get_trace_id(),bytes_transferred);
 	if (error)
 	{
-		std::cerr << "write_callback error:" << error << ": " << error.message() << std::endl;
+		U2_WARN("write_callback error:%i: %s",error.value(),error.message().c_str());
 		set_answer(ProtocolAnswer(IO_ERROR));
 		return -1;
 	}
 
-	if(log_level) std::cerr << "write_callback: " << bytes_transferred << "/" << bytes_sent_to_transfer << std::endl;
+	U2_DEBUG("write_callback: %zu/%zu",bytes_transferred,bytes_sent_to_transfer);
+	mark(TIMING_WRITTEN);
 
 	if(timeout) {
-		provider->set_timeout(timeout,boost::bind(&TerminalProtocol::timeout_callback,this));
+		{
+			TraceSpan span("set_timeout",get_trace_id(),timeout);
+			provider->set_timeout(timeout,boost::bind(&TerminalProtocol::timeout_callback,this));
+		}
 		return 0;
 	} else {
 		set_answer(ProtocolAnswer(NO_ANSWER));
@@ -273,14 +280,17 @@ long TerminalProtocol::send(uint8_t _addr, uint8_t _code, void *data, size_t len
 	uint8_t packet[512] = {0};
 	long packet_len = terminal_create_custom_packet(packet,sizeof(packet),type,addr,code,data,len);
 	if(packet_len == -1) {
-		std::cerr << "terminal_create_custom_packet failed for command code: " << code << std::endl;
+		U2_WARN("terminal_create_custom_packet failed for command code: %02hhX",code);
 		return -0xCF;
 	}
 
 	size_t write_buf_len = terminal_bytestaff(write_buf,sizeof(write_buf),packet,packet_len);
+	mark(TIMING_ENCODED);
+	U2_PROBE(frame_send,get_reader(),addr,code,len,0);
 
-	if(log_level) debug_data("send",write_buf,write_buf_len);
+	U2_DEBUG("send: %s",log_bytes(write_buf,write_buf_len));
 
+	TraceSpan span("IOProvider::send",get_trace_id(),write_buf_len);
 	provider->send(write_buf,write_buf_len,
 		boost::bind(&TerminalProtocol::write_callback,this,write_buf_len,_1,_2));
 
@@ -288,18 +298,24 @@ long TerminalProtocol::send(uint8_t _addr, uint8_t _code, void *data, size_t len
 }
 
 void TerminalProtocol::set_answer(ProtocolAnswer answer) {
+	TraceSpan span("set_answer",get_trace_id(),answer.result);
 	if(!disconnect.empty()) {
 		disconnect();
 		disconnect.clear();
 	}
-	provider->cancel_timeout();
+	{
+		TraceSpan span("cancel_timeout",get_trace_id());
+		provider->cancel_timeout();
+	}
 	Protocol::set_answer(answer);
 }
 
 long TerminalProtocol::feed(void *data, size_t len) {
-	if(log_level) debug_data("feed",data,len);
+	U2_DEBUG("feed: %s",log_bytes(data,len));
 
 	if(!data || !len) return 0;
+	mark(TIMING_FIRST_BYTE);
+	TraceSpan span("feed",get_trace_id(),len);
 
 	filter.feed(data,len);
 
@@ -310,16 +326,14 @@ long TerminalProtocol::feed(void *data, size_t len) {
 
 	//when we have an answer from another device
 	if(header->addr != addr) {
-		fprintf(stderr,"header->addr[%hhX] != addr[%hhX]",header->addr,addr);
-		debug_data("",header,full_size);
+		U2_WARN("header->addr[%hhX] != addr[%hhX]: %s",header->addr,addr,log_bytes(header,full_size));
 		filter.reset();
 		return 0;
 	}
 
 	//when we have an answer to another command
 	if(header->code != code) {
-		fprintf(stderr,"header->code[%hhX] != code[%hhX]",header->code,code);
-		debug_data("",header,full_size);
+		U2_WARN("header->code[%hhX] != code[%hhX]: %s",header->code,code,log_bytes(header,full_size));
 		filter.reset();
 		return 0;
 	}
@@ -329,10 +343,13 @@ long TerminalProtocol::feed(void *data, size_t len) {
 		//its obviously something wrong
 		set_answer(ProtocolAnswer(WRONG_ANSWER));
 	} else if(!header->checksum_check(full_size)) {
+		U2_PROBE(crc_fail,get_reader(),header->addr,header->code,full_size,PACKET_CRC_ERROR);
 		set_answer(ProtocolAnswer(PACKET_CRC_ERROR));
 	} else if(header->type == FNAK) {
+		U2_PROBE(nack,get_reader(),header->addr,header->code,full_size,header->nack_data(full_size));
 		set_answer(ProtocolAnswer(header->nack_data(full_size)));
 	} else {
+		U2_PROBE(frame_received,get_reader(),header->addr,header->code,header->data_len(full_size),0);
 		set_answer(ProtocolAnswer(header->data(),header->data_len(full_size)));
 	}
 
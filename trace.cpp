@@ -0,0 +1,161 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+
+#ifdef WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+struct TraceEvent
+{
+	uint64_t seq;   // position in ring + 1 when event is complete, 0 while it is written
+	uint64_t start;
+	uint64_t duration;
+	uint64_t id;
+	uint64_t arg;
+	const char *name;
+	uint32_t tid;
+	char phase;
+};
+
+volatile int trace_enabled = 0;
+
+struct TraceRing
+{
+	size_t mask;
+	uint64_t head;
+	TraceEvent events[1];
+};
+
+static TraceRing *ring = 0;
+static uint64_t last_id = 0;
+
+static uint32_t thread_id()
+{
+#ifdef WIN32
+	return GetCurrentThreadId();
+#else
+	static __thread uint32_t tid = 0;
+	if(!tid) tid = syscall(SYS_gettid);
+	return tid;
+#endif
+}
+
+uint64_t trace_next_id()
+{
+	return trace_enabled ? __sync_add_and_fetch(&last_id,1) : 0;
+}
+
+void trace_event(char phase, const char *name, uint64_t start, uint64_t duration, uint64_t id, uint64_t arg)
+{
+	TraceRing *r = ring;
+	if(!r) return;
+
+	uint64_t position = __sync_fetch_and_add(&r->head,1);
+	TraceEvent *event = r->events + (position & r->mask);
+
+	__atomic_store_n(&event->seq,0,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event->start = start;
+	event->duration = duration;
+	event->id = id;
+	event->arg = arg;
+	event->name = name;
+	event->tid = thread_id();
+	event->phase = phase;
+	__atomic_store_n(&event->seq,position + 1,__ATOMIC_RELEASE);
+}
+
+void trace_enable(size_t events)
+{
+	if(!events) {
+		trace_enabled = 0;
+		return;
+	}
+
+	if(!ring) {
+		size_t size = 1;
+		while(size < events) size <<= 1;
+
+		TraceRing *fresh = (TraceRing*)calloc(1,sizeof(TraceRing) + (size - 1) * sizeof(TraceEvent));
+		if(!fresh) return;
+		fresh->mask = size - 1;
+		if(!__sync_bool_compare_and_swap(&ring,(TraceRing*)0,fresh)) free(fresh);
+	}
+	trace_enabled = 1;
+}
+
+static bool by_start(const TraceEvent &a, const TraceEvent &b)
+{
+	return a.start < b.start;
+}
+
+long trace_dump(const char *path)
+{
+	std::vector<TraceEvent> events;
+	TraceRing *r = ring;
+	if(r) {
+		events.reserve(r->mask + 1);
+		for(size_t i = 0; i <= r->mask; i++) {
+			TraceEvent *slot = r->events + i;
+			uint64_t seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+			if(!seq) continue;
+
+			TraceEvent copy = *slot;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			// skip slots that were overwritten while we copied them
+			if(__atomic_load_n(&slot->seq,__ATOMIC_RELAXED) != seq) continue;
+			events.push_back(copy);
+		}
+	}
+	sort(events.begin(),events.end(),by_start);
+
+	FILE *file = fopen(path,"w");
+	if(!file) return errno;
+
+#ifdef WIN32
+	int pid = _getpid();
+#else
+	int pid = getpid();
+#endif
+
+	fprintf(file,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for(size_t i = 0; i < events.size(); i++) {
+		const TraceEvent &e = events[i];
+		fprintf(file,"%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,",
+			i ? ",\n" : "",e.name,e.phase,
+			(unsigned long long)(e.start / 1000),(unsigned)(e.start % 1000));
+		if(e.phase == 'X') {
+			fprintf(file,"\"dur\":%llu.%03u,",(unsigned long long)(e.duration / 1000),(unsigned)(e.duration % 1000));
+		} else {
+			fprintf(file,"\"s\":\"t\",");
+		}
+		fprintf(file,"\"pid\":%i,\"tid\":%u,\"args\":{\"cmd\":%llu,\"arg\":%llu}}",
+			pid,e.tid,(unsigned long long)e.id,(unsigned long long)e.arg);
+	}
+	fprintf(file,"\n]}\n");
+
+	int failed = ferror(file);
+	if(fclose(file) || failed) return errno ? errno : EIO;
+	return 0;
+}
+
+// U2_TRACE=<ring size> turns tracing on at load time
+static struct TraceAutostart
+{
+	TraceAutostart() {
+		const char *events = getenv("U2_TRACE");
+		if(events) trace_enable(strtoul(events,0,0));
+	}
+} trace_autostart;
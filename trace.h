@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "stats.h"
+
+// Process-wide timeline of command spans. Tracing is off by default, it is
+// turned on with U2_TRACE=<ring size in events> or u2_trace_enable. Events go
+// to a fixed ring shared by all readers, the oldest ones are overwritten,
+// u2_trace_dump writes what is in the ring as Chrome/Perfetto trace JSON.
+
+extern volatile int trace_enabled;
+
+// Returns new command id to tie spans of one command together.
+uint64_t trace_next_id();
+
+// phase is 'X' for complete span or 'i' for instant event.
+void trace_event(char phase, const char *name, uint64_t start, uint64_t duration, uint64_t id, uint64_t arg);
+
+// Starts tracing with ring of at least events entries (0 stops tracing).
+// Ring is allocated by the first call and lives until process exit.
+void trace_enable(size_t events);
+
+// Returns 0 on success or errno value.
+long trace_dump(const char *path);
+
+// Records span from its construction to its destruction.
+// name should be a string literal, it is stored as pointer.
+class TraceSpan
+{
+	const char *name;
+	uint64_t id;
+	uint64_t arg;
+	uint64_t start;
+public:
+	inline TraceSpan(const char *_name, uint64_t _id = 0, uint64_t _arg = 0)
+		:name(_name),id(_id),arg(_arg),start(trace_enabled ? stats_now() : 0) {
+	}
+
+	inline ~TraceSpan() {
+		if(start) trace_event('X',name,start,stats_now() - start,id,arg);
+	}
+
+	inline void set_arg(uint64_t _arg) {
+		arg = _arg;
+	}
+};
+
+inline void trace_instant(const char *name, uint64_t id = 0, uint64_t arg = 0)
+{
+	if(trace_enabled) trace_event('i',name,stats_now(),0,id,arg);
+}
+
+#endif //TRACE_H
@@ -0,0 +1,482 @@
+// u2bench - end-to-end loopback benchmark.
+//
+// Opens a Reader on every transport against an in-process emulator made of
+// FileImpl and drives card transactions through it: activation (scan + select, one
+// SCAN_SELECT exchange when firmware offers it), sector auth, sector read and write,
+// block read and serial number poll.
+// For every transport prints transactions and commands per second, p50/p99/p999 command latency,
+// CPU time per command (both sides, the emulator runs in the same process)
+// and operator new calls per command.
+//
+//   emulator  - pre-encoded requests of the same transaction go straight to
+//               FileImpl::send without Reader, measures emulator core alone
+//   file      - FileImpl called directly, no transport at all
+//   unix      - unix socket, emulator thread on the other end
+//   tcp       - localhost tcp, emulator thread on the other end
+//   asio      - pty pair, emulator thread on master side
+//   asio-mt   - the same with asio-mt
+//   shm       - shared memory rings, emulator thread serves the segment
+//
+// -f spec wraps every transport into "fault" IOProvider with U2_FAULT=spec
+// (see fault_impl.cpp), so throughput under a lossy link can be compared.
+// -l turns extended commands off, activation takes request, anticollision and select.
+//
+// usage: u2bench [-n transactions] [-f faults] [-l] [transport ...]
+
+#include "protocol.h"
+#include "subway_protocol.h"
+#include "api_subway_high.h"
+#include "commands.h"
+#include "shm_ring.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace boost;
+
+static uint64_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	__sync_fetch_and_add(&allocations,1);
+	void *p = malloc(size ? size : 1);
+	if(!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+static long request_written(size_t, const system::error_code&)
+{
+	return 0;
+}
+
+// Serves subway frames that come through a stream descriptor with FileImpl.
+class StreamEmulator
+{
+	int listener;
+	int fd;
+	volatile bool stopping;
+	IOProvider *emulator;
+	function<void ()> disconnect;
+	SubwayFrameParser parser;
+	thread worker;
+
+	long answer(void *data, size_t len) {
+		uint8_t *p = (uint8_t*)data;
+		while(len) {
+			ssize_t n = write(fd,p,len);
+			if(n <= 0) {
+				if(n < 0 && errno == EINTR) continue;
+				perror("u2bench: emulator write");
+				return 1;
+			}
+			p += n;
+			len -= n;
+		}
+		return 1;
+	}
+
+	bool wait_readable(int descriptor) {
+		struct pollfd p = { descriptor, POLLIN, 0 };
+		while(!stopping) {
+			if(poll(&p,1,100) > 0) return true;
+		}
+		return false;
+	}
+
+	void run() {
+		if(listener != -1) {
+			if(!wait_readable(listener)) return;
+			fd = accept(listener,0,0);
+			if(fd == -1) {
+				perror("u2bench: accept");
+				return;
+			}
+		}
+
+		uint8_t buf[512];
+		while(wait_readable(fd)) {
+			ssize_t n = read(fd,buf,sizeof(buf));
+			if(n <= 0) {
+				if(n < 0 && errno == EINTR) continue;
+				break;
+			}
+			parser.feed(buf,n,boost::bind(send_frame,emulator,_1));
+		}
+	}
+public:
+	// Either listener is a listening socket and connection is accepted
+	// in emulator thread or fd is already connected descriptor.
+	StreamEmulator(int _listener, int _fd):listener(_listener),fd(_fd),stopping(false) {
+		emulator = get_impl("file",0,0,0);
+		disconnect = emulator->listen(boost::bind(&StreamEmulator::answer,this,_1,_2));
+		worker = thread(boost::bind(&StreamEmulator::run,this));
+	}
+
+	~StreamEmulator() {
+		stopping = true;
+		worker.join();
+		disconnect();
+		delete emulator;
+		if(fd != -1) close(fd);
+		if(listener != -1) close(listener);
+	}
+};
+
+// Serves shm segment with FileImpl, the same way u2shm does.
+class ShmEmulator
+{
+	std::string name;
+	ShmSegment *segment;
+	volatile bool stopping;
+	IOProvider *emulator;
+	function<void ()> disconnect;
+	thread worker;
+
+	long answer(void *data, size_t len) {
+		if(!segment->to_client.write(data,len)) fprintf(stderr,"u2bench: shm answer dropped\n");
+		segment->to_client.wake();
+		return 1;
+	}
+
+	void run() {
+		uint8_t request[SHM_RING_SIZE / 2];
+		while(!stopping) {
+			if(!segment->to_server.wait(100)) continue;
+			while(uint32_t len = segment->to_server.read(request,sizeof(request))) {
+				emulator->send(request,len,request_written);
+			}
+		}
+	}
+public:
+	ShmEmulator(const std::string &_name):name(_name),stopping(false) {
+		shm_unlink(name.c_str());
+		segment = shm_segment_open(name.c_str(),true);
+		emulator = get_impl("file",0,0,0);
+		disconnect = emulator->listen(boost::bind(&ShmEmulator::answer,this,_1,_2));
+		if(segment) worker = thread(boost::bind(&ShmEmulator::run,this));
+	}
+
+	~ShmEmulator() {
+		stopping = true;
+		if(segment) {
+			segment->to_server.interrupt();
+			worker.join();
+		}
+		disconnect();
+		delete emulator;
+		shm_segment_close(segment);
+		shm_unlink(name.c_str());
+	}
+
+	bool ready() const {
+		return segment != 0;
+	}
+};
+
+struct Transport
+{
+	std::string impl;
+	std::string path;
+	StreamEmulator *stream;
+	ShmEmulator *shm;
+
+	Transport():stream(0),shm(0) {
+	}
+
+	~Transport() {
+		delete stream;
+		delete shm;
+		if(impl == "unix") unlink(path.c_str());
+	}
+};
+
+static bool setup(const std::string &impl, Transport *t)
+{
+	t->impl = impl;
+	char buf[128];
+
+	if(impl == "file") {
+		return true;
+	}
+
+	if(impl == "unix") {
+		snprintf(buf,sizeof(buf),"/tmp/u2bench-%i.sock",(int)getpid());
+		t->path = buf;
+		unlink(buf);
+
+		int s = socket(AF_UNIX,SOCK_STREAM,0);
+		struct sockaddr_un addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		size_t path_len = strlen(buf);
+		if(path_len >= sizeof(addr.sun_path)) {
+			fprintf(stderr,"u2bench: socket path too long: %s\n",buf);
+			if(s != -1) close(s);
+			return false;
+		}
+		memcpy(addr.sun_path,buf,path_len + 1);
+		if(s == -1 || ::bind(s,(struct sockaddr*)&addr,sizeof(addr)) || listen(s,1)) {
+			perror("u2bench: unix socket");
+			if(s != -1) close(s);
+			return false;
+		}
+		t->stream = new StreamEmulator(s,-1);
+		return true;
+	}
+
+	if(impl == "tcp") {
+		int s = socket(AF_INET,SOCK_STREAM,0);
+		struct sockaddr_in addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addr_len = sizeof(addr);
+		if(s == -1 || ::bind(s,(struct sockaddr*)&addr,sizeof(addr)) || listen(s,1)
+		   || getsockname(s,(struct sockaddr*)&addr,&addr_len)) {
+			perror("u2bench: tcp socket");
+			if(s != -1) close(s);
+			return false;
+		}
+		snprintf(buf,sizeof(buf),"127.0.0.1:%i",(int)ntohs(addr.sin_port));
+		t->path = buf;
+		t->stream = new StreamEmulator(s,-1);
+		return true;
+	}
+
+	if(impl == "asio" || impl == "asio-mt") {
+		int master = posix_openpt(O_RDWR | O_NOCTTY);
+		if(master == -1 || grantpt(master) || unlockpt(master) || !ptsname(master)) {
+			perror("u2bench: pty");
+			if(master != -1) close(master);
+			return false;
+		}
+		t->path = ptsname(master);
+		t->stream = new StreamEmulator(-1,master);
+		return true;
+	}
+
+	if(impl == "shm") {
+		snprintf(buf,sizeof(buf),"/u2bench-%i",(int)getpid());
+		t->path = buf;
+		t->shm = new ShmEmulator(buf);
+		return t->shm->ready();
+	}
+
+	fprintf(stderr,"u2bench: unknown transport %s\n",impl.c_str());
+	return false;
+}
+
+// One gate-like card transaction, returns the first error.
+static long transaction(Reader *reader)
+{
+	Card card;
+	Sector sector(3);
+	uint64_t sn;
+
+	if(long ret = card.activate(reader)) return ret;
+	if(long ret = sector.authenticate(reader,&card)) return ret;
+	if(long ret = sector.read(reader,0xFF)) return ret;
+	sector.data.blocks[0].data[0]++;
+	if(long ret = sector.write(reader,0xFF)) return ret;
+	if(long ret = sector.read_block(reader,1,0xFF)) return ret;
+	return reader->send_command<SubwayProtocol>(0,GET_SN,&sn);
+}
+
+static long count_answer(size_t *errors, void *data, size_t len)
+{
+	// FBGN, addr, code: neither addr 0 nor codes are ever bytestaffed
+	if(len > 2 && ((uint8_t*)data)[2] == NACK_BYTE) (*errors)++;
+	return 1;
+}
+
+static void add_request(std::vector<std::vector<uint8_t> > &requests, uint8_t code,
+						const void *request = 0, uint8_t len = 0)
+{
+	std::vector<uint8_t> frame(MAX_BYTESTAFFED_PACKET);
+	frame.resize(bytestaff_packet(&frame[0],frame.size(),0,code,request,len));
+	requests.push_back(frame);
+}
+
+static double cpu_seconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+	     + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void bench_emulator(size_t transactions)
+{
+	IOProvider *emulator = get_impl("file",0,0,0);
+	size_t errors = 0;
+	function<void ()> disconnect = emulator->listen(boost::bind(count_answer,&errors,_1,_2));
+
+	Sector sector(3);
+	Sector::auth_request auth = { sector.key, sector.num };
+	Sector::read_sector_request read = { sector.num, 0xFF };
+	Sector::write_sector_request write = { sector.data, sector.num, 0xFF };
+	Sector::read_block_request read_block = { 1, sector.num, 0xFF };
+
+	std::vector<std::vector<uint8_t> > requests;
+	add_request(requests,REQUEST_STD);
+	add_request(requests,ANTICOLLISION);
+	add_request(requests,AUTH,&auth,sizeof(auth));
+	add_request(requests,SECTOR_READ,&read,sizeof(read));
+	add_request(requests,SECTOR_WRITE,&write,sizeof(write));
+	add_request(requests,BLOCK_READ,&read_block,sizeof(read_block));
+	add_request(requests,GET_SN);
+
+	for(size_t i = 0; i < requests.size(); i++) {
+		emulator->send(&requests[i][0],requests[i].size(),request_written);
+	}
+	errors = 0;
+
+	uint64_t allocations_before = allocations;
+	double cpu_before = cpu_seconds();
+	uint64_t start = stats_now();
+
+	// emulator is much faster than anything in front of it
+	size_t rounds = transactions * 100;
+	for(size_t n = 0; n < rounds; n++) {
+		for(size_t i = 0; i < requests.size(); i++) {
+			emulator->send(&requests[i][0],requests[i].size(),request_written);
+		}
+	}
+
+	double wall = (stats_now() - start) / 1e9;
+	double cpu = cpu_seconds() - cpu_before;
+	uint64_t allocated = allocations - allocations_before;
+	size_t commands = rounds * requests.size();
+
+	disconnect();
+	delete emulator;
+
+	printf("%-8s %9.0f %10.0f %9s %9s %9s %11.3f %11.1f %7zu\n","emulator",rounds / wall,commands / wall,"-","-","-",
+		cpu * 1e6 / commands,(double)allocated / commands,errors);
+}
+
+static void bench(const std::string &impl, size_t transactions, const char *faults, bool legacy)
+{
+	if(impl == "emulator") {
+		bench_emulator(transactions);
+		return;
+	}
+
+	Transport t;
+	if(!setup(impl,&t)) {
+		printf("%-8s unavailable\n",impl.c_str());
+		return;
+	}
+
+	std::string tag = faults ? "fault:" + impl : impl;
+	Reader *reader = 0;
+	try {
+		reader = new Reader(t.path.empty() ? 0 : t.path.c_str(),115200,PARITY::NONE,tag.c_str());
+	} catch(std::exception &e) {
+		printf("%-8s unavailable: %s\n",impl.c_str(),e.what());
+		return;
+	}
+	if(legacy) reader->set_capabilities(0);
+
+	for(size_t i = 0; i < transactions / 10 + 1; i++) {
+		// lost answers are expected under faults
+		long ret = transaction(reader);
+		if(ret && !faults) {
+			printf("%-8s failed: %08lX\n",impl.c_str(),ret);
+			delete reader;
+			return;
+		}
+	}
+	reader->get_stats().reset();
+
+	uint64_t allocations_before = allocations;
+	double cpu_before = cpu_seconds();
+	uint64_t start = stats_now();
+
+	size_t errors = 0;
+	for(size_t i = 0; i < transactions; i++) {
+		if(transaction(reader)) errors++;
+	}
+
+	double wall = (stats_now() - start) / 1e9;
+	double cpu = cpu_seconds() - cpu_before;
+	uint64_t allocated = allocations - allocations_before;
+
+	// latency of all commands together
+	std::vector<command_stats> stats(512);
+	size_t n = reader->get_stats().snapshot(&stats[0],stats.size());
+	Histogram total;
+	memset(&total,0,sizeof(total));
+	uint64_t commands = 0;
+	for(size_t i = 0; i < n; i++) {
+		uint32_t buckets[STATS_BUCKETS];
+		reader->get_stats().histogram(stats[i].protocol,stats[i].code,STATS_TOTAL,buckets);
+		for(size_t b = 0; b < STATS_BUCKETS; b++) total.buckets[b] += buckets[b];
+		commands += stats[i].count;
+	}
+
+	delete reader;
+
+	if(!commands) return;
+	printf("%-8s %9.0f %10.0f %9.1f %9.1f %9.1f %11.2f %11.1f %7zu\n",impl.c_str(),
+		transactions / wall,commands / wall,
+		total.percentile(50) / 1e3,total.percentile(99) / 1e3,total.percentile(99.9) / 1e3,
+		cpu * 1e6 / commands,(double)allocated / commands,errors);
+}
+
+int main(int argc, char **argv)
+{
+	size_t transactions = 2000;
+	const char *faults = 0;
+	bool legacy = false;
+	std::vector<std::string> transports;
+
+	for(int i = 1; i < argc; i++) {
+		if(std::string(argv[i]) == "-n" && i + 1 < argc) {
+			transactions = strtoul(argv[++i],0,0);
+		} else if(std::string(argv[i]) == "-f" && i + 1 < argc) {
+			faults = argv[++i];
+			setenv("U2_FAULT",faults,1);
+		} else if(std::string(argv[i]) == "-l") {
+			legacy = true;
+		} else {
+			transports.push_back(argv[i]);
+		}
+	}
+
+	if(transports.empty()) {
+		const char *all[] = { "emulator", "file", "unix", "tcp", "asio", "asio-mt", "shm" };
+		transports.assign(all,all + sizeof(all)/sizeof(*all));
+	}
+
+	printf("%-8s %9s %10s %9s %9s %9s %11s %11s %7s\n","impl","tx/s","cmds/s","p50,us","p99,us","p999,us",
+		"cpu,us/cmd","allocs/cmd","errors");
+	for(size_t i = 0; i < transports.size(); i++) {
+		bench(transports[i],transactions,faults,legacy);
+	}
+
+	return 0;
+}
@@ -0,0 +1,435 @@
+// u2d - reader broker daemon.
+//
+// Owns readers through IOProviders and lets many processes share each of them.
+// Clients open "broker" impl with a path of broker socket. Requests of all clients
+// of a device are written to it one at a time: clients of high priority go first,
+// clients of the same priority are served in turns, one request per turn.
+// So high priority client never waits for more than one command being executed.
+//
+// usage: u2d socket impl path baud parity [socket impl path baud parity ...]
+
+#include "protocol.h"
+#include "subway_protocol.h"
+#include "terminal_protocol.h"
+#include "broker.h"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <list>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+using namespace boost;
+
+using boost::asio::local::stream_protocol;
+
+static const int log_level = getenv("DEBUG_U2D") != 0;
+
+class Broker;
+
+struct BrokerRequest
+{
+	std::vector<uint8_t> data;
+	bool answer;
+	size_t timeout;
+	uint32_t seq;
+};
+
+class BrokerClient : public enable_shared_from_this<BrokerClient>
+{
+	Broker *broker;
+
+	uint8_t read_buf[512];
+	std::vector<uint8_t> incoming;
+	std::deque<std::vector<uint8_t> > outgoing;
+
+	void read_callback(size_t bytes_transferred,const system::error_code& error);
+	void write_callback(const system::error_code& error);
+	void handle(BrokerMessage *message, uint8_t *payload);
+	void initiate_write();
+public:
+	stream_protocol::socket socket;
+	uint8_t priority;
+	bool closed;
+	std::deque<BrokerRequest> requests;
+
+	BrokerClient(asio::io_service &io_svc, Broker *_broker)
+		:broker(_broker),socket(io_svc),priority(BROKER_PRIORITY_NORMAL),closed(false) {
+
+	}
+
+	void initiate_read();
+	void write_message(uint8_t type, uint32_t seq, uint32_t error = 0, const void *data = 0, size_t len = 0);
+	void close();
+};
+
+typedef shared_ptr<BrokerClient> client_ptr;
+
+class Broker
+{
+	asio::io_service &io_svc;
+	stream_protocol::acceptor acceptor;
+	IOProvider *device;
+	function<void ()> disconnect;
+
+	std::list<client_ptr> clients;
+
+	// client whose request is being executed now and seq that client gave it
+	client_ptr active;
+	uint32_t active_seq;
+
+	// Sequence number of request on device. Device callbacks carry the number,
+	// so late events of a finished request are ignored.
+	// Fields below up to answer_completed are shared with io thread of device.
+	mutex device_mutex;
+	size_t slot;
+
+	// answer of active request is parsed by protocol of the request,
+	// recognized by the first byte of it; answer_completed stays set until
+	// request is written, bytes that come before that are not its answer
+	uint8_t request_head;
+	SubwayFrameParser subway_parser;
+	TerminalUnbytestaffer terminal_parser;
+	bool answer_completed;
+	std::vector<uint8_t> request_buf;
+
+	void initiate_accept() {
+		client_ptr client(new BrokerClient(io_svc,this));
+		acceptor.async_accept(client->socket,boost::bind(&Broker::accept_callback,this,
+			client,asio::placeholders::error));
+	}
+
+	void accept_callback(client_ptr client, const system::error_code &error) {
+		if(error) {
+			std::cerr << "u2d accept: " << error.message() << std::endl;
+			return;
+		}
+		if(log_level) std::cerr << "u2d: client connected" << std::endl;
+
+		clients.push_back(client);
+		client->initiate_read();
+		initiate_accept();
+	}
+
+	// Picks next client in turn: first one with pending request among clients of
+	// the highest priority present. Chosen client is moved to the end of the list.
+	client_ptr next_client() {
+		std::list<client_ptr>::iterator chosen = clients.end();
+		for(std::list<client_ptr>::iterator i = clients.begin(); i != clients.end(); ++i) {
+			if((*i)->requests.empty()) continue;
+			if(chosen == clients.end() || (*i)->priority < (*chosen)->priority) chosen = i;
+		}
+		if(chosen == clients.end()) return client_ptr();
+
+		client_ptr client = *chosen;
+		clients.erase(chosen);
+		clients.push_back(client);
+		return client;
+	}
+
+	void start_next() {
+		if(active) return;
+
+		active = next_client();
+		if(!active) return;
+
+		BrokerRequest request = active->requests.front();
+		active->requests.pop_front();
+		active_seq = request.seq;
+
+		{
+			mutex::scoped_lock lock(device_mutex);
+			slot++;
+			request_buf.swap(request.data);
+			request_head = request_buf[0];
+			subway_parser.reset();
+			terminal_parser.reset();
+			answer_completed = true;
+		}
+
+		if(log_level) debug_data("u2d request",&request_buf[0],request_buf.size());
+
+		device->send(&request_buf[0],request_buf.size(),
+			boost::bind(&Broker::device_sent,this,slot,request.answer,request.timeout,_1,_2));
+	}
+
+	// Device callbacks below may come from io thread of device, they touch only
+	// answer parsing state under device_mutex. Everything else is posted to broker io_service.
+
+	long device_sent(size_t current, bool answer, size_t timeout, size_t, const system::error_code &error) {
+		io_svc.post(boost::bind(&Broker::sent,this,current,error.value()));
+		if(error) {
+			io_svc.post(boost::bind(&Broker::finish,this,current));
+			return -1;
+		}
+		if(!answer) {
+			io_svc.post(boost::bind(&Broker::finish,this,current));
+			return 1;
+		}
+
+		{
+			mutex::scoped_lock lock(device_mutex);
+			if(current != slot) return 1; // released before it was written
+			answer_completed = false;
+		}
+
+		device->set_timeout(timeout,boost::bind(&Broker::device_timeout,this,current));
+		return 0;
+	}
+
+	void subway_frame(PacketHeader*) {
+		answer_completed = true;
+	}
+
+	// Answer is parsed right here: synchronous "asio" impl reads only until
+	// a listener reports complete answer, so this can't wait for broker io_service.
+	long device_data(void *data, size_t len) {
+		size_t current;
+		bool completed;
+		{
+			mutex::scoped_lock lock(device_mutex);
+			if(answer_completed) {
+				if(log_level) debug_data("u2d unexpected data",data,len);
+				return 0;
+			}
+
+			if(request_head == FBGN) {
+				subway_parser.feed(data,len,boost::bind(&Broker::subway_frame,this,_1));
+			} else if(request_head == FMSTR) {
+				terminal_parser.feed(data,len);
+				answer_completed = terminal_parser.completed();
+			}
+			current = slot;
+			completed = answer_completed;
+		}
+
+		std::vector<uint8_t> bytes((uint8_t*)data,(uint8_t*)data + len);
+		io_svc.post(boost::bind(&Broker::forward,this,current,bytes));
+
+		if(!completed) return 0;
+
+		device->cancel_timeout();
+		io_svc.post(boost::bind(&Broker::finish,this,current));
+		return 1;
+	}
+
+	void device_timeout(size_t current) {
+		io_svc.post(boost::bind(&Broker::timed_out,this,current));
+	}
+
+	void sent(size_t current, int error) {
+		if(current != slot || !active) return;
+		active->write_message(BROKER_SENT,active_seq,error);
+	}
+
+	void forward(size_t current, const std::vector<uint8_t> &bytes) {
+		if(current != slot || !active || bytes.empty()) return;
+		active->write_message(BROKER_DATA,active_seq,0,&bytes[0],bytes.size());
+	}
+
+	void timed_out(size_t current) {
+		if(current != slot || !active) return;
+		active->write_message(BROKER_TIMEOUT,active_seq);
+		finish(current);
+	}
+
+	void finish(size_t current) {
+		if(current != slot || !active) return;
+		active.reset();
+		start_next();
+	}
+
+public:
+	Broker(asio::io_service &_io_svc, const char *socket_path, IOProvider *_device)
+		:io_svc(_io_svc),acceptor(_io_svc),device(_device),active_seq(0),slot(0),request_head(0),answer_completed(true) {
+
+		::unlink(socket_path);
+		stream_protocol::endpoint endpoint(socket_path);
+		acceptor.open(endpoint.protocol());
+		acceptor.bind(endpoint);
+		acceptor.listen();
+
+		disconnect = device->listen(boost::bind(&Broker::device_data,this,_1,_2));
+
+		initiate_accept();
+	}
+
+	~Broker() {
+		disconnect();
+		delete device;
+	}
+
+	void enqueue(BrokerRequest &request, client_ptr client) {
+		client->requests.push_back(request);
+		start_next();
+	}
+
+	// client gave up on its request: the rest of its answer is dropped,
+	// device timeout of it, if armed, fires later with a stale slot
+	void release(client_ptr client, uint32_t seq) {
+		if(client != active || seq != active_seq) return;
+
+		size_t current;
+		{
+			mutex::scoped_lock lock(device_mutex);
+			answer_completed = true;
+			current = slot;
+		}
+		finish(current);
+	}
+
+	// request of a closed client that is on device now is released as well,
+	// nobody waits for its answer
+	void remove(client_ptr client) {
+		client->requests.clear();
+		clients.remove(client);
+		if(client == active) release(client,active_seq);
+	}
+};
+
+void BrokerClient::initiate_read()
+{
+	socket.async_read_some(asio::buffer(read_buf),boost::bind(&BrokerClient::read_callback,
+		shared_from_this(),asio::placeholders::bytes_transferred,asio::placeholders::error));
+}
+
+void BrokerClient::read_callback(size_t bytes_transferred,const system::error_code& error)
+{
+	if(error || !bytes_transferred) {
+		if(log_level) std::cerr << "u2d: client disconnected: " << error.message() << std::endl;
+		close();
+		return;
+	}
+
+	incoming.insert(incoming.end(),read_buf,read_buf + bytes_transferred);
+
+	size_t parsed = 0;
+	while(incoming.size() - parsed >= sizeof(BrokerMessage)) {
+		BrokerMessage *message = (BrokerMessage*)&incoming[parsed];
+		if(message->len > BROKER_MAX_PAYLOAD) {
+			std::cerr << "u2d: message too long: " << message->len << std::endl;
+			close();
+			return;
+		}
+
+		size_t full_size = sizeof(BrokerMessage) + message->len;
+		if(incoming.size() - parsed < full_size) break;
+
+		handle(message,&incoming[parsed] + sizeof(BrokerMessage));
+		parsed += full_size;
+	}
+	incoming.erase(incoming.begin(),incoming.begin() + parsed);
+
+	initiate_read();
+}
+
+void BrokerClient::handle(BrokerMessage *message, uint8_t *payload)
+{
+	switch(message->type) {
+	case BROKER_HELLO:
+		priority = message->priority;
+		break;
+	case BROKER_REQUEST: {
+		if(!message->len) {
+			std::cerr << "u2d: empty request dropped" << std::endl;
+			break;
+		}
+		BrokerRequest request;
+		request.data.assign(payload,payload + message->len);
+		request.answer = message->answer != 0;
+		request.timeout = message->timeout;
+		request.seq = message->seq;
+		broker->enqueue(request,shared_from_this());
+		break;
+	}
+	case BROKER_RELEASE:
+		broker->release(shared_from_this(),message->seq);
+		break;
+	default:
+		std::cerr << "u2d: unknown message " << (int)message->type << std::endl;
+		break;
+	}
+}
+
+void BrokerClient::write_message(uint8_t type, uint32_t seq, uint32_t error, const void *data, size_t len)
+{
+	if(closed) return;
+
+	BrokerMessage header = { type, 0, 0, 0, 0, error, seq, (uint32_t)len };
+	outgoing.push_back(std::vector<uint8_t>(sizeof(header) + len));
+	memcpy(&outgoing.back()[0],&header,sizeof(header));
+	if(len) memcpy(&outgoing.back()[sizeof(header)],data,len);
+
+	if(outgoing.size() == 1) initiate_write();
+}
+
+void BrokerClient::initiate_write()
+{
+	asio::async_write(socket,asio::buffer(outgoing.front()),
+		boost::bind(&BrokerClient::write_callback,shared_from_this(),asio::placeholders::error));
+}
+
+void BrokerClient::write_callback(const system::error_code& error)
+{
+	outgoing.pop_front();
+	if(error) {
+		close();
+		return;
+	}
+	if(!outgoing.empty()) initiate_write();
+}
+
+void BrokerClient::close()
+{
+	if(closed) return;
+	closed = true;
+
+	system::error_code e;
+	socket.close(e);
+	// active request of this client, if any, is released at once
+	broker->remove(shared_from_this());
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 6 || (argc - 1) % 5) {
+		fprintf(stderr,"usage: %s socket impl path baud parity [socket impl path baud parity ...]\n",argv[0]);
+		return 1;
+	}
+
+	asio::io_service io_svc;
+	std::vector<shared_ptr<Broker> > brokers;
+
+	for(int i = 1; i < argc; i += 5) {
+		const char *socket_path = argv[i];
+		const char *impl = argv[i + 1];
+		const char *path = argv[i + 2];
+		uint32_t baud = strtoul(argv[i + 3],0,10);
+		uint8_t parity = (uint8_t)strtoul(argv[i + 4],0,10);
+
+		try {
+			IOProvider *device = get_impl(impl,path,baud,parity);
+			if(!device) {
+				fprintf(stderr,"u2d: unknown impl %s\n",impl);
+				return 1;
+			}
+			brokers.push_back(shared_ptr<Broker>(new Broker(io_svc,socket_path,device)));
+			fprintf(stderr,"u2d: %s[%s] -> %s\n",path,impl,socket_path);
+		} catch(system::system_error &e) {
+			fprintf(stderr,"u2d: %s: %s\n",path,e.what());
+			return 1;
+		}
+	}
+
+	io_svc.run();
+
+	return 0;
+}
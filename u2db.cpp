@@ -0,0 +1,144 @@
+// u2db - card database maintenance (see card_db.h).
+//
+//   u2db db import path...    adds card images (files or directories of them)
+//   u2db db export dir        writes every card to dir/<sn>
+//   u2db db list              prints sn of every card
+//   u2db db generate N        adds N cards with random sn (for tests)
+//   u2db db bench [N]         times N random lookups (1000000 by default)
+//
+// The file emulator serves cards of database directly: pass it as card path.
+
+#include "card_db.h"
+#include "stats.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int.hpp>
+
+using namespace std;
+
+static int usage(const char *name)
+{
+	fprintf(stderr,"usage: %s db import path... | export dir | list | generate N | bench [N]\n",name);
+	return 1;
+}
+
+static long import_image(CardDb &db, const string &path, uint64_t *count)
+{
+	struct stat st;
+	if(stat(path.c_str(),&st) || !S_ISREG(st.st_mode) || st.st_size != sizeof(CardStorage)) return 0;
+
+	CardStorage card;
+	if(card.load(path.c_str())) return 0;
+
+	long ret = db.insert(card);
+	if(!ret) (*count)++;
+	return ret;
+}
+
+static long import(CardDb &db, const char *path, uint64_t *count)
+{
+	struct stat st;
+	if(stat(path,&st)) {
+		fprintf(stderr,"u2db: %s: %s\n",path,strerror(errno));
+		return errno;
+	}
+	if(!S_ISDIR(st.st_mode)) return import_image(db,path,count);
+
+	DIR *dir = opendir(path);
+	if(!dir) return errno;
+	long ret = 0;
+	while(struct dirent *entry = readdir(dir)) {
+		if((ret = import_image(db,string(path) + "/" + entry->d_name,count))) break;
+	}
+	closedir(dir);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 3) return usage(argv[0]);
+
+	const char *command = argv[2];
+	bool writes = !strcmp(command,"import") || !strcmp(command,"generate");
+
+	CardDb db;
+	long ret = db.open(argv[1],writes ? CARD_DB_CREATE : CARD_DB_READONLY);
+	if(ret) {
+		fprintf(stderr,"u2db: %s: %s\n",argv[1],strerror(ret));
+		return 1;
+	}
+
+	if(!strcmp(command,"import") && argc > 3) {
+		uint64_t count = 0;
+		for(int i = 3; i < argc && !ret; i++) ret = import(db,argv[i],&count);
+		printf("%llu cards imported, %llu records\n",(unsigned long long)count,(unsigned long long)db.size());
+	} else if(!strcmp(command,"export") && argc == 4) {
+		for(uint64_t i = 0; i < db.size() && !ret; i++) {
+			if(!db.is_current(i)) continue;
+			string path = string(argv[3]) + "/" + card_db_sn_name(db.get(i)->sn);
+			if(db.get(i)->save(path.c_str())) ret = EIO;
+		}
+	} else if(!strcmp(command,"list") && argc == 3) {
+		for(uint64_t i = 0; i < db.size(); i++) {
+			if(db.is_current(i)) printf("%s\n",card_db_sn_name(db.get(i)->sn).c_str());
+		}
+	} else if(!strcmp(command,"generate") && argc == 4) {
+		uint64_t n = strtoull(argv[3],0,0);
+		boost::mt19937 random;
+		boost::uniform_int<uint64_t> sn(1,(((uint64_t)1) << 56) - 1);
+		CardStorage card;
+		uint64_t start = stats_now();
+		for(uint64_t i = 0; i < n && !ret; i++) {
+			card.sn = sn(random);
+			ret = db.insert(card);
+		}
+		printf("%llu cards generated in %.1f s, %llu records\n",(unsigned long long)n,
+			(stats_now() - start) / 1e9,(unsigned long long)db.size());
+	} else if(!strcmp(command,"bench") && argc <= 4) {
+		uint64_t n = argc == 4 ? strtoull(argv[3],0,0) : 1000000;
+		if(!db.size()) {
+			fprintf(stderr,"u2db: database is empty\n");
+			return 1;
+		}
+
+		// sn are taken from random records beforehand (in file order, that is
+		// much faster on disk), so only lookups are timed
+		boost::mt19937 random;
+		boost::uniform_int<uint64_t> pick(0,db.size() - 1);
+		vector<uint64_t> records(n), sns(n);
+		for(uint64_t i = 0; i < n; i++) records[i] = pick(random);
+		sort(records.begin(),records.end());
+		for(uint64_t i = 0; i < n; i++) sns[i] = db.get(records[i])->sn;
+		for(uint64_t i = n; i > 1; i--) {
+			boost::uniform_int<uint64_t> other(0,i - 1);
+			swap(sns[i - 1],sns[other(random)]);
+		}
+		// reading records may have pushed index pages out of memory
+		db.warm_index();
+
+		uint64_t found = 0;
+		uint64_t start = stats_now();
+		for(uint64_t i = 0; i < n; i++) {
+			if(db.find(sns[i]) != CardDb::CARD_DB_EMPTY) found++;
+		}
+		uint64_t elapsed = stats_now() - start;
+		printf("%llu lookups, %llu found, %.0f ns per lookup\n",(unsigned long long)n,
+			(unsigned long long)found,(double)elapsed / n);
+	} else {
+		return usage(argv[0]);
+	}
+
+	if(ret) fprintf(stderr,"u2db: %s\n",strerror(ret));
+	return ret ? 1 : 0;
+}
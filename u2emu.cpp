@@ -0,0 +1,188 @@
+// u2emu - reader emulator behind a pseudo-terminal.
+//
+// Opens a pty and serves subway frames written to its slave side with file
+// emulator (FileImpl), so serial IOProviders (asio, asio-mt) run their real code:
+// termios setup, reads, timeouts and cancellation, without hardware.
+// Slave path is printed to stdout and optionally symlinked to a stable name.
+//
+// Service time of a command is emulated by a delay before the answer is written:
+//   -t usec       for every command
+//   -t code:usec  for a single command code (hex), overrides the common one
+//   -b baud       adds wire time of the answer at a given baud rate (8N1)
+//
+// card_path is a card image or a directory of them, cards of directory come and go
+// as U2_FIELD says (see card_field.h).
+//
+// usage: u2emu [-t usec] [-t code:usec ...] [-b baud] [-l link] [card_path]
+
+#include "protocol.h"
+#include "subway_protocol.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+
+#include <boost/bind.hpp>
+
+using namespace boost;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int)
+{
+	stopping = 1;
+}
+
+struct Emulator
+{
+	int master;
+	IOProvider *impl;
+	SubwayFrameParser parser;
+
+	long service_time[256]; // microseconds
+	uint32_t baud;
+
+	Emulator():master(-1),impl(0),baud(0) {
+		for(size_t i = 0; i < 256; i++) service_time[i] = 0;
+	}
+};
+
+static void sleep_us(uint64_t us)
+{
+	if(!us) return;
+
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while(nanosleep(&ts,&ts) == -1 && errno == EINTR && !stopping);
+}
+
+static long answer(Emulator *emulator, void *data, size_t len)
+{
+	// start, 8 data bits and stop for every byte
+	if(emulator->baud) sleep_us((uint64_t)len * 10 * 1000000 / emulator->baud);
+
+	uint8_t *p = (uint8_t*)data;
+	while(len) {
+		ssize_t n = write(emulator->master,p,len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			fprintf(stderr,"u2emu: write: %s\n",strerror(errno));
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static void frame(Emulator *emulator, PacketHeader *header)
+{
+	sleep_us(emulator->service_time[header->code]);
+
+	send_frame(emulator->impl,header);
+}
+
+static int usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [-t usec] [-t code:usec ...] [-b baud] [-l link] [card_path]\n",name);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	Emulator emulator;
+	const char *link = 0;
+	const char *card_path = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i],"-t") && i + 1 < argc) {
+			char *colon = strchr(argv[++i],':');
+			if(colon) {
+				unsigned long code = strtoul(argv[i],0,16);
+				if(code > 0xFF) return usage(argv[0]);
+				emulator.service_time[code] = strtol(colon + 1,0,0);
+			} else {
+				long t = strtol(argv[i],0,0);
+				for(size_t code = 0; code < 256; code++) emulator.service_time[code] = t;
+			}
+		} else if(!strcmp(argv[i],"-b") && i + 1 < argc) {
+			emulator.baud = strtoul(argv[++i],0,0);
+		} else if(!strcmp(argv[i],"-l") && i + 1 < argc) {
+			link = argv[++i];
+		} else if(argv[i][0] != '-' && !card_path) {
+			card_path = argv[i];
+		} else {
+			return usage(argv[0]);
+		}
+	}
+
+	emulator.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(emulator.master == -1 || grantpt(emulator.master) || unlockpt(emulator.master)) {
+		fprintf(stderr,"u2emu: pty: %s\n",strerror(errno));
+		return 1;
+	}
+	const char *slave_path = ptsname(emulator.master);
+
+	// Slave is kept open by emulator itself: otherwise master reads fail with EIO
+	// between clients. It is switched to raw mode, so nothing is echoed back
+	// before client configures the port.
+	int slave = open(slave_path,O_RDWR | O_NOCTTY);
+	if(slave == -1) {
+		fprintf(stderr,"u2emu: %s: %s\n",slave_path,strerror(errno));
+		return 1;
+	}
+	struct termios tio;
+	if(tcgetattr(slave,&tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(slave,TCSANOW,&tio);
+	}
+
+	if(link) {
+		unlink(link);
+		if(symlink(slave_path,link)) {
+			fprintf(stderr,"u2emu: symlink %s: %s\n",link,strerror(errno));
+			return 1;
+		}
+	}
+
+	printf("%s\n",slave_path);
+	fflush(stdout);
+
+	emulator.impl = get_impl("file",card_path,0,0);
+	if(!emulator.impl) return 1;
+	emulator.impl->listen(boost::bind(answer,&emulator,_1,_2));
+
+	signal(SIGINT,stop);
+	signal(SIGTERM,stop);
+
+	uint8_t buf[512];
+	struct pollfd p = { emulator.master, POLLIN, 0 };
+	while(!stopping) {
+		if(poll(&p,1,1000) <= 0) continue;
+
+		ssize_t n = read(emulator.master,buf,sizeof(buf));
+		if(n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if(n <= 0) {
+			fprintf(stderr,"u2emu: read: %s\n",n ? strerror(errno) : "end of file");
+			break;
+		}
+		emulator.parser.feed(buf,n,boost::bind(frame,&emulator,_1));
+	}
+
+	if(link) unlink(link);
+	delete emulator.impl;
+	close(slave);
+	close(emulator.master);
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+// u2shm - server side of "shm" IOProvider.
+//
+// Creates shared memory segment with a given name and serves requests that come
+// through it with file emulator (FileImpl), so co-located processes can talk to
+// an emulated reader without sockets in between.
+//
+// usage: u2shm name card_path
+
+#include "protocol.h"
+#include "shm_ring.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+
+#include <sys/mman.h>
+
+#include <boost/bind.hpp>
+
+using namespace boost;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int)
+{
+	stopping = 1;
+}
+
+static long answer(ShmSegment *segment, void *data, size_t len)
+{
+	if(!segment->to_client.write(data,len)) {
+		fprintf(stderr,"u2shm: answer dropped, client ring is full\n");
+		return 1;
+	}
+	segment->to_client.wake();
+	return 1;
+}
+
+static long request_written(size_t, const system::error_code&)
+{
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 3) {
+		fprintf(stderr,"usage: %s name card_path\n",argv[0]);
+		return 1;
+	}
+
+	IOProvider *emulator = get_impl("file",argv[2],0,0);
+
+	shm_unlink(argv[1]);
+	ShmSegment *segment = shm_segment_open(argv[1],true);
+	if(!segment) return 1;
+
+	signal(SIGINT,stop);
+	signal(SIGTERM,stop);
+
+	emulator->listen(boost::bind(answer,segment,_1,_2));
+
+	uint8_t request[SHM_RING_SIZE / 2];
+	while(!stopping) {
+		if(!segment->to_server.wait(1000)) continue;
+		while(uint32_t len = segment->to_server.read(request,sizeof(request))) {
+			emulator->send(request,len,request_written);
+		}
+	}
+
+	shm_segment_close(segment);
+	shm_unlink(argv[1]);
+	delete emulator;
+
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include "protocol.h"
 #include "custom_combiners.h"
+#include "log.h"
 
 #include <iostream>
 #include <iterator>
@@ -20,7 +21,6 @@ using namespace boost;
 
 using boost::asio::local::stream_protocol;
 
-static const int log_level = getenv("DEBUG_UNIX_IMPL") != 0;
 static const size_t connect_timeout = 3000;
 
 class UnixImpl : public IOProvider
@@ -40,7 +40,7 @@ class UnixImpl : public IOProvider
 	{
 		if (error || !bytes_transferred)
 		{
-			if(log_level) std::cerr << "read callback error:" << error << ": " << error.message() << std::endl;
+			U2_DEBUG("read callback error:%i: %s",error.value(),error.message().c_str());
 			return;
 		}
 
@@ -86,7 +86,7 @@ class UnixImpl : public IOProvider
 	//2. read_callback - this callback signals about receiving data and decides what to do next
 	//   by its return value
 	inline void initiate_read() {
-		if(log_level) std::cerr << "initiate_read" << std::endl;
+		U2_DEBUG("initiate_read");
 
 		namespace ph = boost::asio::placeholders;
 		 
@@ -107,17 +107,17 @@ public:
 	}
 
 	void io_service_thread() {
-		if(log_level) std::cerr << "starting io_svc" << std::endl;
+		U2_DEBUG("starting io_svc");
 
 		system::error_code e;
 		io_svc.run(e);
-		if(e) std::cerr << "io_svc: " << e.message() << std::endl;
+		if(e) U2_WARN("io_svc: %s",e.message().c_str());
 		
-		if(log_level) std::cerr << "io_svc[stopped]" << std::endl;
+		U2_DEBUG("io_svc[stopped]");
 		//socket.shutdown(asio::socket_base::shutdown_both);
 		
 		socket.close(e); //socket closed from the same thread as io service
-		if(e) std::cerr << "socket.close() : " << e.message() << std::endl;
+		if(e) U2_WARN("socket.close() : %s",e.message().c_str());
 	}
 
 	virtual ~UnixImpl() {
@@ -133,14 +133,14 @@ public:
 
 static void disconnector(signals2::connection c)
 {
-	if(log_level) std::cerr << "disconnect" << std::endl;
+	U2_DEBUG("disconnect");
 
 	c.disconnect();
 }
 
 function<void ()> UnixImpl::listen(IOProvider::listen_callback callback)
 {
-	if(log_level) std::cerr << "listen" << std::endl;
+	U2_DEBUG("listen");
 
 	signals2::connection c = data_received.connect(callback);
 	return bind(disconnector,c);
@@ -157,7 +157,7 @@ void UnixImpl::send(void *data, size_t len,IOProvider::send_callback callback)
 
 long UnixImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback)
 {
-	if(log_level) std::cerr << "set_timeout" << std::endl;
+	U2_DEBUG("set_timeout");
 
 	this->timeout.expires_from_now(posix_time::milliseconds(timeout));
 	this->timeout.async_wait(bind(&UnixImpl::wait_callback,this,callback,asio::placeholders::error));
@@ -167,7 +167,7 @@ long UnixImpl::set_timeout(size_t timeout, IOProvider::timeout_callback callback
 
 long UnixImpl::cancel_timeout()
 {
-	if(log_level) std::cerr << "cancel_timeout" << std::endl;
+	U2_DEBUG("cancel_timeout");
 
 	this->timeout.cancel();
 